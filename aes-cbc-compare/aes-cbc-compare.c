@@ -0,0 +1,509 @@
+/*
+ * Compare AES-CBC in GnuTLS, OpenSSL and nettle
+ *
+ * Runs the workload of gnutls/test-aes-cbc-parts.c, a buffer encrypted or
+ * decrypted in parts with a single context which carries the IV from one part
+ * to the next, through the three libraries with the same key, IV and data:
+ *  - GnuTLS: gnutls_cipher_encrypt2()/gnutls_cipher_decrypt2();
+ *  - OpenSSL: EVP_EncryptUpdate()/EVP_DecryptUpdate() without padding;
+ *  - nettle: cbc_encrypt()/cbc_decrypt() with the AES functions.
+ *
+ * The output of every library is checked to be byte-identical to the
+ * ciphertext, or plaintext, of a one-shot GnuTLS encryption.
+ *
+ * For each chunk size, the throughput is measured over at least 64M, timing
+ * the whole loop of calls.  The latency of a call is then measured in a
+ * separate pass, timing up to 100000 calls one by one; it includes the cost of
+ * reading the clock (a few tens of ns).
+ *
+ * Build:
+ *     cc -O2 -o aes-cbc-compare aes-cbc-compare.c -lgnutls -lcrypto -lnettle
+ * Usage:
+ *     aes-cbc-compare [--key-size=128|256] [--total=SIZE] [--chunk=SIZE]...
+ *
+ * SIZE accepts the K, M and G suffixes (powers of 1024) and is rounded up to a
+ * multiple of 16.  The default is AES-256, a total of 64M and chunks of 16,
+ * 64, 256, 1K, 16K and 1M.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <gnutls/crypto.h>
+#include <openssl/evp.h>
+#include <nettle/aes.h>
+#include <nettle/cbc.h>
+
+#define BLOCK_SIZE 16
+#define MAX_CHUNKS 16
+/* Each throughput measurement processes at least this many bytes */
+#define MIN_BYTES (64 * 1024 * 1024)
+#define LATENCY_CALLS 100000
+
+struct backend {
+    const char *name;
+    /* Returns a context which encrypts or decrypts from the given IV */
+    void *(*init)(const uint8_t *key, size_t key_len, const uint8_t *iv,
+                  bool encrypt);
+    int (*update)(void *ctx, const uint8_t *in, uint8_t *out, size_t len);
+    void (*deinit)(void *ctx);
+};
+
+/* GnuTLS */
+
+struct gnutls_backend_ctx {
+    gnutls_cipher_hd_t hd;
+    bool encrypt;
+};
+
+static void *gnutls_backend_init(const uint8_t *key, size_t key_len,
+                                 const uint8_t *iv, bool encrypt) {
+
+    struct gnutls_backend_ctx *ctx;
+    gnutls_datum_t key_ctx = {(uint8_t *)key, key_len};
+    gnutls_datum_t iv_ctx = {(uint8_t *)iv, BLOCK_SIZE};
+    int rv;
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    rv = gnutls_cipher_init(&ctx->hd, key_len == 16 ?
+                            GNUTLS_CIPHER_AES_128_CBC :
+                            GNUTLS_CIPHER_AES_256_CBC, &key_ctx, &iv_ctx);
+    if (rv != 0) {
+        fprintf(stderr, "Could not initialize cipher: %s\n",
+                gnutls_strerror(rv));
+        free(ctx);
+        return NULL;
+    }
+    ctx->encrypt = encrypt;
+
+    return ctx;
+}
+
+static int gnutls_backend_update(void *arg, const uint8_t *in, uint8_t *out,
+                                 size_t len) {
+
+    struct gnutls_backend_ctx *ctx = arg;
+
+    if (ctx->encrypt) {
+        return gnutls_cipher_encrypt2(ctx->hd, in, len, out, len);
+    }
+    return gnutls_cipher_decrypt2(ctx->hd, in, len, out, len);
+}
+
+static void gnutls_backend_deinit(void *arg) {
+
+    struct gnutls_backend_ctx *ctx = arg;
+
+    gnutls_cipher_deinit(ctx->hd);
+    free(ctx);
+}
+
+/* OpenSSL */
+
+static void *openssl_backend_init(const uint8_t *key, size_t key_len,
+                                  const uint8_t *iv, bool encrypt) {
+
+    EVP_CIPHER_CTX *ctx;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (EVP_CipherInit_ex(ctx, key_len == 16 ? EVP_aes_128_cbc() :
+                          EVP_aes_256_cbc(), NULL, key, iv, encrypt) != 1 ||
+        EVP_CIPHER_CTX_set_padding(ctx, 0) != 1) {
+        fprintf(stderr, "Could not initialize the OpenSSL cipher\n");
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+static int openssl_backend_update(void *ctx, const uint8_t *in, uint8_t *out,
+                                  size_t len) {
+
+    int out_len;
+
+    /* EVP_EncryptUpdate() and EVP_DecryptUpdate() for the direction set at
+     * initialization */
+    if (len > INT32_MAX ||
+        EVP_CipherUpdate(ctx, out, &out_len, in, (int)len) != 1 ||
+        (size_t)out_len != len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void openssl_backend_deinit(void *ctx) {
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+/* nettle */
+
+struct nettle_backend_ctx {
+    union {
+        struct aes128_ctx aes128;
+        struct aes256_ctx aes256;
+    } aes;
+    nettle_cipher_func *f;
+    uint8_t iv[BLOCK_SIZE];
+    bool encrypt;
+};
+
+static void *nettle_backend_init(const uint8_t *key, size_t key_len,
+                                 const uint8_t *iv, bool encrypt) {
+
+    struct nettle_backend_ctx *ctx;
+
+    ctx = malloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (key_len == 16) {
+        if (encrypt) {
+            aes128_set_encrypt_key(&ctx->aes.aes128, key);
+            ctx->f = (nettle_cipher_func *)aes128_encrypt;
+        } else {
+            aes128_set_decrypt_key(&ctx->aes.aes128, key);
+            ctx->f = (nettle_cipher_func *)aes128_decrypt;
+        }
+    } else {
+        if (encrypt) {
+            aes256_set_encrypt_key(&ctx->aes.aes256, key);
+            ctx->f = (nettle_cipher_func *)aes256_encrypt;
+        } else {
+            aes256_set_decrypt_key(&ctx->aes.aes256, key);
+            ctx->f = (nettle_cipher_func *)aes256_decrypt;
+        }
+    }
+    memcpy(ctx->iv, iv, BLOCK_SIZE);
+    ctx->encrypt = encrypt;
+
+    return ctx;
+}
+
+static int nettle_backend_update(void *arg, const uint8_t *in, uint8_t *out,
+                                 size_t len) {
+
+    struct nettle_backend_ctx *ctx = arg;
+
+    /* The IV is updated in place for the next part */
+    if (ctx->encrypt) {
+        cbc_encrypt(&ctx->aes, ctx->f, BLOCK_SIZE, ctx->iv, len, out, in);
+    } else {
+        cbc_decrypt(&ctx->aes, ctx->f, BLOCK_SIZE, ctx->iv, len, out, in);
+    }
+
+    return 0;
+}
+
+static void nettle_backend_deinit(void *ctx) {
+    free(ctx);
+}
+
+static const struct backend backends[] = {
+    {
+        .name = "gnutls",
+        .init = gnutls_backend_init,
+        .update = gnutls_backend_update,
+        .deinit = gnutls_backend_deinit,
+    },
+    {
+        .name = "openssl",
+        .init = openssl_backend_init,
+        .update = openssl_backend_update,
+        .deinit = openssl_backend_deinit,
+    },
+    {
+        .name = "nettle",
+        .init = nettle_backend_init,
+        .update = nettle_backend_update,
+        .deinit = nettle_backend_deinit,
+    },
+};
+
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static uint64_t now_nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Parse a size with an optional K, M or G suffix; returns 0 if invalid */
+static size_t parse_size(const char *arg) {
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg) {
+        return 0;
+    }
+
+    switch (*end) {
+    case 'G':
+        value *= 1024;
+        /* fall through */
+    case 'M':
+        value *= 1024;
+        /* fall through */
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || value > SIZE_MAX - BLOCK_SIZE) {
+        return 0;
+    }
+
+    return (value + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+/*
+ * Process total bytes from in to out in parts of chunk bytes with a new
+ * context, and return the time taken by the calls in ns, or 0 on error.  If
+ * latencies is not NULL, each of the first nlatencies calls is instead timed
+ * alone into latencies and 1 is returned on success.
+ */
+static uint64_t run(const struct backend *backend, const uint8_t *key,
+                    size_t key_len, const uint8_t *iv, bool encrypt,
+                    const uint8_t *in, uint8_t *out, size_t total,
+                    size_t chunk, uint64_t *latencies, size_t nlatencies) {
+
+    uint64_t start, elapsed = 0;
+    size_t offset, len, call;
+    void *ctx;
+    int rv = 0;
+
+    ctx = backend->init(key, key_len, iv, encrypt);
+    if (ctx == NULL) {
+        return 0;
+    }
+
+    start = now_nsecs();
+    for (offset = 0, call = 0; rv == 0 && offset < total;
+         offset += len, call++) {
+        len = total - offset < chunk ? total - offset : chunk;
+        if (latencies != NULL) {
+            if (call == nlatencies) {
+                break;
+            }
+            start = now_nsecs();
+            rv = backend->update(ctx, in + offset, out + offset, len);
+            latencies[call] = now_nsecs() - start;
+        } else {
+            rv = backend->update(ctx, in + offset, out + offset, len);
+        }
+    }
+    if (latencies == NULL) {
+        elapsed = now_nsecs() - start;
+    }
+
+    backend->deinit(ctx);
+
+    if (rv != 0) {
+        fprintf(stderr, "%s: failed to %s\n", backend->name,
+                encrypt ? "encrypt" : "decrypt");
+        return 0;
+    }
+
+    return latencies != NULL ? 1 : elapsed;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--key-size=128|256] [--total=SIZE] "
+            "[--chunk=SIZE]...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const struct option long_options[] = {
+        {"key-size", required_argument, NULL, 'k'},
+        {"total", required_argument, NULL, 't'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    static const size_t default_chunks[] = {
+        16, 64, 256, 1024, 16 * 1024, 1024 * 1024,
+    };
+
+    size_t chunks[MAX_CHUNKS];
+    size_t nchunks = 0;
+    size_t key_len = 32;
+    size_t total = 64 * 1024 * 1024;
+    uint8_t key[32];
+    uint8_t iv[BLOCK_SIZE];
+    uint8_t *plain = NULL, *cipher = NULL, *out = NULL;
+    uint64_t *latencies = NULL;
+    const uint8_t *in, *expected;
+    unsigned int iterations, it;
+    uint64_t elapsed, ns;
+    size_t nlatencies, c, b, i;
+    char name[32];
+    bool identical;
+    int encrypt;
+    int opt;
+    int rv = -1;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'k':
+            if (strcmp(optarg, "128") == 0) {
+                key_len = 16;
+            } else if (strcmp(optarg, "256") == 0) {
+                key_len = 32;
+            } else {
+                fprintf(stderr, "Invalid key size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 't':
+            total = parse_size(optarg);
+            if (total == 0) {
+                fprintf(stderr, "Invalid total size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'c':
+            if (nchunks == MAX_CHUNKS) {
+                fprintf(stderr, "Too many chunk sizes\n");
+                return -1;
+            }
+            chunks[nchunks] = parse_size(optarg);
+            if (chunks[nchunks] == 0) {
+                fprintf(stderr, "Invalid chunk size %s\n", optarg);
+                return -1;
+            }
+            nchunks++;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (nchunks == 0) {
+        for (c = 0; c < sizeof(default_chunks) / sizeof(default_chunks[0]);
+             c++) {
+            chunks[nchunks++] = default_chunks[c];
+        }
+    }
+
+    gnutls_global_init();
+
+    plain = malloc(total);
+    cipher = malloc(total);
+    out = malloc(total);
+    latencies = malloc(LATENCY_CALLS * sizeof(*latencies));
+    if (plain == NULL || cipher == NULL || out == NULL || latencies == NULL) {
+        fprintf(stderr, "Could not allocate %zu bytes\n", total);
+        goto error;
+    }
+
+    if (gnutls_rnd(GNUTLS_RND_KEY, key, sizeof(key)) != 0 ||
+        gnutls_rnd(GNUTLS_RND_NONCE, iv, sizeof(iv)) != 0) {
+        fprintf(stderr, "Could not generate key\n");
+        goto error;
+    }
+
+    for (i = 0; i < total; i++) {
+        plain[i] = i % 0x100;
+    }
+
+    /* Reference ciphertext, in one call */
+    if (run(&backends[0], key, key_len, iv, true, plain, cipher, total, total,
+            NULL, 0) == 0) {
+        goto error;
+    }
+
+    iterations = total < MIN_BYTES ? (MIN_BYTES + total - 1) / total : 1;
+
+    printf("%-12s %-7s %8s %-8s %9s %8s %8s %9s\n", "cipher", "op", "chunk",
+           "library", "MB/s", "p50 ns", "p99 ns", "identical");
+
+    for (encrypt = 1; encrypt >= 0; encrypt--) {
+        in = encrypt ? plain : cipher;
+        expected = encrypt ? cipher : plain;
+
+        for (c = 0; c < nchunks; c++) {
+            for (b = 0; b < NBACKENDS; b++) {
+                elapsed = 0;
+                for (it = 0; it < iterations; it++) {
+                    memset(out, 0, total);
+                    ns = run(&backends[b], key, key_len, iv, encrypt, in, out,
+                             total, chunks[c], NULL, 0);
+                    if (ns == 0) {
+                        goto error;
+                    }
+                    elapsed += ns;
+                }
+                identical = memcmp(out, expected, total) == 0;
+
+                nlatencies = (total + chunks[c] - 1) / chunks[c];
+                if (nlatencies > LATENCY_CALLS) {
+                    nlatencies = LATENCY_CALLS;
+                }
+                if (run(&backends[b], key, key_len, iv, encrypt, in, out,
+                        total, chunks[c], latencies, nlatencies) == 0) {
+                    goto error;
+                }
+                qsort(latencies, nlatencies, sizeof(*latencies), compare_u64);
+
+                snprintf(name, sizeof(name), "AES-%zu-CBC", key_len * 8);
+                printf("%-12s %-7s %8zu %-8s %9.1f %8llu %8llu %9s\n", name,
+                       encrypt ? "encrypt" : "decrypt", chunks[c],
+                       backends[b].name,
+                       (double)total * iterations / elapsed * 1e3,
+                       (unsigned long long)latencies[nlatencies / 2],
+                       (unsigned long long)latencies[nlatencies * 99 / 100],
+                       identical ? "yes" : "NO");
+                if (!identical) {
+                    fprintf(stderr, "%s: the %s output differs from "
+                            "GnuTLS\n", backends[b].name,
+                            encrypt ? "encrypt" : "decrypt");
+                    goto error;
+                }
+            }
+        }
+    }
+
+    rv = 0;
+
+error:
+    free(plain);
+    free(cipher);
+    free(out);
+    free(latencies);
+    gnutls_global_deinit();
+    return rv;
+}
@@ -0,0 +1,386 @@
+/*
+ * Encrypt or decrypt a file in place with AES-CBC using GnuTLS
+ *
+ * The file is mapped in memory and processed where it is, without copying it
+ * to the heap.  Encryption is serial: like in test-aes-cbc-parts.c, a single
+ * context is used to encrypt the file in parts and carries the IV from one
+ * part to the next.  The file is padded as in PKCS#7, so it grows by 1 to 16
+ * bytes.
+ *
+ * Decryption is parallel: the plaintext of a CBC block only depends on the
+ * block and on the previous ciphertext block.  The file is split in one
+ * segment per thread, each segment is decrypted by its own context initialized
+ * with the last ciphertext block of the previous segment as IV.  Those blocks
+ * are saved before any thread starts, as decrypting in place overwrites them.
+ *
+ * Build:
+ *     cc -O2 -o aes-cbc-file aes-cbc-file.c -lgnutls -lpthread
+ * Usage:
+ *     aes-cbc-file encrypt|decrypt --key=HEX --iv=HEX [--threads=N] FILE
+ *
+ * The key is 16, 24 or 32 bytes for AES-128, AES-192 or AES-256 and the IV 16
+ * bytes, both in hexadecimal.  Decryption uses all the CPUs the process may
+ * run on by default; --threads=1 gives the serial path.  The time taken is
+ * printed on the standard error.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gnutls/crypto.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BLOCK_SIZE 16
+/* Size of the parts passed to gnutls_cipher_encrypt2()/decrypt2() */
+#define PART_SIZE (16 * 1024 * 1024)
+#define CACHE_LINE 64
+
+/* Each thread writes only its own segment, aligned so that two threads never
+ * share a cache line */
+struct segment {
+    pthread_t thread;
+    bool started;
+    gnutls_cipher_algorithm_t cipher;
+    gnutls_datum_t *key_ctx;
+    uint8_t iv[BLOCK_SIZE];
+    uint8_t *data;
+    size_t len;
+    int rv;
+} __attribute__((aligned(CACHE_LINE)));
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse len bytes of hexadecimal; returns the number of bytes or -1 */
+static int parse_hex(const char *hex, uint8_t *out, size_t len) {
+    size_t i;
+    unsigned int byte;
+
+    for (i = 0; i < len && hex[0] != '\0' && hex[1] != '\0'; i++, hex += 2) {
+        if (sscanf(hex, "%2x", &byte) != 1) {
+            return -1;
+        }
+        out[i] = byte;
+    }
+
+    return hex[0] == '\0' ? (int)i : -1;
+}
+
+/* Encrypt or decrypt data in place, in parts, with a single context */
+static int cipher_parts(gnutls_cipher_algorithm_t cipher,
+                        gnutls_datum_t *key_ctx, uint8_t *iv, bool encrypt,
+                        uint8_t *data, size_t len) {
+
+    gnutls_cipher_hd_t ctx;
+    gnutls_datum_t iv_ctx;
+    size_t offset, part;
+    int rv;
+
+    iv_ctx.data = iv;
+    iv_ctx.size = BLOCK_SIZE;
+
+    rv = gnutls_cipher_init(&ctx, cipher, key_ctx, &iv_ctx);
+    if (rv != 0) {
+        fprintf(stderr, "Could not initialize cipher: %s\n",
+                gnutls_strerror(rv));
+        return -1;
+    }
+
+    for (offset = 0; offset < len; offset += part) {
+        part = len - offset < PART_SIZE ? len - offset : PART_SIZE;
+        if (encrypt) {
+            rv = gnutls_cipher_encrypt2(ctx, data + offset, part,
+                                        data + offset, part);
+        } else {
+            rv = gnutls_cipher_decrypt2(ctx, data + offset, part,
+                                        data + offset, part);
+        }
+        if (rv != 0) {
+            fprintf(stderr, "Failed to %s: %s\n",
+                    encrypt ? "encrypt" : "decrypt", gnutls_strerror(rv));
+            break;
+        }
+    }
+
+    gnutls_cipher_deinit(ctx);
+    return rv != 0 ? -1 : 0;
+}
+
+static void *decrypt_segment(void *arg) {
+
+    struct segment *segment = arg;
+
+    madvise(segment->data, segment->len, MADV_SEQUENTIAL);
+    segment->rv = cipher_parts(segment->cipher, segment->key_ctx,
+                               segment->iv, false, segment->data,
+                               segment->len);
+    return NULL;
+}
+
+static int decrypt_parallel(gnutls_cipher_algorithm_t cipher,
+                            gnutls_datum_t *key_ctx, uint8_t *iv,
+                            uint8_t *data, size_t len, long nthreads) {
+
+    struct segment *segments;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t offset, seglen;
+    long nsegments, i;
+    int rv = 0;
+
+    /* Segments start on a page boundary, which is also a block boundary, so
+     * that two threads never write to the same page */
+    seglen = (len / nthreads + page - 1) / page * page;
+    if (seglen == 0) {
+        seglen = page;
+    }
+    nsegments = (len + seglen - 1) / seglen;
+
+    segments = aligned_alloc(CACHE_LINE, nsegments * sizeof(*segments));
+    if (segments == NULL) {
+        fprintf(stderr, "Could not allocate the segments\n");
+        return -1;
+    }
+
+    /* Save the IV of every segment before any of them is decrypted */
+    for (i = 0, offset = 0; i < nsegments; i++, offset += seglen) {
+        segments[i].cipher = cipher;
+        segments[i].key_ctx = key_ctx;
+        memcpy(segments[i].iv, i == 0 ? iv : data + offset - BLOCK_SIZE,
+               BLOCK_SIZE);
+        segments[i].data = data + offset;
+        segments[i].len = len - offset < seglen ? len - offset : seglen;
+        segments[i].rv = 0;
+        segments[i].started = false;
+    }
+
+    for (i = 0; i < nsegments; i++) {
+        rv = pthread_create(&segments[i].thread, NULL, decrypt_segment,
+                            &segments[i]);
+        if (rv != 0) {
+            fprintf(stderr, "Could not create thread: %s\n", strerror(rv));
+            /* Decrypt it here; the segments are independent */
+            decrypt_segment(&segments[i]);
+        } else {
+            segments[i].started = true;
+        }
+    }
+
+    rv = 0;
+    for (i = 0; i < nsegments; i++) {
+        if (segments[i].started) {
+            pthread_join(segments[i].thread, NULL);
+        }
+        if (segments[i].rv != 0) {
+            rv = -1;
+        }
+    }
+
+    free(segments);
+    return rv;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s encrypt|decrypt --key=HEX --iv=HEX "
+            "[--threads=N] FILE\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const struct option long_options[] = {
+        {"key", required_argument, NULL, 'k'},
+        {"iv", required_argument, NULL, 'i'},
+        {"threads", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    gnutls_cipher_algorithm_t cipher;
+    gnutls_datum_t key_ctx;
+    cpu_set_t allowed;
+    struct stat st;
+    uint8_t key[32];
+    uint8_t iv[BLOCK_SIZE];
+    int key_len = -1;
+    int iv_len = -1;
+    long nthreads = 0;
+    bool encrypt;
+    const char *path;
+    uint8_t *data = MAP_FAILED;
+    size_t len = 0;
+    size_t pad = 0, i;
+    double start, elapsed;
+    int fd = -1;
+    int opt;
+    int rv = -1;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'k':
+            key_len = parse_hex(optarg, key, sizeof(key));
+            break;
+        case 'i':
+            iv_len = parse_hex(optarg, iv, sizeof(iv));
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            if (nthreads <= 0) {
+                fprintf(stderr, "Invalid number of threads %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind + 2 != argc ||
+        (strcmp(argv[optind], "encrypt") != 0 &&
+         strcmp(argv[optind], "decrypt") != 0)) {
+        usage(argv[0]);
+        return -1;
+    }
+    encrypt = strcmp(argv[optind], "encrypt") == 0;
+    path = argv[optind + 1];
+
+    switch (key_len) {
+    case 16:
+        cipher = GNUTLS_CIPHER_AES_128_CBC;
+        break;
+    case 24:
+        cipher = GNUTLS_CIPHER_AES_192_CBC;
+        break;
+    case 32:
+        cipher = GNUTLS_CIPHER_AES_256_CBC;
+        break;
+    default:
+        fprintf(stderr, "The key must be 16, 24 or 32 bytes in hex\n");
+        return -1;
+    }
+    if (iv_len != BLOCK_SIZE) {
+        fprintf(stderr, "The IV must be 16 bytes in hex\n");
+        return -1;
+    }
+
+    if (nthreads == 0) {
+        nthreads = 1;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            nthreads = CPU_COUNT(&allowed);
+        }
+    }
+
+    key_ctx.data = key;
+    key_ctx.size = key_len;
+
+    gnutls_global_init();
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open file %s: %s\n", path,
+                strerror(errno));
+        goto error;
+    }
+    len = st.st_size;
+
+    if (encrypt) {
+        /* Grow the file for the padding before mapping it */
+        pad = BLOCK_SIZE - len % BLOCK_SIZE;
+        if (ftruncate(fd, len + pad) != 0) {
+            fprintf(stderr, "Could not extend file %s: %s\n", path,
+                    strerror(errno));
+            goto error;
+        }
+        len += pad;
+    } else if (len == 0 || len % BLOCK_SIZE != 0) {
+        fprintf(stderr, "The size of %s is not a multiple of %d\n", path,
+                BLOCK_SIZE);
+        goto error;
+    }
+
+    data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map file %s: %s\n", path, strerror(errno));
+        if (encrypt) {
+            /* Remove the padding */
+            ftruncate(fd, len - pad);
+        }
+        goto error;
+    }
+
+    start = now();
+    if (encrypt) {
+        memset(data + len - pad, pad, pad);
+        madvise(data, len, MADV_SEQUENTIAL);
+        rv = cipher_parts(cipher, &key_ctx, iv, true, data, len);
+        nthreads = 1;
+    } else if (nthreads == 1) {
+        madvise(data, len, MADV_SEQUENTIAL);
+        rv = cipher_parts(cipher, &key_ctx, iv, false, data, len);
+    } else {
+        rv = decrypt_parallel(cipher, &key_ctx, iv, data, len, nthreads);
+    }
+    elapsed = now() - start;
+    if (rv != 0) {
+        goto error;
+    }
+
+    fprintf(stderr, "%s %zu bytes in %.3f s (%.1f MB/s) with %ld "
+            "thread%s\n", encrypt ? "Encrypted" : "Decrypted", len,
+            elapsed, len / elapsed / 1e6, nthreads, nthreads > 1 ? "s" : "");
+
+    if (!encrypt) {
+        /* Check and remove the padding */
+        pad = data[len - 1];
+        for (i = 1; i <= pad && pad <= BLOCK_SIZE; i++) {
+            if (data[len - i] != pad) {
+                break;
+            }
+        }
+        if (pad == 0 || pad > BLOCK_SIZE || i <= pad) {
+            fprintf(stderr, "Invalid padding, wrong key or IV?\n");
+            rv = -1;
+            goto error;
+        }
+
+        munmap(data, len);
+        data = MAP_FAILED;
+        if (ftruncate(fd, len - pad) != 0) {
+            fprintf(stderr, "Could not truncate file %s: %s\n", path,
+                    strerror(errno));
+            rv = -1;
+            goto error;
+        }
+    }
+
+    rv = 0;
+
+error:
+    if (data != MAP_FAILED) {
+        munmap(data, len);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    gnutls_global_deinit();
+    return rv;
+}
@@ -0,0 +1,677 @@
+/*
+ * Pool of GnuTLS cipher contexts for many small messages
+ *
+ * gnutls_cipher_init() allocates a context and expands the key every time it
+ * is called.  When millions of small messages are encrypted under a few keys,
+ * this dominates the cost of the encryption itself.  The pool keeps the
+ * contexts of each (algorithm, key) once they are released, and hands them out
+ * again after only setting the IV of the next message with
+ * gnutls_cipher_set_iv(), like test-aes-cbc-parts.c relies on the context to
+ * carry the IV from one part to the next.
+ *
+ * A pool is not thread-safe; use one pool per thread.  The keys are kept in
+ * the pool, which wipes them when it is freed.
+ *
+ * The program benchmarks, for packets of 64 to 1500 bytes encrypted under
+ * --keys keys with a new IV per packet:
+ *  - reinit: gnutls_cipher_init() and gnutls_cipher_deinit() per packet;
+ *  - pool: a context from the pool per packet;
+ *  - aead: for AEAD ciphers, gnutls_aead_cipher_encrypt() per packet with one
+ *    gnutls_aead_cipher_hd_t per key;
+ *  - one-shot: all the packets encrypted by a single call, without IV or tag,
+ *    the cost of the cipher alone.
+ * The ciphertexts and tags of reinit, pool and aead are checked to be the
+ * same.
+ *
+ * Build:
+ *     cc -O2 -o cipher-ctx-pool cipher-ctx-pool.c -lgnutls
+ * Usage:
+ *     cipher-ctx-pool [--cipher=NAME]... [--size=BYTES]... [--keys=N]
+ *                     [--messages=N]
+ *
+ * The defaults are AES-128-CBC, AES-256-CBC, AES-128-GCM and AES-256-GCM,
+ * packets of 64, 128, 256, 512, 1024 and 1500 bytes (rounded up to a multiple
+ * of the block size for CBC), 4 keys and 1000000 packets per measurement.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#define MAX_KEY_SIZE 64
+#define MAX_IV_SIZE 16
+#define TAG_SIZE 16
+
+/* Contexts of one (algorithm, key) */
+struct cipher_ctx_entry {
+    gnutls_cipher_algorithm_t algo;
+    uint8_t key[MAX_KEY_SIZE];
+    unsigned int key_size;
+    /* Released contexts, ready to be handed out */
+    struct cipher_ctx *free;
+    unsigned int nfree;
+};
+
+struct cipher_ctx {
+    gnutls_cipher_hd_t hd;
+    struct cipher_ctx_entry *entry;
+    struct cipher_ctx *next;
+};
+
+struct cipher_ctx_pool {
+    /* Open addressing hash table of entries, size is a power of 2 */
+    struct cipher_ctx_entry **entries;
+    size_t size;
+    size_t count;
+    /* Released contexts kept per entry; the others are freed */
+    unsigned int max_free;
+};
+
+/**
+ * @brief Create a pool which keeps up to max_free released contexts per
+ * (algorithm, key).
+ *
+ * @returns The pool; NULL if out of memory
+ */
+static struct cipher_ctx_pool *cipher_ctx_pool_new(unsigned int max_free) {
+
+    struct cipher_ctx_pool *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->size = 16;
+    pool->entries = calloc(pool->size, sizeof(*pool->entries));
+    if (pool->entries == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->max_free = max_free;
+
+    return pool;
+}
+
+/**
+ * @brief Free the pool, its released contexts and the keys.  The contexts
+ * still in use must be released before.
+ */
+static void cipher_ctx_pool_free(struct cipher_ctx_pool *pool) {
+
+    struct cipher_ctx_entry *entry;
+    struct cipher_ctx *ctx;
+    size_t i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    for (i = 0; i < pool->size; i++) {
+        entry = pool->entries[i];
+        if (entry == NULL) {
+            continue;
+        }
+        while ((ctx = entry->free) != NULL) {
+            entry->free = ctx->next;
+            gnutls_cipher_deinit(ctx->hd);
+            free(ctx);
+        }
+        gnutls_memset(entry->key, 0, sizeof(entry->key));
+        free(entry);
+    }
+
+    free(pool->entries);
+    free(pool);
+}
+
+static size_t cipher_ctx_pool_hash(gnutls_cipher_algorithm_t algo,
+                                   const gnutls_datum_t *key) {
+
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL ^ algo;
+    unsigned int i;
+
+    for (i = 0; i < key->size; i++) {
+        h = (h ^ key->data[i]) * 0x100000001b3ULL;
+    }
+
+    return (size_t)(h ^ (h >> 32));
+}
+
+/* Find the slot of (algo, key), or the empty slot where to add it */
+static size_t cipher_ctx_pool_slot(struct cipher_ctx_entry **entries,
+                                   size_t size,
+                                   gnutls_cipher_algorithm_t algo,
+                                   const gnutls_datum_t *key) {
+
+    struct cipher_ctx_entry *entry;
+    size_t i = cipher_ctx_pool_hash(algo, key) & (size - 1);
+
+    for (;;) {
+        entry = entries[i];
+        if (entry == NULL ||
+            (entry->algo == algo && entry->key_size == key->size &&
+             memcmp(entry->key, key->data, key->size) == 0)) {
+            return i;
+        }
+        i = (i + 1) & (size - 1);
+    }
+}
+
+static struct cipher_ctx_entry *
+cipher_ctx_pool_entry(struct cipher_ctx_pool *pool,
+                      gnutls_cipher_algorithm_t algo,
+                      const gnutls_datum_t *key) {
+
+    struct cipher_ctx_entry **entries, *entry;
+    size_t size, i, slot;
+
+    if (key->size > MAX_KEY_SIZE) {
+        return NULL;
+    }
+
+    slot = cipher_ctx_pool_slot(pool->entries, pool->size, algo, key);
+    if (pool->entries[slot] != NULL) {
+        return pool->entries[slot];
+    }
+
+    /* Keep the table at most half full */
+    if ((pool->count + 1) * 2 > pool->size) {
+        size = pool->size * 2;
+        entries = calloc(size, sizeof(*entries));
+        if (entries == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < pool->size; i++) {
+            entry = pool->entries[i];
+            if (entry != NULL) {
+                gnutls_datum_t k = {entry->key, entry->key_size};
+
+                entries[cipher_ctx_pool_slot(entries, size, entry->algo,
+                                             &k)] = entry;
+            }
+        }
+        free(pool->entries);
+        pool->entries = entries;
+        pool->size = size;
+        slot = cipher_ctx_pool_slot(pool->entries, pool->size, algo, key);
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->algo = algo;
+    memcpy(entry->key, key->data, key->size);
+    entry->key_size = key->size;
+
+    pool->entries[slot] = entry;
+    pool->count++;
+
+    return entry;
+}
+
+/**
+ * @brief Get a context for the given algorithm and key, set to the given IV.
+ *
+ * A released context of the same (algorithm, key) is reused if there is one,
+ * otherwise a new one is initialized.
+ *
+ * @returns 0 on success; a negative GnuTLS error code otherwise
+ */
+static int cipher_ctx_pool_get(struct cipher_ctx_pool *pool,
+                               gnutls_cipher_algorithm_t algo,
+                               const gnutls_datum_t *key,
+                               const gnutls_datum_t *iv,
+                               struct cipher_ctx **out) {
+
+    struct cipher_ctx_entry *entry;
+    struct cipher_ctx *ctx;
+    int rv;
+
+    entry = cipher_ctx_pool_entry(pool, algo, key);
+    if (entry == NULL) {
+        return key->size > MAX_KEY_SIZE ? GNUTLS_E_INVALID_REQUEST :
+                                          GNUTLS_E_MEMORY_ERROR;
+    }
+
+    ctx = entry->free;
+    if (ctx != NULL) {
+        entry->free = ctx->next;
+        entry->nfree--;
+        gnutls_cipher_set_iv(ctx->hd, iv->data, iv->size);
+    } else {
+        ctx = malloc(sizeof(*ctx));
+        if (ctx == NULL) {
+            return GNUTLS_E_MEMORY_ERROR;
+        }
+        rv = gnutls_cipher_init(&ctx->hd, algo, key, iv);
+        if (rv != 0) {
+            free(ctx);
+            return rv;
+        }
+        ctx->entry = entry;
+    }
+
+    ctx->next = NULL;
+    *out = ctx;
+    return 0;
+}
+
+/**
+ * @brief Release a context got from cipher_ctx_pool_get().
+ */
+static void cipher_ctx_pool_put(struct cipher_ctx_pool *pool,
+                                struct cipher_ctx *ctx) {
+
+    struct cipher_ctx_entry *entry = ctx->entry;
+
+    if (entry->nfree >= pool->max_free) {
+        gnutls_cipher_deinit(ctx->hd);
+        free(ctx);
+        return;
+    }
+
+    ctx->next = entry->free;
+    entry->free = ctx;
+    entry->nfree++;
+}
+
+/* Benchmark */
+
+#define MAX_CIPHERS 16
+#define MAX_SIZES 16
+#define MAX_KEYS 256
+/* Number of packet buffers, so that the data stays in the cache */
+#define SLOTS 256
+
+enum bench_mode {
+    BENCH_REINIT,
+    BENCH_POOL,
+    BENCH_AEAD,
+    BENCH_ONESHOT,
+};
+
+static const char *bench_mode_names[] = {
+    [BENCH_REINIT] = "reinit",
+    [BENCH_POOL] = "pool",
+    [BENCH_AEAD] = "aead",
+    [BENCH_ONESHOT] = "one-shot",
+};
+
+struct bench {
+    gnutls_cipher_algorithm_t cipher;
+    bool aead;
+    size_t size;
+    unsigned int nkeys;
+    unsigned long nmessages;
+    gnutls_datum_t keys[MAX_KEYS];
+    uint8_t *in;
+    uint8_t *out;
+    uint8_t *tags;
+    struct cipher_ctx_pool *pool;
+    gnutls_aead_cipher_hd_t aead_hds[MAX_KEYS];
+};
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The IV of a message is its number */
+static void bench_iv(uint8_t *iv, unsigned long i) {
+    memset(iv, 0, MAX_IV_SIZE);
+    memcpy(iv, &i, sizeof(i));
+}
+
+static int bench_message(struct bench *b, enum bench_mode mode,
+                         unsigned long i) {
+
+    uint8_t iv[MAX_IV_SIZE];
+    gnutls_datum_t iv_ctx = {iv, gnutls_cipher_get_iv_size(b->cipher)};
+    gnutls_datum_t *key = &b->keys[i % b->nkeys];
+    uint8_t *in = b->in + (i % SLOTS) * b->size;
+    uint8_t *out = b->out + (i % SLOTS) * (b->size + TAG_SIZE);
+    uint8_t *tag = b->tags + (i % SLOTS) * TAG_SIZE;
+    gnutls_cipher_hd_t hd;
+    struct cipher_ctx *ctx;
+    size_t out_len;
+    int rv;
+
+    bench_iv(iv, i);
+
+    switch (mode) {
+    case BENCH_REINIT:
+        rv = gnutls_cipher_init(&hd, b->cipher, key, &iv_ctx);
+        if (rv != 0) {
+            return rv;
+        }
+        rv = gnutls_cipher_encrypt2(hd, in, b->size, out, b->size);
+        if (rv == 0 && b->aead) {
+            rv = gnutls_cipher_tag(hd, tag, TAG_SIZE);
+        }
+        gnutls_cipher_deinit(hd);
+        return rv;
+    case BENCH_POOL:
+        rv = cipher_ctx_pool_get(b->pool, b->cipher, key, &iv_ctx, &ctx);
+        if (rv != 0) {
+            return rv;
+        }
+        rv = gnutls_cipher_encrypt2(ctx->hd, in, b->size, out, b->size);
+        if (rv == 0 && b->aead) {
+            rv = gnutls_cipher_tag(ctx->hd, tag, TAG_SIZE);
+        }
+        cipher_ctx_pool_put(b->pool, ctx);
+        return rv;
+    case BENCH_AEAD:
+        /* The tag follows the ciphertext */
+        out_len = b->size + TAG_SIZE;
+        rv = gnutls_aead_cipher_encrypt(b->aead_hds[i % b->nkeys], iv,
+                                        iv_ctx.size, NULL, 0, TAG_SIZE, in,
+                                        b->size, out, &out_len);
+        if (rv == 0) {
+            memcpy(tag, out + b->size, TAG_SIZE);
+        }
+        return rv;
+    default:
+        return GNUTLS_E_INVALID_REQUEST;
+    }
+}
+
+/* Encrypt all the packets as one buffer in a single call */
+static int bench_oneshot(struct bench *b) {
+
+    uint8_t iv[MAX_IV_SIZE];
+    gnutls_datum_t iv_ctx = {iv, gnutls_cipher_get_iv_size(b->cipher)};
+    gnutls_cipher_hd_t hd;
+    unsigned long done;
+    size_t len;
+    int rv;
+
+    bench_iv(iv, 0);
+    rv = gnutls_cipher_init(&hd, b->cipher, &b->keys[0], &iv_ctx);
+    if (rv != 0) {
+        return rv;
+    }
+
+    for (done = 0; rv == 0 && done < b->nmessages; done += SLOTS) {
+        len = (b->nmessages - done < SLOTS ? b->nmessages - done : SLOTS) *
+              b->size;
+        rv = gnutls_cipher_encrypt2(hd, b->in, len, b->out, len);
+    }
+
+    gnutls_cipher_deinit(hd);
+    return rv;
+}
+
+static int bench_run(struct bench *b, enum bench_mode mode, double *secs) {
+
+    double start;
+    unsigned long i;
+    int rv = 0;
+
+    start = now();
+    if (mode == BENCH_ONESHOT) {
+        rv = bench_oneshot(b);
+    } else {
+        for (i = 0; rv == 0 && i < b->nmessages; i++) {
+            rv = bench_message(b, mode, i);
+        }
+    }
+    *secs = now() - start;
+
+    if (rv != 0) {
+        fprintf(stderr, "%s %s: %s\n", gnutls_cipher_get_name(b->cipher),
+                bench_mode_names[mode], gnutls_strerror(rv));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bench_cipher(gnutls_cipher_algorithm_t cipher, const size_t *sizes,
+                        size_t nsizes, unsigned int nkeys,
+                        unsigned long nmessages) {
+
+    struct bench b;
+    uint8_t key_data[MAX_KEYS][MAX_KEY_SIZE];
+    uint8_t *reference = NULL, *reference_tags = NULL;
+    size_t block, s, i;
+    double secs, reinit_secs = 0;
+    int mode;
+    int rv = -1;
+
+    memset(&b, 0, sizeof(b));
+    b.cipher = cipher;
+    b.aead = gnutls_cipher_get_tag_size(cipher) > 0;
+    b.nkeys = nkeys;
+    b.nmessages = nmessages;
+
+    for (i = 0; i < nkeys; i++) {
+        if (gnutls_rnd(GNUTLS_RND_KEY, key_data[i], MAX_KEY_SIZE) != 0) {
+            fprintf(stderr, "Could not generate key\n");
+            return -1;
+        }
+        b.keys[i].data = key_data[i];
+        b.keys[i].size = gnutls_cipher_get_key_size(cipher);
+
+        if (b.aead) {
+            rv = gnutls_aead_cipher_init(&b.aead_hds[i], cipher, &b.keys[i]);
+            if (rv != 0) {
+                fprintf(stderr, "Could not initialize %s: %s\n",
+                        gnutls_cipher_get_name(cipher), gnutls_strerror(rv));
+                nkeys = i;
+                rv = -1;
+                goto end;
+            }
+        }
+    }
+    rv = -1;
+
+    b.pool = cipher_ctx_pool_new(4);
+    if (b.pool == NULL) {
+        goto end;
+    }
+
+    for (s = 0; s < nsizes; s++) {
+        b.size = sizes[s];
+        if (!b.aead) {
+            /* CBC only encrypts whole blocks */
+            block = gnutls_cipher_get_block_size(cipher);
+            b.size = (b.size + block - 1) / block * block;
+        }
+
+        free(b.in);
+        free(b.out);
+        free(b.tags);
+        free(reference);
+        free(reference_tags);
+        b.in = malloc(SLOTS * b.size);
+        b.out = malloc(SLOTS * (b.size + TAG_SIZE));
+        b.tags = calloc(SLOTS, TAG_SIZE);
+        reference = malloc(SLOTS * (b.size + TAG_SIZE));
+        reference_tags = malloc(SLOTS * TAG_SIZE);
+        if (b.in == NULL || b.out == NULL || b.tags == NULL ||
+            reference == NULL || reference_tags == NULL) {
+            fprintf(stderr, "Could not allocate the packets\n");
+            goto end;
+        }
+        for (i = 0; i < SLOTS * b.size; i++) {
+            b.in[i] = i % 0x100;
+        }
+
+        for (mode = BENCH_REINIT; mode <= BENCH_ONESHOT; mode++) {
+            if (mode == BENCH_AEAD && !b.aead) {
+                continue;
+            }
+            memset(b.out, 0, SLOTS * (b.size + TAG_SIZE));
+
+            if (bench_run(&b, mode, &secs) != 0) {
+                goto end;
+            }
+            if (mode == BENCH_REINIT) {
+                reinit_secs = secs;
+                memcpy(reference, b.out, SLOTS * (b.size + TAG_SIZE));
+                memcpy(reference_tags, b.tags, SLOTS * TAG_SIZE);
+            } else if (mode != BENCH_ONESHOT) {
+                /* Only the ciphertexts are compared, the aead mode also
+                 * writes the tag after them */
+                for (i = 0; i < SLOTS; i++) {
+                    if (memcmp(b.out + i * (b.size + TAG_SIZE),
+                               reference + i * (b.size + TAG_SIZE),
+                               b.size) != 0 ||
+                        memcmp(b.tags + i * TAG_SIZE,
+                               reference_tags + i * TAG_SIZE,
+                               b.aead ? TAG_SIZE : 0) != 0) {
+                        fprintf(stderr, "%s %s: the output differs from "
+                                "reinit\n", gnutls_cipher_get_name(cipher),
+                                bench_mode_names[mode]);
+                        goto end;
+                    }
+                }
+            }
+
+            printf("%-18s %6zu %-8s %12.0f %8.1f %9.1f %7.2f\n",
+                   gnutls_cipher_get_name(cipher), b.size,
+                   bench_mode_names[mode], nmessages / secs,
+                   secs * 1e9 / nmessages, nmessages * b.size / secs / 1e6,
+                   reinit_secs / secs);
+        }
+    }
+
+    rv = 0;
+
+end:
+    cipher_ctx_pool_free(b.pool);
+    for (i = 0; b.aead && i < nkeys; i++) {
+        gnutls_aead_cipher_deinit(b.aead_hds[i]);
+    }
+    gnutls_memset(key_data, 0, sizeof(key_data));
+    free(b.in);
+    free(b.out);
+    free(b.tags);
+    free(reference);
+    free(reference_tags);
+    return rv;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--cipher=NAME]... [--size=BYTES]... "
+            "[--keys=N] [--messages=N]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const struct option long_options[] = {
+        {"cipher", required_argument, NULL, 'c'},
+        {"size", required_argument, NULL, 's'},
+        {"keys", required_argument, NULL, 'k'},
+        {"messages", required_argument, NULL, 'm'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    static const gnutls_cipher_algorithm_t default_ciphers[] = {
+        GNUTLS_CIPHER_AES_128_CBC,
+        GNUTLS_CIPHER_AES_256_CBC,
+        GNUTLS_CIPHER_AES_128_GCM,
+        GNUTLS_CIPHER_AES_256_GCM,
+    };
+    static const size_t default_sizes[] = {64, 128, 256, 512, 1024, 1500};
+
+    gnutls_cipher_algorithm_t ciphers[MAX_CIPHERS];
+    size_t nciphers = 0;
+    size_t sizes[MAX_SIZES];
+    size_t nsizes = 0;
+    long nkeys = 4;
+    long nmessages = 1000000;
+    size_t i;
+    int opt;
+    int rv = 0;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            if (nciphers == MAX_CIPHERS) {
+                fprintf(stderr, "Too many ciphers\n");
+                return -1;
+            }
+            ciphers[nciphers] = gnutls_cipher_get_id(optarg);
+            if (ciphers[nciphers] == GNUTLS_CIPHER_UNKNOWN) {
+                fprintf(stderr, "Unknown cipher %s\n", optarg);
+                return -1;
+            }
+            nciphers++;
+            break;
+        case 's':
+            if (nsizes == MAX_SIZES) {
+                fprintf(stderr, "Too many sizes\n");
+                return -1;
+            }
+            sizes[nsizes] = strtoul(optarg, NULL, 10);
+            if (sizes[nsizes] == 0) {
+                fprintf(stderr, "Invalid size %s\n", optarg);
+                return -1;
+            }
+            nsizes++;
+            break;
+        case 'k':
+            nkeys = strtol(optarg, NULL, 10);
+            if (nkeys <= 0 || nkeys > MAX_KEYS) {
+                fprintf(stderr, "Invalid number of keys %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm':
+            nmessages = strtol(optarg, NULL, 10);
+            if (nmessages <= 0) {
+                fprintf(stderr, "Invalid number of messages %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (nciphers == 0) {
+        for (i = 0; i < sizeof(default_ciphers) / sizeof(default_ciphers[0]);
+             i++) {
+            ciphers[nciphers++] = default_ciphers[i];
+        }
+    }
+    if (nsizes == 0) {
+        for (i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]);
+             i++) {
+            sizes[nsizes++] = default_sizes[i];
+        }
+    }
+
+    gnutls_global_init();
+
+    printf("%-18s %6s %-8s %12s %8s %9s %7s\n", "cipher", "size", "mode",
+           "msgs/s", "ns/msg", "MB/s", "speedup");
+
+    for (i = 0; rv == 0 && i < nciphers; i++) {
+        rv = bench_cipher(ciphers[i], sizes, nsizes, nkeys, nmessages);
+    }
+
+    gnutls_global_deinit();
+    return rv;
+}
@@ -4,16 +4,77 @@
  * The purpose is to verify that the same context initialized with an IV can be
  * used to encrypt data in parts without handling the intermediate IVs manually.
  *
+ * With --bench, it instead measures the throughput of gnutls_cipher_encrypt2()
+ * and gnutls_cipher_decrypt2() when the data is passed in parts of increasing
+ * size, compared to a single call for the whole buffer, to show the per-call
+ * overhead paid at small chunk sizes.
+ *
+ * Build:
+ *     cc -O2 -o test-aes-cbc-parts test-aes-cbc-parts.c -lgnutls -lpthread -lm
+ * Usage:
+ *     test-aes-cbc-parts
+ *     test-aes-cbc-parts --bench [--cipher=NAME]... [--total=SIZE]...
+ *                        [--min-chunk=SIZE] [--max-chunk=SIZE]
+ *                        [--threads[=N] [--chunk=SIZE]]
+ *     test-aes-cbc-parts --bench --layouts [--cipher=NAME]... [--total=SIZE]...
+ *                        [--chunk=SIZE]
+ *
+ * SIZE accepts the K, M and G suffixes (powers of 1024).  The chunk size is
+ * doubled from --min-chunk (default 16) to --max-chunk (default 1M); it is
+ * raised to the block size of the cipher, as the AEAD ciphers only accept
+ * parts which are a multiple of it.  Each --total (default 64M) is processed
+ * in place in a single buffer, repeated until at least 64M were processed.
+ * The default ciphers are AES-128-CBC, AES-256-CBC, AES-128-GCM, AES-256-GCM
+ * and CHACHA20-POLY1305.
+ *
+ * The ns/call column is the time spent in parts over the one-shot time,
+ * divided by the number of extra calls.  For large chunks the difference is
+ * within the noise and may be negative.
+ *
+ * With --threads, the same work is instead run by 1, 2, 4... and finally N
+ * threads at once (default: all the CPUs the process may run on), in parts of
+ * --chunk bytes (default 16K, the size of a TLS record, rounded up to a
+ * multiple of the block size).  Each thread is bound
+ * to its own CPU and has its own contexts and its own buffer of --total bytes,
+ * cache-line aligned and first touched by the thread so that it is allocated
+ * on the local NUMA node.  The aggregate throughput is reported together with
+ * the throughput of the threads; contention inside the library shows up as a
+ * scaling below the number of threads and a growing spread between threads.
+ *
+ * With --layouts, messages of --chunk bytes are encrypted one after the other
+ * from a pool of --total bytes, for every combination of:
+ *  - the alignment of the messages: exactly 1, 16 or 64 bytes, or a page;
+ *  - in place, or out of place into a second pool with the same layout;
+ *  - pools backed by 4K pages, transparent hugepages (MADV_HUGEPAGE) or
+ *    explicit hugepages (MAP_HUGETLB, which need vm.nr_hugepages).
+ * The pools are written before the measurement so that no page fault is
+ * counted.  The huge column is the part of the pools actually backed by
+ * hugepages, as the kernel silently falls back to 4K pages.
+ *
  * */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <gnutls/crypto.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
 
-int main(int argc, char *argv[]) {
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+static int test_parts(void) {
 
     uint8_t input[1024];
     size_t input_len = 1024;
@@ -39,8 +100,6 @@ int main(int argc, char *argv[]) {
     int rv;
     int i, j;
 
-    gnutls_global_init();
-
     rv = gnutls_rnd(GNUTLS_RND_KEY, key, key_len);
     if (rv != 0) {
         fprintf(stderr, "Could not generate key\n");
@@ -128,10 +187,904 @@ int main(int argc, char *argv[]) {
         printf("Contents of input and decrypted are different\nFAILED\n");
     }
 
-    gnutls_global_deinit();
     return 0;
 
 error:
-    gnutls_global_deinit();
     return -1;
 }
+
+#define BENCH_MAX_CIPHERS 16
+#define BENCH_MAX_TOTALS 16
+/* Each measurement processes at least this many bytes */
+#define BENCH_MIN_BYTES (64 * 1024 * 1024)
+#define BENCH_CACHE_LINE 64
+#define BENCH_PAGE_SIZE 4096
+#define BENCH_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct bench_params {
+    gnutls_cipher_algorithm_t ciphers[BENCH_MAX_CIPHERS];
+    size_t nciphers;
+    size_t totals[BENCH_MAX_TOTALS];
+    size_t ntotals;
+    size_t min_chunk;
+    size_t max_chunk;
+    /* Threaded mode if not 0 */
+    long threads;
+    bool layouts;
+    size_t chunk;
+};
+
+struct bench_result {
+    double secs;
+    uint64_t cycles;
+    uint64_t calls;
+};
+
+static uint64_t bench_cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parse a size with an optional K, M or G suffix; returns 0 if invalid */
+static size_t bench_parse_size(const char *arg) {
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg) {
+        return 0;
+    }
+
+    switch (*end) {
+    case 'G':
+        value *= 1024;
+        /* fall through */
+    case 'M':
+        value *= 1024;
+        /* fall through */
+    case 'K':
+        value *= 1024;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || value > SIZE_MAX) {
+        return 0;
+    }
+
+    return (size_t)value;
+}
+
+static void bench_format_size(char *buf, size_t len, size_t size) {
+    if (size >= 1024 * 1024 * 1024 && size % (1024 * 1024 * 1024) == 0) {
+        snprintf(buf, len, "%zuG", size / (1024 * 1024 * 1024));
+    } else if (size >= 1024 * 1024 && size % (1024 * 1024) == 0) {
+        snprintf(buf, len, "%zuM", size / (1024 * 1024));
+    } else if (size >= 1024 && size % 1024 == 0) {
+        snprintf(buf, len, "%zuK", size / 1024);
+    } else {
+        snprintf(buf, len, "%zu", size);
+    }
+}
+
+/*
+ * Encrypt or decrypt the buffer in place, in parts of chunk bytes, iterations
+ * times with a new context each time.  Only the calls to
+ * gnutls_cipher_encrypt2()/gnutls_cipher_decrypt2() are measured.
+ *
+ * As every iteration uses the same key and IV, decrypting as many times as
+ * the buffer was encrypted gives back the plaintext.
+ */
+static int bench_run(gnutls_cipher_algorithm_t cipher, bool encrypt,
+                     uint8_t *buf, size_t total, size_t chunk,
+                     unsigned int iterations, gnutls_datum_t *key_ctx,
+                     gnutls_datum_t *iv_ctx, struct bench_result *result) {
+
+    gnutls_cipher_hd_t ctx;
+    uint64_t cycles;
+    double start;
+    size_t offset, len;
+    unsigned int i;
+    int rv;
+
+    memset(result, 0, sizeof(*result));
+
+    for (i = 0; i < iterations; i++) {
+        rv = gnutls_cipher_init(&ctx, cipher, key_ctx, iv_ctx);
+        if (rv != 0) {
+            fprintf(stderr, "Could not initialize %s: %s\n",
+                    gnutls_cipher_get_name(cipher), gnutls_strerror(rv));
+            return -1;
+        }
+
+        start = bench_now();
+        cycles = bench_cycles();
+        for (offset = 0; offset < total; offset += len) {
+            len = total - offset < chunk ? total - offset : chunk;
+            if (encrypt) {
+                rv = gnutls_cipher_encrypt2(ctx, buf + offset, len,
+                                            buf + offset, len);
+            } else {
+                rv = gnutls_cipher_decrypt2(ctx, buf + offset, len,
+                                            buf + offset, len);
+            }
+            if (rv != 0) {
+                break;
+            }
+            result->calls++;
+        }
+        result->cycles += bench_cycles() - cycles;
+        result->secs += bench_now() - start;
+
+        gnutls_cipher_deinit(ctx);
+
+        if (rv != 0) {
+            fprintf(stderr, "Failed to %s with %s: %s\n",
+                    encrypt ? "encrypt" : "decrypt",
+                    gnutls_cipher_get_name(cipher), gnutls_strerror(rv));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void bench_print(gnutls_cipher_algorithm_t cipher, bool encrypt,
+                        size_t total, size_t chunk, unsigned int iterations,
+                        const struct bench_result *result,
+                        const struct bench_result *oneshot) {
+
+    double bytes = (double)total * iterations;
+    char total_str[32], chunk_str[32];
+
+    bench_format_size(total_str, sizeof(total_str), total);
+    if (oneshot == NULL) {
+        snprintf(chunk_str, sizeof(chunk_str), "one-shot");
+    } else {
+        bench_format_size(chunk_str, sizeof(chunk_str), chunk);
+    }
+
+    printf("%-18s %-7s %6s %8s %10llu %9.1f", gnutls_cipher_get_name(cipher),
+           encrypt ? "encrypt" : "decrypt", total_str, chunk_str,
+           (unsigned long long)result->calls, bytes / result->secs / 1e6);
+#ifdef HAVE_RDTSC
+    printf(" %8.2f", result->cycles / bytes);
+#else
+    printf(" %8s", "-");
+#endif
+    if (oneshot != NULL) {
+        /* Extra time of the calls in parts over the single call, per call */
+        printf(" %10.1f", (result->secs - oneshot->secs) * 1e9 /
+               (result->calls - oneshot->calls));
+    }
+    printf("\n");
+}
+
+static int bench(const struct bench_params *params) {
+
+    struct bench_result oneshot, result;
+    gnutls_cipher_algorithm_t cipher;
+    gnutls_datum_t key_ctx;
+    gnutls_datum_t iv_ctx;
+    uint8_t key[64];
+    uint8_t iv[16];
+    unsigned int iterations;
+    size_t total, chunk, min_chunk, t, c, i;
+    uint8_t *buf = NULL;
+    int op;
+    int rv;
+
+    rv = gnutls_rnd(GNUTLS_RND_KEY, key, sizeof(key));
+    if (rv == 0) {
+        rv = gnutls_rnd(GNUTLS_RND_KEY, iv, sizeof(iv));
+    }
+    if (rv != 0) {
+        fprintf(stderr, "Could not generate key\n");
+        return -1;
+    }
+
+    printf("%-18s %-7s %6s %8s %10s %9s %8s %10s\n", "cipher", "op", "total",
+           "chunk", "calls", "MB/s", "cycles/B", "ns/call");
+
+    for (t = 0; t < params->ntotals; t++) {
+        total = params->totals[t];
+        iterations = total < BENCH_MIN_BYTES ?
+                     (BENCH_MIN_BYTES + total - 1) / total : 1;
+
+        free(buf);
+        buf = malloc(total);
+        if (buf == NULL) {
+            fprintf(stderr, "Could not allocate %zu bytes\n", total);
+            return -1;
+        }
+        for (i = 0; i < total; i++) {
+            buf[i] = i % 0x100;
+        }
+
+        for (c = 0; c < params->nciphers; c++) {
+            cipher = params->ciphers[c];
+
+            key_ctx.data = key;
+            key_ctx.size = gnutls_cipher_get_key_size(cipher);
+            iv_ctx.data = iv;
+            iv_ctx.size = gnutls_cipher_get_iv_size(cipher);
+
+            min_chunk = gnutls_cipher_get_block_size(cipher);
+            if (min_chunk < params->min_chunk) {
+                min_chunk = params->min_chunk;
+            }
+
+            for (op = 1; op >= 0; op--) {
+                if (bench_run(cipher, op, buf, total, total, iterations,
+                              &key_ctx, &iv_ctx, &oneshot) != 0) {
+                    goto error;
+                }
+                bench_print(cipher, op, total, total, iterations, &oneshot,
+                            NULL);
+
+                for (chunk = min_chunk;
+                     chunk <= params->max_chunk && chunk < total;
+                     chunk *= 2) {
+                    if (bench_run(cipher, op, buf, total, chunk, iterations,
+                                  &key_ctx, &iv_ctx, &result) != 0) {
+                        goto error;
+                    }
+                    bench_print(cipher, op, total, chunk, iterations,
+                                &result, &oneshot);
+
+                    /* Keep the number of encryptions and decryptions of the
+                     * buffer equal */
+                    if (bench_run(cipher, !op, buf, total, total, iterations,
+                                  &key_ctx, &iv_ctx, &result) != 0) {
+                        goto error;
+                    }
+                }
+            }
+
+            for (i = 0; i < total; i++) {
+                if (buf[i] != i % 0x100) {
+                    fprintf(stderr, "%s: contents of input and decrypted "
+                            "are different\n", gnutls_cipher_get_name(cipher));
+                    goto error;
+                }
+            }
+        }
+    }
+
+    free(buf);
+    return 0;
+
+error:
+    free(buf);
+    return -1;
+}
+
+/* Round a chunk size up to a multiple of the block size of the cipher, as
+ * only the last part may be shorter */
+static size_t bench_chunk(gnutls_cipher_algorithm_t cipher, size_t chunk) {
+    size_t block = gnutls_cipher_get_block_size(cipher);
+
+    return (chunk + block - 1) / block * block;
+}
+
+/* Work shared by the threads of a threaded run */
+struct bench_threads_job {
+    gnutls_cipher_algorithm_t cipher;
+    gnutls_datum_t key_ctx;
+    gnutls_datum_t iv_ctx;
+    size_t total;
+    size_t chunk;
+    unsigned int iterations;
+    pthread_barrier_t barrier;
+};
+
+/* Each thread writes only its own structure, aligned so that two threads
+ * never share a cache line */
+struct bench_thread {
+    pthread_t thread;
+    int cpu;
+    struct bench_threads_job *job;
+    /* Encryption and decryption */
+    struct bench_result result[2];
+    double start[2];
+    double end[2];
+    int rv;
+} __attribute__((aligned(BENCH_CACHE_LINE)));
+
+static void *bench_thread_main(void *arg) {
+
+    struct bench_thread *self = arg;
+    struct bench_threads_job *job = self->job;
+    cpu_set_t cpus;
+    uint8_t *buf = NULL;
+    size_t i;
+    int op;
+
+    /* Bind the thread before allocating, so that the buffer is first touched
+     * on the CPU which will use it */
+    CPU_ZERO(&cpus);
+    CPU_SET(self->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    self->rv = posix_memalign((void **)&buf, BENCH_CACHE_LINE, job->total);
+    if (self->rv != 0) {
+        fprintf(stderr, "Could not allocate %zu bytes\n", job->total);
+        buf = NULL;
+    } else {
+        for (i = 0; i < job->total; i++) {
+            buf[i] = i % 0x100;
+        }
+    }
+
+    for (op = 1; op >= 0; op--) {
+        /* Even if this thread failed, the others wait for it */
+        pthread_barrier_wait(&job->barrier);
+        if (self->rv != 0) {
+            continue;
+        }
+
+        self->start[op] = bench_now();
+        self->rv = bench_run(job->cipher, op, buf, job->total, job->chunk,
+                             job->iterations, &job->key_ctx, &job->iv_ctx,
+                             &self->result[op]);
+        self->end[op] = bench_now();
+    }
+
+    for (i = 0; self->rv == 0 && i < job->total; i++) {
+        if (buf[i] != i % 0x100) {
+            fprintf(stderr, "%s: contents of input and decrypted are "
+                    "different in thread %d\n",
+                    gnutls_cipher_get_name(job->cipher), self->cpu);
+            self->rv = -1;
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void bench_threads_print(const struct bench_threads_job *job,
+                                const struct bench_thread *threads,
+                                long nthreads, int op, double *single) {
+
+    double bytes = (double)job->total * job->iterations;
+    double start = threads[0].start[op], end = threads[0].end[op];
+    double rate, sum = 0, sum2 = 0, min = INFINITY, max = 0;
+    double aggregate, mean, stddev;
+    char chunk_str[32];
+    long i;
+
+    for (i = 0; i < nthreads; i++) {
+        rate = bytes / threads[i].result[op].secs / 1e6;
+        sum += rate;
+        sum2 += rate * rate;
+        min = rate < min ? rate : min;
+        max = rate > max ? rate : max;
+        start = threads[i].start[op] < start ? threads[i].start[op] : start;
+        end = threads[i].end[op] > end ? threads[i].end[op] : end;
+    }
+
+    aggregate = bytes * nthreads / (end - start) / 1e6;
+    mean = sum / nthreads;
+    stddev = sqrt(fmax(sum2 / nthreads - mean * mean, 0));
+    if (nthreads == 1) {
+        *single = aggregate;
+    }
+
+    bench_format_size(chunk_str, sizeof(chunk_str), job->chunk);
+    printf("%-18s %-7s %7ld %8s %10.1f %9.1f %8.1f %9.1f %9.1f %7.2f\n",
+           gnutls_cipher_get_name(job->cipher), op ? "encrypt" : "decrypt",
+           nthreads, chunk_str, aggregate, mean, stddev, min, max,
+           aggregate / *single);
+}
+
+static int bench_threads(const struct bench_params *params) {
+
+    struct bench_threads_job job;
+    struct bench_thread *threads;
+    double single[2] = {0, 0};
+    uint8_t key[64];
+    uint8_t iv[16];
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    long nthreads, i;
+    size_t c, t;
+    int op;
+    int rv;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Could not get the CPU affinity: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+            cpus[ncpus++] = i;
+        }
+    }
+
+    rv = gnutls_rnd(GNUTLS_RND_KEY, key, sizeof(key));
+    if (rv == 0) {
+        rv = gnutls_rnd(GNUTLS_RND_KEY, iv, sizeof(iv));
+    }
+    if (rv != 0) {
+        fprintf(stderr, "Could not generate key\n");
+        return -1;
+    }
+
+    threads = aligned_alloc(BENCH_CACHE_LINE,
+                            params->threads * sizeof(*threads));
+    if (threads == NULL) {
+        fprintf(stderr, "Could not allocate the threads\n");
+        return -1;
+    }
+
+    printf("%-18s %-7s %7s %8s %10s %9s %8s %9s %9s %7s\n", "cipher", "op",
+           "threads", "chunk", "MB/s", "mean", "stddev", "min", "max",
+           "scaling");
+
+    for (t = 0; t < params->ntotals; t++) {
+        for (c = 0; c < params->nciphers; c++) {
+            job.cipher = params->ciphers[c];
+            job.key_ctx.data = key;
+            job.key_ctx.size = gnutls_cipher_get_key_size(job.cipher);
+            job.iv_ctx.data = iv;
+            job.iv_ctx.size = gnutls_cipher_get_iv_size(job.cipher);
+            job.total = params->totals[t];
+            job.chunk = bench_chunk(job.cipher, params->chunk);
+            job.iterations = job.total < BENCH_MIN_BYTES ?
+                             (BENCH_MIN_BYTES + job.total - 1) / job.total : 1;
+
+            /* 1, 2, 4... threads, then all of them */
+            for (nthreads = 1; nthreads <= params->threads;
+                 nthreads = nthreads * 2 > params->threads &&
+                            nthreads < params->threads ?
+                            params->threads : nthreads * 2) {
+                pthread_barrier_init(&job.barrier, NULL, nthreads);
+
+                memset(threads, 0, nthreads * sizeof(*threads));
+                for (i = 0; i < nthreads; i++) {
+                    threads[i].cpu = cpus[i % ncpus];
+                    threads[i].job = &job;
+                    rv = pthread_create(&threads[i].thread, NULL,
+                                        bench_thread_main, &threads[i]);
+                    if (rv != 0) {
+                        fprintf(stderr, "Could not create thread: %s\n",
+                                strerror(rv));
+                        abort();
+                    }
+                }
+
+                rv = 0;
+                for (i = 0; i < nthreads; i++) {
+                    pthread_join(threads[i].thread, NULL);
+                    if (threads[i].rv != 0) {
+                        rv = -1;
+                    }
+                }
+                pthread_barrier_destroy(&job.barrier);
+                if (rv != 0) {
+                    goto end;
+                }
+
+                for (op = 1; op >= 0; op--) {
+                    bench_threads_print(&job, threads, nthreads, op,
+                                        &single[op]);
+                }
+            }
+        }
+    }
+
+end:
+    free(threads);
+    return rv;
+}
+
+enum bench_pages {
+    BENCH_PAGES_4K,
+    BENCH_PAGES_THP,
+    BENCH_PAGES_HUGETLB,
+};
+
+static const char *bench_pages_names[] = {
+    [BENCH_PAGES_4K] = "4K",
+    [BENCH_PAGES_THP] = "THP",
+    [BENCH_PAGES_HUGETLB] = "hugetlb",
+};
+
+/* Allocate and pre-fault a pool of size bytes, rounded to a hugepage */
+static uint8_t *bench_pool_alloc(size_t size, enum bench_pages pages) {
+
+    uint8_t *base, *aligned;
+    size_t extra = 0;
+
+    switch (pages) {
+    case BENCH_PAGES_HUGETLB:
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                    -1, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        aligned = base;
+        break;
+    default:
+        /* Map one more hugepage to align the pool on a hugepage */
+        extra = BENCH_HUGE_PAGE_SIZE;
+        base = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        aligned = (uint8_t *)(((uintptr_t)base + extra - 1) &
+                              ~(uintptr_t)(extra - 1));
+        if (aligned > base) {
+            munmap(base, aligned - base);
+        }
+        munmap(aligned + size, base + extra - aligned);
+
+        madvise(aligned, size, pages == BENCH_PAGES_THP ? MADV_HUGEPAGE :
+                                                          MADV_NOHUGEPAGE);
+        break;
+    }
+
+    /* Fault in every page before the measurement */
+    memset(aligned, 0, size);
+    return aligned;
+}
+
+/* Get how many bytes of the two pools of size bytes are backed by hugepages.
+ * Both are checked at once as the kernel may merge their mappings. */
+static size_t bench_pool_huge(const uint8_t *in, const uint8_t *out,
+                              size_t size) {
+
+    char line[256];
+    unsigned long start, end;
+    size_t kib, huge = 0;
+    bool found = false;
+    FILE *file;
+
+    file = fopen("/proc/self/smaps", "re");
+    if (file == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            found = (start < (uintptr_t)in + size && end > (uintptr_t)in) ||
+                    (start < (uintptr_t)out + size && end > (uintptr_t)out);
+        } else if (found &&
+                   (sscanf(line, "AnonHugePages: %zu kB", &kib) == 1 ||
+                    sscanf(line, "Private_Hugetlb: %zu kB", &kib) == 1)) {
+            huge += kib * 1024;
+        }
+    }
+
+    fclose(file);
+    return huge < 2 * size ? huge : 2 * size;
+}
+
+/*
+ * Encrypt the messages of the input pool one after the other, in place or
+ * into the output pool, with a single context, until at least
+ * BENCH_MIN_BYTES were encrypted.
+ */
+static int bench_layout_run(gnutls_cipher_algorithm_t cipher, uint8_t *in,
+                            uint8_t *out, size_t nmsgs, size_t stride,
+                            size_t offset, size_t chunk,
+                            gnutls_datum_t *key_ctx, gnutls_datum_t *iv_ctx,
+                            struct bench_result *result) {
+
+    gnutls_cipher_hd_t ctx;
+    uint64_t cycles;
+    double start;
+    size_t m;
+    int rv = 0;
+
+    memset(result, 0, sizeof(*result));
+
+    rv = gnutls_cipher_init(&ctx, cipher, key_ctx, iv_ctx);
+    if (rv != 0) {
+        fprintf(stderr, "Could not initialize %s: %s\n",
+                gnutls_cipher_get_name(cipher), gnutls_strerror(rv));
+        return -1;
+    }
+
+    start = bench_now();
+    cycles = bench_cycles();
+    while (rv == 0 && result->calls * chunk < BENCH_MIN_BYTES) {
+        for (m = 0; m < nmsgs; m++) {
+            rv = gnutls_cipher_encrypt2(ctx, in + m * stride + offset, chunk,
+                                        out + m * stride + offset, chunk);
+            if (rv != 0) {
+                break;
+            }
+        }
+        result->calls += m;
+    }
+    result->cycles = bench_cycles() - cycles;
+    result->secs = bench_now() - start;
+
+    gnutls_cipher_deinit(ctx);
+
+    if (rv != 0) {
+        fprintf(stderr, "Failed to encrypt with %s: %s\n",
+                gnutls_cipher_get_name(cipher), gnutls_strerror(rv));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int bench_layouts(const struct bench_params *params) {
+
+    static const size_t alignments[] = {1, 16, 64, BENCH_PAGE_SIZE};
+
+    struct bench_result result;
+    gnutls_cipher_algorithm_t cipher;
+    gnutls_datum_t key_ctx;
+    gnutls_datum_t iv_ctx;
+    uint8_t key[64];
+    uint8_t iv[16];
+    uint8_t *in, *out;
+    size_t pool_size, stride, nmsgs, chunk, huge;
+    size_t t, c, a;
+    char total_str[32], chunk_str[32], align_str[32];
+    double bytes;
+    int pages, inplace;
+    int rv;
+
+    rv = gnutls_rnd(GNUTLS_RND_KEY, key, sizeof(key));
+    if (rv == 0) {
+        rv = gnutls_rnd(GNUTLS_RND_KEY, iv, sizeof(iv));
+    }
+    if (rv != 0) {
+        fprintf(stderr, "Could not generate key\n");
+        return -1;
+    }
+
+    printf("%-18s %6s %8s %5s %-7s %-7s %6s %9s %8s\n", "cipher", "total",
+           "chunk", "align", "pages", "place", "huge", "MB/s", "cycles/B");
+
+    for (t = 0; t < params->ntotals; t++) {
+        bench_format_size(total_str, sizeof(total_str), params->totals[t]);
+
+        for (c = 0; c < params->nciphers; c++) {
+            cipher = params->ciphers[c];
+            key_ctx.data = key;
+            key_ctx.size = gnutls_cipher_get_key_size(cipher);
+            iv_ctx.data = iv;
+            iv_ctx.size = gnutls_cipher_get_iv_size(cipher);
+
+            chunk = bench_chunk(cipher, params->chunk);
+            bench_format_size(chunk_str, sizeof(chunk_str), chunk);
+
+            /* Each message starts at offset bytes into its own pages, so
+             * that all have the same alignment */
+            stride = (chunk + BENCH_PAGE_SIZE) / BENCH_PAGE_SIZE *
+                     BENCH_PAGE_SIZE;
+            pool_size = (params->totals[t] + BENCH_HUGE_PAGE_SIZE - 1) /
+                        BENCH_HUGE_PAGE_SIZE * BENCH_HUGE_PAGE_SIZE;
+            nmsgs = pool_size / stride;
+            if (nmsgs == 0) {
+                fprintf(stderr, "The total size must be larger than the "
+                        "chunk size\n");
+                return -1;
+            }
+
+            for (pages = BENCH_PAGES_4K; pages <= BENCH_PAGES_HUGETLB;
+                 pages++) {
+                in = bench_pool_alloc(pool_size, pages);
+                out = bench_pool_alloc(pool_size, pages);
+                if (in == NULL || out == NULL) {
+                    printf("%-18s %6s %8s %5s %-7s unavailable: %s\n",
+                           gnutls_cipher_get_name(cipher), total_str,
+                           chunk_str, "-", bench_pages_names[pages],
+                           strerror(errno));
+                    if (in != NULL) {
+                        munmap(in, pool_size);
+                    }
+                    continue;
+                }
+                huge = bench_pool_huge(in, out, pool_size);
+
+                for (a = 0; a < sizeof(alignments) / sizeof(alignments[0]);
+                     a++) {
+                    if (alignments[a] == BENCH_PAGE_SIZE) {
+                        snprintf(align_str, sizeof(align_str), "page");
+                    } else {
+                        snprintf(align_str, sizeof(align_str), "%zu",
+                                 alignments[a]);
+                    }
+
+                    for (inplace = 1; inplace >= 0; inplace--) {
+                        rv = bench_layout_run(cipher, in, inplace ? in : out,
+                                              nmsgs, stride,
+                                              alignments[a] % BENCH_PAGE_SIZE,
+                                              chunk, &key_ctx, &iv_ctx,
+                                              &result);
+                        if (rv != 0) {
+                            munmap(in, pool_size);
+                            munmap(out, pool_size);
+                            return -1;
+                        }
+
+                        bytes = (double)result.calls * chunk;
+                        printf("%-18s %6s %8s %5s %-7s %-7s %5.0f%% %9.1f",
+                               gnutls_cipher_get_name(cipher), total_str,
+                               chunk_str, align_str, bench_pages_names[pages],
+                               inplace ? "in" : "out",
+                               100.0 * huge / (2 * pool_size),
+                               bytes / result.secs / 1e6);
+#ifdef HAVE_RDTSC
+                        printf(" %8.2f\n", result.cycles / bytes);
+#else
+                        printf(" %8s\n", "-");
+#endif
+                    }
+                }
+
+                munmap(in, pool_size);
+                munmap(out, pool_size);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [--bench [--cipher=NAME]... [--total=SIZE]... "
+            "[--min-chunk=SIZE] [--max-chunk=SIZE] "
+            "[--threads[=N] | --layouts] [--chunk=SIZE]]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const struct option long_options[] = {
+        {"bench", no_argument, NULL, 'b'},
+        {"cipher", required_argument, NULL, 'c'},
+        {"total", required_argument, NULL, 't'},
+        {"min-chunk", required_argument, NULL, 'm'},
+        {"max-chunk", required_argument, NULL, 'M'},
+        {"threads", optional_argument, NULL, 'T'},
+        {"chunk", required_argument, NULL, 'C'},
+        {"layouts", no_argument, NULL, 'L'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    static const gnutls_cipher_algorithm_t default_ciphers[] = {
+        GNUTLS_CIPHER_AES_128_CBC,
+        GNUTLS_CIPHER_AES_256_CBC,
+        GNUTLS_CIPHER_AES_128_GCM,
+        GNUTLS_CIPHER_AES_256_GCM,
+        GNUTLS_CIPHER_CHACHA20_POLY1305,
+    };
+
+    struct bench_params params = {
+        .min_chunk = 16,
+        .max_chunk = 1024 * 1024,
+        .chunk = 16 * 1024,
+    };
+    cpu_set_t allowed;
+    bool run_bench = false;
+    size_t i;
+    int opt;
+    int rv;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            run_bench = true;
+            break;
+        case 'c':
+            if (params.nciphers == BENCH_MAX_CIPHERS) {
+                fprintf(stderr, "Too many ciphers\n");
+                return -1;
+            }
+            params.ciphers[params.nciphers] = gnutls_cipher_get_id(optarg);
+            if (params.ciphers[params.nciphers] == GNUTLS_CIPHER_UNKNOWN) {
+                fprintf(stderr, "Unknown cipher %s\n", optarg);
+                return -1;
+            }
+            params.nciphers++;
+            break;
+        case 't':
+            if (params.ntotals == BENCH_MAX_TOTALS) {
+                fprintf(stderr, "Too many total sizes\n");
+                return -1;
+            }
+            params.totals[params.ntotals] = bench_parse_size(optarg);
+            if (params.totals[params.ntotals] == 0) {
+                fprintf(stderr, "Invalid total size %s\n", optarg);
+                return -1;
+            }
+            params.ntotals++;
+            break;
+        case 'm':
+            params.min_chunk = bench_parse_size(optarg);
+            if (params.min_chunk == 0) {
+                fprintf(stderr, "Invalid chunk size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'M':
+            params.max_chunk = bench_parse_size(optarg);
+            if (params.max_chunk == 0) {
+                fprintf(stderr, "Invalid chunk size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            if (optarg == NULL) {
+                if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+                    fprintf(stderr, "Could not get the CPU affinity: %s\n",
+                            strerror(errno));
+                    return -1;
+                }
+                params.threads = CPU_COUNT(&allowed);
+            } else {
+                params.threads = strtol(optarg, NULL, 10);
+                if (params.threads <= 0) {
+                    fprintf(stderr, "Invalid number of threads %s\n",
+                            optarg);
+                    return -1;
+                }
+            }
+            break;
+        case 'L':
+            params.layouts = true;
+            break;
+        case 'C':
+            params.chunk = bench_parse_size(optarg);
+            if (params.chunk == 0) {
+                fprintf(stderr, "Invalid chunk size %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (params.nciphers == 0) {
+        for (i = 0; i < sizeof(default_ciphers) / sizeof(default_ciphers[0]);
+             i++) {
+            params.ciphers[params.nciphers++] = default_ciphers[i];
+        }
+    }
+    if (params.ntotals == 0) {
+        params.totals[params.ntotals++] = 64 * 1024 * 1024;
+    }
+
+    gnutls_global_init();
+
+    if (run_bench && params.layouts) {
+        rv = bench_layouts(&params);
+    } else if (run_bench && params.threads > 0) {
+        rv = bench_threads(&params);
+    } else if (run_bench) {
+        rv = bench(&params);
+    } else {
+        rv = test_parts();
+    }
+
+    gnutls_global_deinit();
+    return rv;
+}
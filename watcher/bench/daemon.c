@@ -0,0 +1,259 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Job throughput of the watcher daemon compared with starting the watcher
+ * binary once per job.
+ *
+ * The one-shot mode runs "watcher COMMAND" for each job with posix_spawn(),
+ * keeping CONCURRENCY watchers running at once.  The daemon mode starts
+ * "watcher --daemon=SOCKET --jobs=CONCURRENCY" once and submits all the jobs
+ * on a single connection, keeping CONCURRENCY requests pending.  Both modes
+ * wait for the result of every job.
+ *
+ * Build:
+ *     cc -O2 -o bench-daemon daemon.c
+ * Usage:
+ *     bench-daemon WATCHER [JOBS] [CONCURRENCY...]
+ *
+ * The results are printed as one JSON object per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../watcher.h"
+
+#define COMMAND "/bin/true"
+
+extern char **environ;
+
+static long long now_nsecs(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (long long)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+/**
+ * @brief Start the watcher with the given arguments, discarding its output.
+ *
+ * @returns The pid of the watcher; -1 on error
+ */
+static pid_t spawn_watcher(char *argv[])
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int rc;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return rc == 0 ? pid : -1;
+}
+
+static int run_oneshot(char *watcher, long jobs, long concurrency)
+{
+    char *argv[] = {watcher, "-t10000", COMMAND, NULL};
+    long started = 0;
+    long running = 0;
+    int status;
+
+    while (started < jobs || running > 0) {
+        if (started < jobs && running < concurrency) {
+            if (spawn_watcher(argv) < 0) {
+                return -1;
+            }
+            started++;
+            running++;
+            continue;
+        }
+
+        if (wait(&status) < 0) {
+            return -1;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "A watcher failed with status %d\n", status);
+            return -1;
+        }
+        running--;
+    }
+
+    return 0;
+}
+
+static int run_daemon(char *watcher, long jobs, long concurrency)
+{
+    char payload[] = COMMAND;
+    struct watcher_request_st req;
+    struct sockaddr_un addr;
+    char socket_path[64];
+    char daemon_arg[80];
+    char jobs_arg[32];
+    char *argv[] = {watcher, daemon_arg, jobs_arg, "-t10000", NULL};
+    char buf[4096];
+    long submitted = 0;
+    long finished = 0;
+    ssize_t n;
+    ssize_t i;
+    pid_t pid;
+    int tries;
+    int fd;
+    int rc = -1;
+
+    snprintf(socket_path, sizeof(socket_path), "/tmp/bench-daemon-%d.sock",
+             getpid());
+    snprintf(daemon_arg, sizeof(daemon_arg), "-d%s", socket_path);
+    snprintf(jobs_arg, sizeof(jobs_arg), "-j%ld", concurrency);
+
+    pid = spawn_watcher(argv);
+    if (pid < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    for (tries = 0; tries < 1000; tries++) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    if (tries == 1000) {
+        fprintf(stderr, "Could not connect to the daemon\n");
+        goto end;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.magic = WATCHER_REQUEST_MAGIC;
+    req.argc = 1;
+    req.size = sizeof(payload);
+
+    while (finished < jobs) {
+        /* Keep the daemon busy: submit while the window is not full */
+        while (submitted < jobs && submitted - finished < concurrency) {
+            req.id = submitted;
+            if (write(fd, &req, sizeof(req)) != sizeof(req) ||
+                write(fd, payload, sizeof(payload)) != sizeof(payload))
+            {
+                goto end;
+            }
+            submitted++;
+        }
+
+        n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            fprintf(stderr, "The daemon closed the connection\n");
+            goto end;
+        }
+        for (i = 0; i < n; i++) {
+            finished += buf[i] == '\n';
+        }
+    }
+
+    rc = 0;
+
+end:
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(socket_path);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    static const long default_concurrency[] = {1, 8, 64};
+    static const char *modes[] = {"oneshot", "daemon"};
+    long long start, elapsed;
+    long concurrency;
+    long jobs = 2000;
+    long n, c;
+    int m;
+    int rc;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s WATCHER [JOBS] [CONCURRENCY...]\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (argc > 2) {
+        jobs = strtol(argv[2], NULL, 10);
+    }
+    n = (argc > 3) ? argc - 3 :
+                     (long)(sizeof(default_concurrency) / sizeof(long));
+
+    for (c = 0; c < n; c++) {
+        concurrency = (argc > 3) ? strtol(argv[c + 3], NULL, 10) :
+                                   default_concurrency[c];
+        if (jobs <= 0 || concurrency <= 0) {
+            fprintf(stderr, "Invalid number of jobs or concurrency\n");
+            return 1;
+        }
+
+        for (m = 0; m < 2; m++) {
+            start = now_nsecs();
+            if (m == 0) {
+                rc = run_oneshot(argv[1], jobs, concurrency);
+            } else {
+                rc = run_daemon(argv[1], jobs, concurrency);
+            }
+            elapsed = now_nsecs() - start;
+            if (rc != 0) {
+                fprintf(stderr, "%s failed\n", modes[m]);
+                return 1;
+            }
+
+            printf("{\"mode\":\"%s\",\"jobs\":%ld,\"concurrency\":%ld,"
+                   "\"seconds\":%.3f,\"jobs_per_sec\":%.1f}\n",
+                   modes[m], jobs, concurrency, elapsed / 1e9,
+                   jobs * 1e9 / elapsed);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
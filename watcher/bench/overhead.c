@@ -0,0 +1,438 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Overhead of the watcher for 1, 10, 100 and 1000 concurrently watched
+ * processes (by default):
+ *
+ * - idle: CPU time consumed by the watcher and its wake ups while all the
+ *   processes sleep.
+ * - spawn: spawn-to-exec latency of each process.
+ * - sigusr1: CPU time consumed per SIGUSR1 heartbeat and the delay until the
+ *   watcher handled it.  The signals are sent with sigqueue() from outside,
+ *   so each one resets all the deadlines.
+ * - kill: latency from the deadline to the reaping of each timed out
+ *   process.
+ *
+ * The latencies are taken from the histograms written by "watcher --stats".
+ * The percentiles are the upper bounds of the histogram buckets.
+ *
+ * The event loop backend of the watcher is chosen with --backend, to compare
+ * poll and io_uring.
+ *
+ * Build:
+ *     cc -O2 -o bench-overhead overhead.c
+ * Usage:
+ *     bench-overhead [--backend=BACKEND] WATCHER [PROCESSES...]
+ *
+ * The results are printed as one JSON object per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIGUSR1_INTERVAL_US 200
+#define MEASURE_MS 1000
+#define KILL_TIMEOUT_MS 300
+
+extern char **environ;
+
+/* Passed to the watcher */
+static const char *backend = "poll";
+
+struct histogram_st {
+    double sum;
+    unsigned long long count;
+    /* Upper bounds of the buckets containing the percentiles, in seconds */
+    double p50;
+    double p99;
+};
+
+static long long now_usecs(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (long long)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/**
+ * @brief Start the watcher running nprocs "sleep 1000" commands, discarding
+ * its output.
+ *
+ * @returns The pid of the watcher; -1 on error
+ */
+static pid_t start_watcher(char *watcher, const char *timeout_arg,
+                           const char *stats_arg, long nprocs)
+{
+    posix_spawn_file_actions_t actions;
+    char **argv;
+    char backend_arg[64];
+    long i, n = 0;
+    pid_t pid;
+    int rc;
+
+    snprintf(backend_arg, sizeof(backend_arg), "--backend=%s", backend);
+
+    argv = calloc(5 + 3 * nprocs + 1, sizeof(char *));
+    if (argv == NULL) {
+        return -1;
+    }
+
+    argv[n++] = watcher;
+    argv[n++] = "-m";
+    argv[n++] = (char *)timeout_arg;
+    argv[n++] = (char *)stats_arg;
+    argv[n++] = backend_arg;
+    for (i = 0; i < nprocs; i++) {
+        if (i > 0) {
+            argv[n++] = ";";
+        }
+        argv[n++] = "/bin/sleep";
+        argv[n++] = "1000";
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    free(argv);
+
+    return rc == 0 ? pid : -1;
+}
+
+/**
+ * @brief Read the children of the given process.
+ *
+ * @returns The number of children, up to max, stored in pids
+ */
+static long read_children(pid_t pid, pid_t *pids, long max)
+{
+    char path[64];
+    FILE *file;
+    long n = 0;
+    int child;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+    file = fopen(path, "re");
+    if (file == NULL) {
+        return 0;
+    }
+    while (n < max && fscanf(file, "%d", &child) == 1) {
+        pids[n++] = child;
+    }
+    fclose(file);
+
+    return n;
+}
+
+/**
+ * @brief Read the CPU time in microseconds and the number of context
+ * switches of the given process, not including its children.
+ */
+static int read_usage(pid_t pid, long long *cpu_usecs,
+                      unsigned long long *switches)
+{
+    struct timespec tp;
+    clockid_t clock;
+    char path[64];
+    char line[256];
+    unsigned long long value;
+    FILE *file;
+
+    /* The CPU clock of the process is more precise than /proc/<pid>/stat,
+     * which counts clock ticks */
+    if (clock_getcpuclockid(pid, &clock) != 0 ||
+        clock_gettime(clock, &tp) != 0)
+    {
+        return -1;
+    }
+    *cpu_usecs = (long long)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+
+    *switches = 0;
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    file = fopen(path, "re");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "voluntary_ctxt_switches: %llu", &value) == 1 ||
+            sscanf(line, "nonvoluntary_ctxt_switches: %llu", &value) == 1)
+        {
+            *switches += value;
+        }
+    }
+    fclose(file);
+
+    return 0;
+}
+
+/**
+ * @brief Parse a histogram from a statistics file written by the watcher.
+ */
+static int read_histogram(const char *path, const char *name,
+                          struct histogram_st *h)
+{
+    char line[256];
+    char prefix[128];
+    double bounds[64];
+    unsigned long long cumulative[64];
+    size_t nbuckets = 0;
+    size_t len;
+    FILE *file;
+    size_t i;
+
+    memset(h, 0, sizeof(*h));
+
+    file = fopen(path, "re");
+    if (file == NULL) {
+        return -1;
+    }
+
+    snprintf(prefix, sizeof(prefix), "%s_", name);
+    len = strlen(prefix);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, prefix, len) != 0) {
+            continue;
+        }
+        if (nbuckets < 64 &&
+            sscanf(line + len, "bucket{le=\"%lf\"} %llu", &bounds[nbuckets],
+                   &cumulative[nbuckets]) == 2)
+        {
+            nbuckets++;
+        } else {
+            sscanf(line + len, "sum %lf", &h->sum);
+            sscanf(line + len, "count %llu", &h->count);
+        }
+    }
+    fclose(file);
+
+    /* The +Inf bucket is not parsed, so percentiles in it are reported as
+     * -1 */
+    h->p50 = h->count > 0 ? -1 : 0;
+    h->p99 = h->count > 0 ? -1 : 0;
+    for (i = nbuckets; h->count > 0 && i > 0; i--) {
+        if (cumulative[i - 1] * 100 >= h->count * 50) {
+            h->p50 = bounds[i - 1];
+        }
+        if (cumulative[i - 1] * 100 >= h->count * 99) {
+            h->p99 = bounds[i - 1];
+        }
+    }
+
+    return 0;
+}
+
+static void print_histogram(const char *metric, long nprocs,
+                            struct histogram_st *h)
+{
+    printf("{\"metric\":\"%s\",\"backend\":\"%s\",\"processes\":%ld,"
+           "\"count\":%llu,\"mean_us\":%.1f,\"p50_us\":%.0f,"
+           "\"p99_us\":%.0f}\n",
+           metric, backend, nprocs, h->count,
+           h->count > 0 ? h->sum * 1e6 / h->count : 0.0,
+           h->p50 * 1e6, h->p99 * 1e6);
+}
+
+/**
+ * @brief Measure the idle overhead, the spawn latency and the SIGUSR1
+ * handling cost with nprocs watched processes.
+ */
+static int bench_running(char *watcher, const char *stats_path, long nprocs)
+{
+    long long cpu_start, cpu_end;
+    unsigned long long switches_start, switches_end;
+    long long signals_cpu_usecs;
+    struct histogram_st h;
+    char stats_arg[128];
+    union sigval value;
+    long long start, elapsed;
+    long sent = 0;
+    long tries;
+    long n = 0;
+    pid_t *children;
+    pid_t pid;
+    long i;
+
+    children = calloc(nprocs, sizeof(pid_t));
+    if (children == NULL) {
+        return -1;
+    }
+
+    snprintf(stats_arg, sizeof(stats_arg), "-T%s", stats_path);
+    pid = start_watcher(watcher, "-t600000", stats_arg, nprocs);
+    if (pid < 0) {
+        free(children);
+        return -1;
+    }
+
+    /* Wait until all the processes were started */
+    for (tries = 0; tries < 30000; tries++) {
+        n = read_children(pid, children, nprocs);
+        if (n == nprocs) {
+            break;
+        }
+        usleep(1000);
+    }
+    if (n != nprocs) {
+        fprintf(stderr, "Only %ld of %ld processes started\n", n, nprocs);
+        goto end;
+    }
+
+    /* Idle: nothing happens except the periodic statistics */
+    read_usage(pid, &cpu_start, &switches_start);
+    start = now_usecs();
+    usleep(MEASURE_MS * 1000);
+    elapsed = now_usecs() - start;
+    read_usage(pid, &cpu_end, &switches_end);
+
+    printf("{\"metric\":\"idle\",\"backend\":\"%s\",\"processes\":%ld,"
+           "\"cpu_percent\":%.4f,\"wakeups_per_sec\":%.1f}\n",
+           backend, nprocs,
+           (cpu_end - cpu_start) * 100.0 / elapsed,
+           (switches_end - switches_start) * 1e6 / elapsed);
+
+    /* SIGUSR1: the signals sent while one is pending are merged, the
+     * histogram tells how many were handled */
+    read_usage(pid, &cpu_start, &switches_start);
+    start = now_usecs();
+    while (now_usecs() - start < MEASURE_MS * 1000) {
+        value.sival_ptr = (void *)(intptr_t)now_usecs();
+        sigqueue(pid, SIGUSR1, value);
+        sent++;
+        usleep(SIGUSR1_INTERVAL_US);
+    }
+    read_usage(pid, &cpu_end, &switches_end);
+    signals_cpu_usecs = cpu_end - cpu_start;
+
+    /* Let the watcher reap the processes and write its statistics */
+    for (i = 0; i < nprocs; i++) {
+        kill(children[i], SIGKILL);
+    }
+    waitpid(pid, NULL, 0);
+    pid = -1;
+
+    read_histogram(stats_path, "watcher_spawn_seconds", &h);
+    print_histogram("spawn", nprocs, &h);
+
+    read_histogram(stats_path, "watcher_sigusr1_delay_seconds", &h);
+    printf("{\"metric\":\"sigusr1\",\"backend\":\"%s\",\"processes\":%ld,"
+           "\"sent\":%ld,\"handled\":%llu,\"cpu_us_per_signal\":%.2f,"
+           "\"delay_mean_us\":%.1f,\"delay_p99_us\":%.0f}\n",
+           backend, nprocs, sent, h.count,
+           h.count > 0 ? (double)signals_cpu_usecs / h.count : 0.0,
+           h.count > 0 ? h.sum * 1e6 / h.count : 0.0, h.p99 * 1e6);
+
+end:
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    free(children);
+    return 0;
+}
+
+/**
+ * @brief Measure the latency from the deadline to the reaping of nprocs
+ * processes which time out together.
+ */
+static int bench_kill(char *watcher, const char *stats_path, long nprocs)
+{
+    struct histogram_st h;
+    char timeout_arg[32];
+    char stats_arg[128];
+    pid_t pid;
+
+    snprintf(timeout_arg, sizeof(timeout_arg), "-t%d", KILL_TIMEOUT_MS);
+    snprintf(stats_arg, sizeof(stats_arg), "-T%s", stats_path);
+    pid = start_watcher(watcher, timeout_arg, stats_arg, nprocs);
+    if (pid < 0) {
+        return -1;
+    }
+    waitpid(pid, NULL, 0);
+
+    read_histogram(stats_path, "watcher_kill_seconds", &h);
+    print_histogram("kill", nprocs, &h);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const long default_procs[] = {1, 10, 100, 1000};
+    char stats_path[64];
+    long nprocs;
+    long n, i;
+
+    if (argc > 1 && strncmp(argv[1], "--backend=", 10) == 0) {
+        backend = argv[1] + 10;
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [--backend=BACKEND] WATCHER "
+                "[PROCESSES...]\n", argv[0]);
+        return 1;
+    }
+
+    snprintf(stats_path, sizeof(stats_path), "/tmp/bench-overhead-%d.prom",
+             getpid());
+
+    n = (argc > 2) ? argc - 2 :
+                     (long)(sizeof(default_procs) / sizeof(long));
+    for (i = 0; i < n; i++) {
+        nprocs = (argc > 2) ? strtol(argv[i + 2], NULL, 10) :
+                              default_procs[i];
+        if (nprocs <= 0) {
+            fprintf(stderr, "Invalid number of processes\n");
+            return 1;
+        }
+
+        if (bench_running(argv[1], stats_path, nprocs) != 0 ||
+            bench_kill(argv[1], stats_path, nprocs) != 0)
+        {
+            fprintf(stderr, "Could not start the watcher: %s\n",
+                    strerror(errno));
+            return 1;
+        }
+        fflush(stdout);
+    }
+
+    unlink(stats_path);
+    return 0;
+}
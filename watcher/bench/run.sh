@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Build the watcher, watcher-timeline, libwatcher (shared and static) and the
+# benchmarks, then run the benchmarks.  The results are printed as one JSON
+# object per line:
+#
+# $ watcher/bench/run.sh > bench_output.txt
+#
+# The compiler, archiver and flags can be changed with CC, AR and CFLAGS.
+# The binaries are built in BUILDDIR, a temporary directory by default.
+# PROCESSES sets the numbers of concurrently watched processes for
+# bench-overhead, which runs once per event loop backend in BACKENDS.
+
+set -e
+
+SRCDIR=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+AR=${AR:-ar}
+CFLAGS=${CFLAGS:--O2}
+PROCESSES=${PROCESSES:-1 10 100 1000}
+BACKENDS=${BACKENDS:-poll io_uring}
+
+if [ -z "$BUILDDIR" ]; then
+    BUILDDIR=$(mktemp -d /tmp/watcher-bench.XXXXXX)
+    trap 'rm -rf "$BUILDDIR"' EXIT
+fi
+
+$CC $CFLAGS -I"$SRCDIR" -o "$BUILDDIR/watcher" \
+    "$SRCDIR/watcher.c" "$SRCDIR/libwatcher.c"
+$CC $CFLAGS -I"$SRCDIR" -o "$BUILDDIR/watcher-timeline" "$SRCDIR/timeline.c"
+$CC $CFLAGS -fPIC -shared -I"$SRCDIR" -o "$BUILDDIR/libwatcher.so" \
+    "$SRCDIR/libwatcher.c"
+$CC $CFLAGS -I"$SRCDIR" -c -o "$BUILDDIR/libwatcher.o" "$SRCDIR/libwatcher.c"
+$AR rcs "$BUILDDIR/libwatcher.a" "$BUILDDIR/libwatcher.o"
+for bench in overhead spawn daemon; do
+    $CC $CFLAGS -o "$BUILDDIR/bench-$bench" "$SRCDIR/bench/$bench.c"
+done
+
+for backend in $BACKENDS; do
+    "$BUILDDIR/bench-overhead" --backend="$backend" "$BUILDDIR/watcher" \
+        $PROCESSES
+done
+"$BUILDDIR/bench-spawn" 200 0 256
+"$BUILDDIR/bench-daemon" "$BUILDDIR/watcher" 1000 1 64
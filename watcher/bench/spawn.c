@@ -0,0 +1,225 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Spawn-to-exec latency of the methods the watcher can use to start a
+ * process: fork(), clone3() and posix_spawn().
+ *
+ * The parent first maps and touches a configurable amount of memory, to show
+ * how the cost of copying its page tables grows with its size.  The latency
+ * is measured from the start of the spawn until the child executed the
+ * command, which the parent learns when the close-on-exec pipe is closed
+ * (posix_spawn() itself only returns after the exec).
+ *
+ * Build:
+ *     cc -O2 -o bench-spawn spawn.c
+ * Usage:
+ *     bench-spawn [ITERATIONS] [PARENT_MB...]
+ *
+ * The results are printed as one JSON object per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/sched.h>
+
+#define COMMAND "/bin/true"
+
+extern char **environ;
+
+enum method_e {
+    METHOD_FORK,
+    METHOD_CLONE3,
+    METHOD_POSIX_SPAWN,
+};
+
+static const char *method_names[] = {
+    "fork",
+    "clone3",
+    "posix_spawn",
+};
+
+static long long now_nsecs(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (long long)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+static void child_exec(int err_fd)
+{
+    char *argv[] = {COMMAND, NULL};
+    int err;
+
+    execve(argv[0], argv, environ);
+    err = errno;
+    if (write(err_fd, &err, sizeof(err)) < 0) {
+        /* The exit code tells the failure */
+    }
+    _exit(127);
+}
+
+/**
+ * @brief Start the command and wait until it is executed.
+ *
+ * @returns The pid of the child; -1 on error
+ */
+static pid_t spawn(enum method_e method)
+{
+    char *argv[] = {COMMAND, NULL};
+    struct clone_args args;
+    int err_pipe[2];
+    int pidfd = -1;
+    pid_t pid;
+    int err;
+    int rc;
+
+    if (method == METHOD_POSIX_SPAWN) {
+        rc = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+        return rc == 0 ? pid : -1;
+    }
+
+    if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+        return -1;
+    }
+
+    if (method == METHOD_CLONE3) {
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_PIDFD;
+        args.pidfd = (uint64_t)(uintptr_t)&pidfd;
+        args.exit_signal = SIGCHLD;
+        pid = syscall(SYS_clone3, &args, sizeof(args));
+    } else {
+        pid = fork();
+    }
+
+    if (pid == 0) {
+        child_exec(err_pipe[1]);
+    }
+
+    close(err_pipe[1]);
+    if (pid > 0) {
+        while (read(err_pipe[0], &err, sizeof(err)) < 0 && errno == EINTR);
+    }
+    close(err_pipe[0]);
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+
+    return pid;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    static const long default_sizes[] = {0, 256, 1024};
+    long long *samples;
+    long long start;
+    long iterations = 1000;
+    long nsizes;
+    long size_mb;
+    long i, s;
+    char *memory;
+    pid_t pid;
+    int m;
+
+    if (argc > 1) {
+        iterations = strtol(argv[1], NULL, 10);
+    }
+    nsizes = (argc > 2) ? argc - 2 :
+                          (long)(sizeof(default_sizes) / sizeof(long));
+
+    samples = calloc(iterations, sizeof(long long));
+    if (iterations <= 0 || samples == NULL) {
+        fprintf(stderr, "Invalid number of iterations\n");
+        return 1;
+    }
+
+    for (s = 0; s < nsizes; s++) {
+        size_mb = (argc > 2) ? strtol(argv[s + 2], NULL, 10) :
+                               default_sizes[s];
+
+        memory = NULL;
+        if (size_mb > 0) {
+            memory = mmap(NULL, size_mb << 20, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                fprintf(stderr, "Could not map %ld MiB\n", size_mb);
+                return 1;
+            }
+            memset(memory, 1, size_mb << 20);
+        }
+
+        for (m = METHOD_FORK; m <= METHOD_POSIX_SPAWN; m++) {
+            for (i = 0; i < iterations; i++) {
+                start = now_nsecs();
+                pid = spawn(m);
+                samples[i] = now_nsecs() - start;
+                if (pid < 0) {
+                    fprintf(stderr, "%s failed: %s\n", method_names[m],
+                            strerror(errno));
+                    return 1;
+                }
+                waitpid(pid, NULL, 0);
+            }
+
+            qsort(samples, iterations, sizeof(long long), compare);
+            printf("{\"method\":\"%s\",\"parent_mb\":%ld,\"iterations\":%ld,"
+                   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+                   method_names[m], size_mb, iterations,
+                   samples[iterations / 2] / 1000.0,
+                   samples[iterations * 99 / 100] / 1000.0,
+                   samples[iterations - 1] / 1000.0);
+            fflush(stdout);
+        }
+
+        if (memory != NULL) {
+            munmap(memory, size_mb << 20);
+        }
+    }
+
+    free(samples);
+    return 0;
+}
@@ -27,3 +27,9 @@
 #define HAVE_SYS_TIME_H 1
 #define HAVE_SYS_TIME_H 1
 #define HAVE_CLOCK_GETTIME 1
+#define HAVE_POLL_H 1
+#define HAVE_SYS_SYSCALL_H 1
+#define HAVE_LINUX_SCHED_H 1
+#define HAVE_LINUX_MEMPOLICY_H 1
+#define HAVE_LINUX_IO_URING_H 1
+#define HAVE_LINUX_PERF_EVENT_H 1
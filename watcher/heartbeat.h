@@ -0,0 +1,111 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Heartbeat channel shared between the watcher and the watched process.
+ *
+ * When the watcher is started with --heartbeat, it maps a
+ * struct watcher_heartbeat_st in shared memory and passes the file descriptor
+ * to the watched process in the WATCHER_HEARTBEAT_FD environment variable.
+ *
+ * The watched process attaches to it once with watcher_heartbeat_attach() and
+ * then calls watcher_heartbeat() as often as it wants.  A heartbeat is a
+ * single atomic increment in memory: no signal or system call is involved.
+ * The watcher only reads the counter when the deadline of the process
+ * expires, so a process is killed after it sends no heartbeat for a whole
+ * timeout period, at most two timeout periods after its last heartbeat.
+ *
+ * The progress value is free-form and is reported by the watcher when the
+ * process times out.
+ */
+
+#ifndef WATCHER_HEARTBEAT_H
+#define WATCHER_HEARTBEAT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define WATCHER_HEARTBEAT_ENV "WATCHER_HEARTBEAT_FD"
+
+struct watcher_heartbeat_st {
+    /* Incremented on every heartbeat */
+    uint64_t count;
+    /* Last progress value reported */
+    uint64_t progress;
+};
+
+/**
+ * @brief Map the heartbeat channel passed by the watcher.
+ *
+ * The file descriptor is kept open so that it is inherited by the children
+ * of the watched process.
+ *
+ * @returns The heartbeat channel; NULL if the process is not being watched
+ * with a heartbeat channel
+ */
+static inline struct watcher_heartbeat_st *watcher_heartbeat_attach(void)
+{
+    struct watcher_heartbeat_st *hb;
+    const char *value;
+    char *end = NULL;
+    long fd;
+
+    value = getenv(WATCHER_HEARTBEAT_ENV);
+    if (value == NULL) {
+        return NULL;
+    }
+
+    fd = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || fd < 0) {
+        return NULL;
+    }
+
+    hb = mmap(NULL, sizeof(struct watcher_heartbeat_st),
+              PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd, 0);
+    if (hb == MAP_FAILED) {
+        return NULL;
+    }
+
+    return hb;
+}
+
+/**
+ * @brief Reset the timeout of the watched process and report its progress.
+ *
+ * @param[in] hb        The channel returned by watcher_heartbeat_attach().
+ *                      Ignored if NULL.
+ * @param[in] progress  The progress value to report
+ */
+static inline void watcher_heartbeat(struct watcher_heartbeat_st *hb,
+                                     uint64_t progress)
+{
+    if (hb == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&hb->progress, progress, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hb->count, 1, __ATOMIC_RELEASE);
+}
+
+#endif /* WATCHER_HEARTBEAT_H */
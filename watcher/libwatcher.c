@@ -0,0 +1,1821 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The watched jobs and the libwatcher API.
+ *
+ * The job functions start, signal and reap a single process and release its
+ * resources.  They use no global state, so they are shared by the watcher
+ * event loop in watcher.c and by the watcher_process_* functions at the end
+ * of this file, which wait for the processes without signal handlers.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include <time.h>
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mntent.h>
+#include <spawn.h>
+
+#ifdef HAVE_LINUX_SCHED_H
+#include <linux/sched.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "watcher.h"
+
+#ifdef _POSIX_MONOTONIC_CLOCK
+#define CLOCK CLOCK_MONOTONIC
+#else
+#define CLOCK CLOCK_REALTIME
+#endif
+
+#ifdef HAVE_CLOCK_GETTIME
+int watcher_timestamp(struct timestamp_st *ts)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK, &tp);
+    ts->useconds = tp.tv_nsec / 1000;
+#else
+    struct timeval tp;
+    gettimeofday(&tp, NULL);
+    ts->useconds = tp.tv_usec;
+#endif
+    ts->seconds = tp.tv_sec;
+
+    return 0;
+}
+
+#undef CLOCK
+
+long long watcher_timestamp_msecs(struct timestamp_st *ts)
+{
+    return (long long)ts->seconds * 1000 + ts->useconds / 1000;
+}
+
+long long watcher_timestamp_usecs(struct timestamp_st *ts)
+{
+    return (long long)ts->seconds * 1000000 + ts->useconds;
+}
+
+/**
+ * @brief Read the I/O counters of the given process from /proc/<pid>/io.
+ *
+ * This must be called before the process is reaped.  The counters which could
+ * not be read are set to -1.
+ */
+static void watcher_read_io(pid_t pid, struct watcher_usage_st *usage)
+{
+    char path[64];
+    char line[128];
+    char name[64];
+    long long value;
+    FILE *file;
+
+    usage->rchar = -1;
+    usage->wchar = -1;
+    usage->read_bytes = -1;
+    usage->write_bytes = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "%63[^:]: %lld", name, &value) != 2) {
+            continue;
+        }
+        if (strcmp(name, "rchar") == 0) {
+            usage->rchar = value;
+        } else if (strcmp(name, "wchar") == 0) {
+            usage->wchar = value;
+        } else if (strcmp(name, "read_bytes") == 0) {
+            usage->read_bytes = value;
+        } else if (strcmp(name, "write_bytes") == 0) {
+            usage->write_bytes = value;
+        }
+    }
+
+    fclose(file);
+}
+
+/**
+ * @brief Reap the process of the given job if it finished, collecting its
+ * resource usage.
+ *
+ * @param[in]  job      The job of the watched process
+ * @param[out] status   The process status as returned by waitpid()
+ * @param[in]  options  The options for wait4(), e.g. WNOHANG
+ *
+ * @returns The same as waitpid()
+ */
+pid_t watcher_job_wait(struct watcher_job *job, int *status,
+                       int options)
+{
+    struct timestamp_st now;
+    siginfo_t info;
+    pid_t changed_pid;
+    int rc;
+
+    if (job->accounting != NULL || job->read_io) {
+        /* The I/O counters are gone once the process is reaped, so check if
+         * it finished without reaping it first */
+        info.si_pid = 0;
+        rc = waitid(P_PID, job->pid, &info, WEXITED | WNOWAIT |
+                    ((options & WNOHANG) ? WNOHANG : 0));
+        if (rc == 0 && info.si_pid == job->pid) {
+            watcher_read_io(job->pid, &job->usage);
+        }
+    }
+
+    changed_pid = wait4(job->pid, status, options, &job->usage.rusage);
+    if (changed_pid == job->pid) {
+        watcher_timestamp(&now);
+        job->usage.wall_msecs = watcher_timestamp_msecs(&now) -
+                                watcher_timestamp_msecs(&job->start);
+    }
+
+    return changed_pid;
+}
+
+static void watcher_json_string(FILE *file, const char *str)
+{
+    const unsigned char *c;
+
+    fputc('"', file);
+    for (c = (const unsigned char *)str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static long long watcher_timeval_usecs(const struct timeval *tv)
+{
+    return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/**
+ * @brief Write the accounting record of the given job to the given file as a
+ * single line JSON object.
+ */
+void watcher_accounting_write(const struct watcher_job *job, FILE *file,
+                              int watcher_exit, int status, bool reaped)
+{
+    const struct rusage *ru = &job->usage.rusage;
+    int i;
+
+    if (file == NULL) {
+        return;
+    }
+
+    fprintf(file, "{\"id\":%" PRIu64 ",\"pid\":%d,\"argv\":[", job->id,
+            job->pid);
+    for (i = 0; job->argv != NULL && job->argv[i] != NULL; i++) {
+        if (i > 0) {
+            fputc(',', file);
+        }
+        watcher_json_string(file, job->argv[i]);
+    }
+    fprintf(file, "],\"watcher_exit\":%d,\"timed_out\":%s",
+            watcher_exit, job->timed_out ? "true" : "false");
+
+    if (!reaped) {
+        fprintf(file, ",\"reaped\":false}\n");
+        fflush(file);
+        return;
+    }
+
+    if (WIFEXITED(status)) {
+        fprintf(file, ",\"exit_code\":%d", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        fprintf(file, ",\"signal\":%d", WTERMSIG(status));
+    }
+
+    /* ru_maxrss is in kilobytes on Linux */
+    fprintf(file, ",\"wall_ms\":%lld,\"user_us\":%lld,\"sys_us\":%lld,"
+            "\"max_rss_kb\":%ld,\"major_faults\":%ld,\"minor_faults\":%ld,"
+            "\"voluntary_ctxt_switches\":%ld,"
+            "\"involuntary_ctxt_switches\":%ld,"
+            "\"rchar\":%lld,\"wchar\":%lld,"
+            "\"read_bytes\":%lld,\"write_bytes\":%lld}\n",
+            job->usage.wall_msecs,
+            watcher_timeval_usecs(&ru->ru_utime),
+            watcher_timeval_usecs(&ru->ru_stime),
+            ru->ru_maxrss, ru->ru_majflt, ru->ru_minflt,
+            ru->ru_nvcsw, ru->ru_nivcsw,
+            job->usage.rchar, job->usage.wchar,
+            job->usage.read_bytes, job->usage.write_bytes);
+    fflush(file);
+}
+
+/**
+ * @brief Write a value to a cgroup interface file.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+static int watcher_cgroup_write(int dirfd, const char *name,
+                                const char *value)
+{
+    ssize_t written;
+    int saved_errno;
+    int fd;
+
+    fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    written = write(fd, value, strlen(value));
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+
+    return written < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Find the cgroup v2 directory of the watcher process.
+ *
+ * @returns The path, which must be freed by the caller; NULL on error
+ */
+char *watcher_cgroup_self(void)
+{
+    struct mntent *ent;
+    char line[PATH_MAX];
+    char *mount_point = NULL;
+    char *path = NULL;
+    FILE *file;
+    int rc;
+
+    file = setmntent("/proc/self/mounts", "re");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    while ((ent = getmntent(file)) != NULL) {
+        if (strcmp(ent->mnt_type, "cgroup2") == 0) {
+            mount_point = strdup(ent->mnt_dir);
+            break;
+        }
+    }
+    endmntent(file);
+
+    if (mount_point == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    file = fopen("/proc/self/cgroup", "re");
+    if (file == NULL) {
+        free(mount_point);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            rc = asprintf(&path, "%s%s", mount_point, line + 3);
+            if (rc < 0) {
+                path = NULL;
+            }
+            break;
+        }
+    }
+
+    fclose(file);
+    free(mount_point);
+
+    return path;
+}
+
+/**
+ * @brief Enable the controllers needed for the limits in the parent cgroup.
+ *
+ * The parent cgroup must not contain processes, otherwise the kernel refuses
+ * to enable controllers for its children.
+ *
+ * @returns 0 on success; -1 with errno set otherwise
+ */
+int watcher_cgroup_prepare(const char *parent, bool memory, bool cpu)
+{
+    int saved_errno;
+    int dirfd;
+    int rc = 0;
+
+    dirfd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return -1;
+    }
+
+    if (memory) {
+        rc = watcher_cgroup_write(dirfd, "cgroup.subtree_control", "+memory");
+    }
+    if (rc == 0 && cpu) {
+        rc = watcher_cgroup_write(dirfd, "cgroup.subtree_control", "+cpu");
+    }
+
+    saved_errno = errno;
+    close(dirfd);
+    errno = saved_errno;
+    return rc;
+}
+
+/**
+ * @brief Create the cgroup for the given job and apply its limits.
+ *
+ * @returns 0 on success; -1 with errno set otherwise
+ */
+static int watcher_cgroup_create(struct watcher_job *job)
+{
+    static unsigned int count = 0;
+    int rc;
+
+    /* Jobs may be started from several threads by libwatcher */
+    rc = asprintf(&job->cgroup_path, "%s/watcher-%d-%u", job->cgroup_parent,
+                  getpid(), __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
+    if (rc < 0) {
+        job->cgroup_path = NULL;
+        return -1;
+    }
+
+    rc = mkdir(job->cgroup_path, 0755);
+    if (rc != 0) {
+        free(job->cgroup_path);
+        job->cgroup_path = NULL;
+        return -1;
+    }
+
+    job->cgroup_fd = open(job->cgroup_path,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job->cgroup_fd < 0) {
+        return -1;
+    }
+
+    if (job->memory_max != NULL) {
+        rc = watcher_cgroup_write(job->cgroup_fd, "memory.max",
+                                  job->memory_max);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+
+    if (job->cpu_max != NULL) {
+        rc = watcher_cgroup_write(job->cgroup_fd, "cpu.max", job->cpu_max);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+
+    /* Used by the child to move itself to the cgroup before exec */
+    job->cgroup_procs_fd = openat(job->cgroup_fd, "cgroup.procs",
+                                  O_WRONLY | O_CLOEXEC);
+    if (job->cgroup_procs_fd < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send a signal to all processes in the cgroup of the given job.
+ *
+ * SIGKILL is sent atomically with cgroup.kill (Linux >= 5.14).  Other signals,
+ * or SIGKILL on older kernels, are sent to each process while the cgroup is
+ * frozen, so no process can escape by forking.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+static int watcher_cgroup_signal(struct watcher_job *job, int signo)
+{
+    FILE *file;
+    bool frozen;
+    int fd;
+    int pid;
+    int rc;
+
+    if (signo == SIGKILL) {
+        rc = watcher_cgroup_write(job->cgroup_fd, "cgroup.kill", "1");
+        if (rc == 0) {
+            return 0;
+        }
+    }
+
+    frozen = (watcher_cgroup_write(job->cgroup_fd, "cgroup.freeze", "1") == 0);
+
+    rc = kill(job->pid, signo);
+
+    fd = openat(job->cgroup_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+    file = (fd >= 0) ? fdopen(fd, "r") : NULL;
+    if (file != NULL) {
+        while (fscanf(file, "%d", &pid) == 1) {
+            kill(pid, signo);
+        }
+        fclose(file);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (frozen) {
+        watcher_cgroup_write(job->cgroup_fd, "cgroup.freeze", "0");
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Kill the processes left in the cgroup of the given job and remove
+ * the cgroup.
+ *
+ * @returns 0 on success; -1 with errno set if the cgroup could not be removed
+ */
+int watcher_cgroup_cleanup(struct watcher_job *job)
+{
+    struct pollfd pfd;
+    char events[256];
+    ssize_t nread;
+    int saved_errno;
+    int count;
+    int fd;
+    int rc = 0;
+
+    if (job->cgroup_procs_fd >= 0) {
+        close(job->cgroup_procs_fd);
+        job->cgroup_procs_fd = -1;
+    }
+
+    if (job->cgroup_fd < 0) {
+        goto end;
+    }
+
+    fd = openat(job->cgroup_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+    for (count = 0; fd >= 0 && count < 10; count++) {
+        nread = pread(fd, events, sizeof(events) - 1, 0);
+        if (nread <= 0) {
+            break;
+        }
+        events[nread] = '\0';
+        if (strstr(events, "populated 0") != NULL) {
+            break;
+        }
+
+        /* Kill what the watched process left behind and wait for the cgroup
+         * to become empty; cgroup.events is modified when it happens */
+        if (count == 0) {
+            watcher_cgroup_signal(job, SIGKILL);
+        }
+        pfd.fd = fd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+        poll(&pfd, 1, 100);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    close(job->cgroup_fd);
+    job->cgroup_fd = -1;
+
+end:
+    if (job->cgroup_path != NULL) {
+        rc = rmdir(job->cgroup_path);
+        saved_errno = errno;
+        free(job->cgroup_path);
+        job->cgroup_path = NULL;
+        errno = saved_errno;
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Send a signal to the watched process and, if it runs in its own
+ * cgroup, to all its descendants.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+int watcher_job_signal(struct watcher_job *job, int signo)
+{
+    if (job->cgroup_fd >= 0) {
+        return watcher_cgroup_signal(job, signo);
+    }
+
+    return kill(job->pid, signo);
+}
+
+/**
+ * @brief Freeze or thaw the watched process and, if it runs in its own cgroup,
+ * all its descendants.
+ *
+ * Without a cgroup, the process is stopped with SIGSTOP and continued with
+ * SIGCONT.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+int watcher_job_freeze(struct watcher_job *job, bool frozen)
+{
+    if (job->cgroup_fd >= 0) {
+        return watcher_cgroup_write(job->cgroup_fd, "cgroup.freeze",
+                                    frozen ? "1" : "0");
+    }
+
+    return kill(job->pid, frozen ? SIGSTOP : SIGCONT);
+}
+
+/**
+ * @brief Marshal the command and environment of a job into its arena.
+ *
+ * The arena is a single allocation sized to the input which holds the argv
+ * pointer array, the env pointer array and all the strings, one after the
+ * other.  The env array has room for one more variable, used to pass the
+ * heartbeat channel, so launching the process needs no further allocation.
+ *
+ * @param[in] job   The job; the arena must be freed with free(job->arena)
+ * @param[in] argv  The command and its arguments
+ * @param[in] argc  The number of elements in argv
+ * @param[in] env   The environment variables; can be NULL if envc is 0
+ * @param[in] envc  The number of elements in env
+ *
+ * @returns 0 on success; a watcher exit code otherwise
+ */
+int watcher_job_marshal(struct watcher_job *job, char **argv,
+                        size_t argc, char **env, size_t envc)
+{
+    size_t size;
+    long arg_max;
+    char *p;
+    size_t i;
+
+    arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) {
+        arg_max = LONG_MAX;
+    }
+
+    size = (argc + 1 + envc + 2) * sizeof(char *);
+    for (i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+    if (size > (size_t)arg_max) {
+        errno = E2BIG;
+        return WATCHER_COMMAND_TOO_LONG;
+    }
+
+    for (i = 0; i < envc; i++) {
+        size += strlen(env[i]) + 1;
+    }
+    if (size > (size_t)arg_max) {
+        errno = E2BIG;
+        return WATCHER_ENV_TOO_LONG;
+    }
+
+    job->arena = malloc(size);
+    if (job->arena == NULL) {
+        return WATCHER_OOM;
+    }
+
+    job->argv = job->arena;
+    job->env = job->argv + argc + 1;
+    job->envc = envc;
+    p = (char *)(job->env + envc + 2);
+
+    for (i = 0; i < argc; i++) {
+        job->argv[i] = p;
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    job->argv[argc] = NULL;
+
+    for (i = 0; i < envc; i++) {
+        job->env[i] = p;
+        p = stpcpy(p, env[i]) + 1;
+    }
+    job->env[envc] = NULL;
+    job->env[envc + 1] = NULL;
+
+    return 0;
+}
+
+/**
+ * @brief Create the shared memory heartbeat channel for the given job.
+ *
+ * The channel is passed to the watched process as an inherited file
+ * descriptor whose number is set in the WATCHER_HEARTBEAT_FD environment
+ * variable.
+ *
+ * @returns 0 on success; -1 with errno set otherwise
+ */
+static int watcher_heartbeat_setup(struct watcher_job *job)
+{
+    int rc;
+
+    job->heartbeat_fd = memfd_create("watcher-heartbeat", MFD_CLOEXEC);
+    if (job->heartbeat_fd < 0) {
+        return -1;
+    }
+
+    rc = ftruncate(job->heartbeat_fd, sizeof(struct watcher_heartbeat_st));
+    if (rc != 0) {
+        return -1;
+    }
+
+    job->heartbeat = mmap(NULL, sizeof(struct watcher_heartbeat_st),
+                          PROT_READ | PROT_WRITE, MAP_SHARED,
+                          job->heartbeat_fd, 0);
+    if (job->heartbeat == MAP_FAILED) {
+        job->heartbeat = NULL;
+        return -1;
+    }
+    job->heartbeat_count = 0;
+
+    snprintf(job->heartbeat_var, sizeof(job->heartbeat_var), "%s=%d",
+             WATCHER_HEARTBEAT_ENV, job->heartbeat_fd);
+
+    /* The arena has room for one more environment variable */
+    job->env[job->envc] = job->heartbeat_var;
+    job->env[job->envc + 1] = NULL;
+
+    return 0;
+}
+
+void watcher_heartbeat_cleanup(struct watcher_job *job)
+{
+    if (job->heartbeat != NULL) {
+        munmap(job->heartbeat, sizeof(struct watcher_heartbeat_st));
+        job->heartbeat = NULL;
+    }
+
+    if (job->heartbeat_fd >= 0) {
+        close(job->heartbeat_fd);
+        job->heartbeat_fd = -1;
+    }
+
+    if (job->env != NULL) {
+        job->env[job->envc] = NULL;
+    }
+}
+
+/**
+ * @brief Check if the watched process sent heartbeats through the shared
+ * memory channel since the last check.
+ *
+ * @returns true if the heartbeat counter changed; false otherwise
+ */
+bool watcher_heartbeat_changed(struct watcher_job *job)
+{
+    uint64_t count;
+
+    if (job->heartbeat == NULL) {
+        return false;
+    }
+
+    count = __atomic_load_n(&job->heartbeat->count, __ATOMIC_ACQUIRE);
+    if (count == job->heartbeat_count) {
+        return false;
+    }
+
+    job->heartbeat_count = count;
+    return true;
+}
+
+/**
+ * @brief Create the pipe to capture stdout and stderr of the given job, and
+ * where the output is stored: an in-memory ring buffer or the log file.
+ *
+ * @returns 0 on success; -1 with errno set otherwise
+ */
+static int watcher_capture_setup(struct watcher_job *job)
+{
+    int pipefd[2];
+    int rc;
+
+    rc = pipe2(pipefd, O_CLOEXEC);
+    if (rc != 0) {
+        return -1;
+    }
+    job->output_fd = pipefd[0];
+    job->output_write_fd = pipefd[1];
+    job->output_len = 0;
+
+    rc = fcntl(job->output_fd, F_SETFL, O_NONBLOCK);
+    if (rc != 0) {
+        return -1;
+    }
+
+    if (job->log_file != NULL) {
+        /* The tail is read back from the log file */
+        job->log_fd = open(job->log_file,
+                           O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (job->log_fd < 0) {
+            job->spawn_error = "Could not open the log file";
+            return -1;
+        }
+        return 0;
+    }
+
+    job->ring_fd = memfd_create("watcher-output", MFD_CLOEXEC);
+    if (job->ring_fd < 0) {
+        return -1;
+    }
+
+    return ftruncate(job->ring_fd, job->capture_size);
+}
+
+/**
+ * @brief Move the output available in the pipe of the given job to the log
+ * file or ring buffer.
+ *
+ * The data is moved with splice(), so it is never copied to userspace.  The
+ * pipe is closed when all its writers are gone.
+ */
+void watcher_capture_drain(struct watcher_job *job)
+{
+    loff_t offset;
+    size_t len;
+    ssize_t moved;
+
+    while (job->output_fd >= 0) {
+        if (job->log_fd >= 0) {
+            moved = splice(job->output_fd, NULL, job->log_fd, NULL, 1 << 20,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            /* Write up to the end of the ring and wrap around */
+            offset = job->output_len % job->capture_size;
+            len = job->capture_size - offset;
+            moved = splice(job->output_fd, NULL, job->ring_fd, &offset, len,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+
+        if (moved > 0) {
+            job->output_len += moved;
+            continue;
+        }
+
+        if (moved < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+
+        /* End of file or error, stop capturing */
+        close(job->output_fd);
+        job->output_fd = -1;
+    }
+}
+
+void watcher_capture_cleanup(struct watcher_job *job)
+{
+    if (job->output_write_fd >= 0) {
+        close(job->output_write_fd);
+        job->output_write_fd = -1;
+    }
+
+    if (job->output_fd >= 0) {
+        close(job->output_fd);
+        job->output_fd = -1;
+    }
+
+    if (job->ring_fd >= 0) {
+        close(job->ring_fd);
+        job->ring_fd = -1;
+    }
+
+    if (job->log_fd >= 0) {
+        close(job->log_fd);
+        job->log_fd = -1;
+    }
+}
+
+/**
+ * @brief Parse a list of numbers and ranges such as "0-3,8,10-11", as used
+ * for CPU and NUMA node lists, into a bit mask of nbits bits.
+ *
+ * @returns 0 on success; -1 if the list is invalid or has a number >= nbits
+ */
+int watcher_parse_list(const char *list, unsigned long *mask,
+                       size_t nbits)
+{
+    const char *p = list;
+    unsigned long first, last, i;
+    char *end;
+
+    memset(mask, 0, (nbits + WATCHER_NODE_BITS - 1) / WATCHER_NODE_BITS *
+           sizeof(unsigned long));
+
+    for (;;) {
+        errno = 0;
+        first = strtoul(p, &end, 10);
+        if (end == p || errno != 0) {
+            return -1;
+        }
+
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p || errno != 0) {
+                return -1;
+            }
+        }
+
+        if (first > last || last >= nbits) {
+            return -1;
+        }
+
+        for (i = first; i <= last; i++) {
+            mask[i / WATCHER_NODE_BITS] |= 1UL << (i % WATCHER_NODE_BITS);
+        }
+
+        /* The lists in sysfs end with a newline */
+        if (*end == '\0' || (*end == '\n' && end[1] == '\0')) {
+            return 0;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        p = end + 1;
+    }
+}
+
+/**
+ * @brief Parse a CPU list such as "0-3,8" into a CPU set.
+ *
+ * @returns 0 on success; -1 if the list is invalid
+ */
+int watcher_parse_cpus(const char *list, cpu_set_t *cpus)
+{
+    unsigned long mask[CPU_SETSIZE / WATCHER_NODE_BITS];
+    size_t i;
+
+    if (list == NULL || watcher_parse_list(list, mask, CPU_SETSIZE) != 0) {
+        return -1;
+    }
+
+    CPU_ZERO(cpus);
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (mask[i / WATCHER_NODE_BITS] & (1UL << (i % WATCHER_NODE_BITS))) {
+            CPU_SET(i, cpus);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Apply the placement to the calling process.  If cpu >= 0, the
+ * process is pinned to that CPU instead of the CPUs of the placement.
+ *
+ * This runs in the child, so only async-signal-safe functions are used.
+ *
+ * @returns 0 on success; -1 otherwise, with errno set
+ */
+int watcher_placement_apply(const struct watcher_placement_st *p,
+                            int cpu)
+{
+    struct sched_param param;
+    cpu_set_t single;
+
+    if (p->set_mempolicy &&
+        syscall(SYS_set_mempolicy, p->mempolicy,
+                p->mempolicy == MPOL_DEFAULT ? NULL : p->nodes,
+                p->mempolicy == MPOL_DEFAULT ? 0 : WATCHER_MAX_NODES + 1) != 0)
+    {
+        return -1;
+    }
+
+    if (cpu >= 0) {
+        CPU_ZERO(&single);
+        CPU_SET(cpu, &single);
+        if (sched_setaffinity(0, sizeof(single), &single) != 0) {
+            return -1;
+        }
+    } else if (p->set_cpus &&
+               sched_setaffinity(0, sizeof(p->cpus), &p->cpus) != 0)
+    {
+        return -1;
+    }
+
+    if (p->set_policy) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = p->priority;
+        if (sched_setscheduler(0, p->policy, &param) != 0) {
+            return -1;
+        }
+    }
+
+    if (p->set_nice && setpriority(PRIO_PROCESS, 0, p->nice) != 0) {
+        return -1;
+    }
+
+    if (p->set_ioprio &&
+        syscall(SYS_ioprio_set, WATCHER_IOPRIO_WHO_PROCESS, 0, p->ioprio) != 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stages of the child setup reported to the parent on failure */
+#define WATCHER_CHILD_CGROUP 1
+#define WATCHER_CHILD_PLACEMENT 2
+#define WATCHER_CHILD_EXEC 3
+
+/**
+ * @brief Set up and execute the command in the child process created with
+ * fork() or clone3().
+ *
+ * On failure, the stage and errno are written to err_fd, which is closed on
+ * exec, so the parent knows when the command was executed.
+ *
+ * This runs in the child, so only async-signal-safe functions are used.
+ */
+static void watcher_child_exec(struct watcher_job *job, int err_fd,
+                               bool in_cgroup)
+{
+    int err[2];
+
+    /* Let the command inherit the heartbeat channel */
+    if (job->heartbeat_fd >= 0) {
+        fcntl(job->heartbeat_fd, F_SETFD, 0);
+    }
+
+    /* Connect stdout and stderr to the capture pipe */
+    if (job->output_write_fd >= 0) {
+        dup2(job->output_write_fd, STDOUT_FILENO);
+        dup2(job->output_write_fd, STDERR_FILENO);
+    }
+
+    /* Move to the cgroup before exec, so all descendants are in it */
+    err[0] = WATCHER_CHILD_CGROUP;
+    if (!in_cgroup && job->cgroup_procs_fd >= 0 &&
+        write(job->cgroup_procs_fd, "0", 1) < 0)
+    {
+        goto error;
+    }
+
+    err[0] = WATCHER_CHILD_PLACEMENT;
+    if (job->placement != NULL &&
+        watcher_placement_apply(job->placement,
+                                job->pinned ? job->cpu : -1) != 0)
+    {
+        goto error;
+    }
+
+    /* Execute the command */
+    err[0] = WATCHER_CHILD_EXEC;
+    execve(job->argv[0], job->argv, job->env);
+
+error:
+    err[1] = errno;
+    if (write(err_fd, err, sizeof(err)) < 0) {
+        /* Nothing else to do, the exit code tells the failure */
+    }
+    _exit(WATCHER_EXEC_FAILED);
+}
+
+/**
+ * @brief Wait until the child created with fork() or clone3() executes the
+ * command or fails to do so.
+ *
+ * @returns 0 if the command was executed; 1 if it failed, in which case the
+ * child is reaped and errno is set
+ */
+static int watcher_child_wait_exec(struct watcher_job *job, int err_pipe[2])
+{
+    ssize_t nread;
+    int err[2];
+
+    close(err_pipe[1]);
+
+    do {
+        nread = read(err_pipe[0], err, sizeof(err));
+    } while (nread < 0 && errno == EINTR);
+
+    close(err_pipe[0]);
+
+    if (nread != sizeof(err)) {
+        return 0;
+    }
+
+    while (waitpid(job->pid, NULL, 0) < 0 && errno == EINTR);
+
+    switch (err[0]) {
+    case WATCHER_CHILD_CGROUP:
+        job->spawn_error = "Could not move to cgroup";
+        break;
+    case WATCHER_CHILD_PLACEMENT:
+        job->spawn_error = "Could not apply the CPU, memory or scheduling "
+                           "settings";
+        break;
+    default:
+        job->spawn_error = "Error in execve";
+        break;
+    }
+    errno = err[1];
+    return 1;
+}
+
+/**
+ * @brief Start the process with posix_spawn(), which does not copy the page
+ * tables of the watcher (glibc uses CLONE_VM | CLONE_VFORK).
+ *
+ * @returns 0 on success; 1 if the command could not be executed; -1 otherwise
+ */
+static int watcher_spawn_posix(struct watcher_job *job)
+{
+    posix_spawn_file_actions_t actions;
+    int rc;
+
+    rc = posix_spawn_file_actions_init(&actions);
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+
+    /* Duplicating the descriptor onto itself clears FD_CLOEXEC, so the
+     * command inherits the heartbeat channel */
+    if (job->heartbeat_fd >= 0) {
+        rc = posix_spawn_file_actions_adddup2(&actions, job->heartbeat_fd,
+                                              job->heartbeat_fd);
+        if (rc != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            errno = rc;
+            return -1;
+        }
+    }
+
+    /* Connect stdout and stderr to the capture pipe */
+    if (job->output_write_fd >= 0) {
+        rc = posix_spawn_file_actions_adddup2(&actions, job->output_write_fd,
+                                              STDOUT_FILENO);
+        if (rc == 0) {
+            rc = posix_spawn_file_actions_adddup2(&actions,
+                                                  job->output_write_fd,
+                                                  STDERR_FILENO);
+        }
+        if (rc != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            errno = rc;
+            return -1;
+        }
+    }
+
+    /* Errors of execve() in the child are returned here */
+    rc = posix_spawn(&job->pid, job->argv[0], &actions, NULL, job->argv,
+                     job->env);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        job->spawn_error = "Error in execve";
+        errno = rc;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Start the process with clone3(), which returns a pidfd and, when
+ * the process has its own cgroup, starts it directly in the cgroup.
+ *
+ * @returns 0 on success; 1 if the command could not be executed; -1 otherwise
+ * with errno set to ENOSYS if clone3() is not supported
+ */
+static int watcher_spawn_clone3(struct watcher_job *job)
+{
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_clone3) && \
+    defined(HAVE_LINUX_SCHED_H) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args;
+    int err_pipe[2];
+    int pidfd = -1;
+    long pid;
+    int rc;
+
+    rc = pipe2(err_pipe, O_CLOEXEC);
+    if (rc != 0) {
+        return -1;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_PIDFD;
+    args.pidfd = (uint64_t)(uintptr_t)&pidfd;
+    args.exit_signal = SIGCHLD;
+    if (job->cgroup_fd >= 0) {
+        args.flags |= CLONE_INTO_CGROUP;
+        args.cgroup = job->cgroup_fd;
+    }
+
+    pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid == 0) {
+        watcher_child_exec(job, err_pipe[1], job->cgroup_fd >= 0);
+    }
+
+    if (pid < 0) {
+        rc = errno;
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        /* Kernels older than 5.7 do not support CLONE_INTO_CGROUP */
+        errno = (rc == E2BIG || rc == EINVAL) ? ENOSYS : rc;
+        return -1;
+    }
+
+    job->pid = pid;
+    job->pidfd = pidfd;
+
+    return watcher_child_wait_exec(job, err_pipe);
+#else
+    (void) job;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Start the process with fork().
+ *
+ * @returns 0 on success; 1 if the command could not be executed; -1 otherwise
+ */
+static int watcher_spawn_fork(struct watcher_job *job)
+{
+    int err_pipe[2];
+    pid_t pid;
+    int rc;
+
+    rc = pipe2(err_pipe, O_CLOEXEC);
+    if (rc != 0) {
+        return -1;
+    }
+
+    pid = fork();
+    switch(pid){
+    case 0:
+        watcher_child_exec(job, err_pipe[1], false);
+        break;
+    case -1:
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        return -1;
+    default:
+        break;
+    }
+
+    job->pid = pid;
+
+    return watcher_child_wait_exec(job, err_pipe);
+}
+
+/**
+ * @brief Start the process for the given job.
+ *
+ * This returns only after the command was executed, or failed to.  The
+ * method is chosen by job->spawn.  By default, posix_spawn() is used, which
+ * is the fastest, or clone3() when the process runs in its own cgroup, to
+ * start it directly in the cgroup.  fork() is the fallback for old kernels.
+ *
+ * The pidfd of the process is left at -1 if pidfd is not supported.
+ *
+ * On failure, errno is set and job->spawn_error tells what failed, for the
+ * caller to report.
+ *
+ * @returns 0 on success; WATCHER_EXEC_FAILED if the command could not be
+ * executed, in which case the job is finished; WATCHER_HEARTBEAT_SETUP_FAILED,
+ * WATCHER_CGROUP_SETUP_FAILED, WATCHER_CAPTURE_SETUP_FAILED or
+ * WATCHER_SPAWN_FAILED otherwise
+ */
+int watcher_job_spawn(struct watcher_job *job)
+{
+    enum watcher_spawn_e spawn = job->spawn;
+    int saved_errno;
+    int rc;
+
+    job->spawn_error = NULL;
+
+    if (job->use_heartbeat) {
+        rc = watcher_heartbeat_setup(job);
+        if (rc != 0) {
+            job->spawn_error = "Could not create the heartbeat channel";
+            return WATCHER_HEARTBEAT_SETUP_FAILED;
+        }
+    }
+
+    if (job->cgroup_parent != NULL) {
+        rc = watcher_cgroup_create(job);
+        if (rc != 0) {
+            job->spawn_error = "Could not set up the cgroup";
+            return WATCHER_CGROUP_SETUP_FAILED;
+        }
+    }
+
+    if (job->capture_size > 0) {
+        rc = watcher_capture_setup(job);
+        if (rc != 0) {
+            if (job->spawn_error == NULL) {
+                job->spawn_error = "Could not set up the output capture";
+            }
+            return WATCHER_CAPTURE_SETUP_FAILED;
+        }
+    }
+
+    if (spawn == WATCHER_SPAWN_AUTO) {
+        spawn = WATCHER_SPAWN_POSIX;
+    }
+
+    /* posix_spawn() cannot start the process in a cgroup nor change its
+     * placement */
+    if (spawn == WATCHER_SPAWN_POSIX &&
+        (job->cgroup_fd >= 0 || job->placement != NULL))
+    {
+        spawn = WATCHER_SPAWN_CLONE3;
+    }
+
+    job->pid = -1;
+    job->pidfd = -1;
+
+    watcher_timestamp(&job->start);
+
+    switch (spawn) {
+    case WATCHER_SPAWN_POSIX:
+        rc = watcher_spawn_posix(job);
+        break;
+    case WATCHER_SPAWN_CLONE3:
+        rc = watcher_spawn_clone3(job);
+        if (rc < 0 && errno == ENOSYS) {
+            rc = watcher_spawn_fork(job);
+        }
+        break;
+    default:
+        rc = watcher_spawn_fork(job);
+        break;
+    }
+
+    /* Only the child writes to the capture pipe */
+    saved_errno = errno;
+    if (job->output_write_fd >= 0) {
+        close(job->output_write_fd);
+        job->output_write_fd = -1;
+    }
+
+    if (rc < 0) {
+        job->spawn_error = "Could not start the process";
+        errno = saved_errno;
+        return WATCHER_SPAWN_FAILED;
+    } else if (rc > 0) {
+        job->running = false;
+        job->result = WATCHER_EXEC_FAILED;
+        watcher_heartbeat_cleanup(job);
+        watcher_cgroup_cleanup(job);
+        watcher_capture_cleanup(job);
+        errno = saved_errno;
+        return WATCHER_EXEC_FAILED;
+    }
+
+    job->running = true;
+    job->timed_out = false;
+    job->terminating = false;
+    job->killed = false;
+
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_pidfd_open)
+    if (job->pidfd < 0) {
+        /* Stays -1 if pidfd is not supported */
+        job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Initialize the runtime state of a job which is not running.
+ */
+void watcher_job_init(struct watcher_job *job)
+{
+    size_t i;
+
+    job->pid = -1;
+    job->pidfd = -1;
+    job->client_fd = -1;
+    job->heartbeat = NULL;
+    job->heartbeat_fd = -1;
+    job->cgroup_path = NULL;
+    job->cgroup_fd = -1;
+    job->cgroup_procs_fd = -1;
+    job->output_fd = -1;
+    job->output_write_fd = -1;
+    job->ring_fd = -1;
+    job->log_fd = -1;
+    job->sampler_pid = -1;
+    job->sampled = false;
+    job->stat_fd = -1;
+    job->schedstat_fd = -1;
+    job->io_fd = -1;
+    job->cpu_stat_fd = -1;
+    job->stalled = false;
+    job->throttled = false;
+    job->throttles = 0;
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        job->pressure_fds[i] = -1;
+    }
+    job->running = false;
+    job->reaped = false;
+    job->result = WATCHER_SUCCESS;
+    job->heap_index = (size_t)-1;
+}
+
+/* Size of the ring buffer of the output, which is only used to dump the tail
+ * of a log file */
+#define WATCHER_PROCESS_CAPTURE_SIZE (64 * 1024)
+
+/* Time in ms between two checks of a process without pidfd */
+#define WATCHER_PROCESS_POLL_INTERVAL 10
+
+struct watcher_process_st {
+    struct watcher_job job;
+};
+
+void watcher_options_init(struct watcher_options_st *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->timeout = -1;
+    options->spawn = WATCHER_SPAWN_AUTO;
+}
+
+/**
+ * @brief Stop watching the process and release everything but the arena.
+ */
+static void watcher_process_finish(struct watcher_process_st *process,
+                                   int result, int status, bool reaped)
+{
+    struct watcher_job *job = &process->job;
+
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+
+    watcher_heartbeat_cleanup(job);
+    watcher_cgroup_cleanup(job);
+    watcher_capture_drain(job);
+    watcher_capture_cleanup(job);
+
+    /* The same exit codes as the watcher, without the reports */
+    if (reaped && (result == WATCHER_SUCCESS || result == WATCHER_TIMEOUT)) {
+        if (WIFEXITED(status) && WEXITSTATUS(status) != 0 &&
+            result == WATCHER_SUCCESS)
+        {
+            result = WATCHER_COMMAND_RETURNED_NON_ZERO;
+        }
+#ifdef WCOREDUMP
+        if (WIFSIGNALED(status) && WCOREDUMP(status)) {
+            result = WATCHER_COMMAND_CORE_DUMP;
+        }
+#endif
+    }
+
+    job->running = false;
+    job->status = status;
+    job->reaped = reaped;
+    job->result = result;
+}
+
+int watcher_process_start(struct watcher_process_st **process,
+                          char *const argv[], char *const env[],
+                          const struct watcher_options_st *options)
+{
+    struct watcher_options_st defaults;
+    struct watcher_process_st *p;
+    struct watcher_job *job;
+    size_t argc = 0;
+    size_t envc = 0;
+    int saved_errno;
+    int rc;
+
+    *process = NULL;
+
+    if (options == NULL) {
+        watcher_options_init(&defaults);
+        options = &defaults;
+    }
+
+    if (env == NULL) {
+        env = environ;
+    }
+
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+
+    while (env[envc] != NULL) {
+        envc++;
+    }
+
+    p = calloc(1, sizeof(struct watcher_process_st));
+    if (p == NULL) {
+        return WATCHER_OOM;
+    }
+    job = &p->job;
+
+    watcher_job_init(job);
+
+    rc = watcher_job_marshal(job, (char **)argv, argc, (char **)env, envc);
+    if (rc != 0) {
+        free(p);
+        return rc;
+    }
+
+    job->timeout = options->timeout;
+    job->grace = options->grace;
+    job->use_heartbeat = options->heartbeat;
+    job->spawn = options->spawn;
+    job->log_file = options->log_file;
+    if (job->log_file != NULL) {
+        job->capture_size = WATCHER_PROCESS_CAPTURE_SIZE;
+    }
+    job->cgroup_parent = options->cgroup_parent;
+    job->memory_max = options->memory_max;
+    job->cpu_max = options->cpu_max;
+    job->read_io = options->io_counters;
+
+    if (job->cgroup_parent != NULL &&
+        (job->memory_max != NULL || job->cpu_max != NULL))
+    {
+        rc = watcher_cgroup_prepare(job->cgroup_parent,
+                                    job->memory_max != NULL,
+                                    job->cpu_max != NULL);
+        if (rc != 0) {
+            rc = WATCHER_CGROUP_SETUP_FAILED;
+            goto error;
+        }
+    }
+
+    rc = watcher_timestamp(&job->ts);
+    if (rc != 0) {
+        rc = WATCHER_TIMESTAMP_FAILED;
+        goto error;
+    }
+    job->deadline = (job->timeout < 0) ? LLONG_MAX :
+                    watcher_timestamp_msecs(&job->ts) + job->timeout;
+
+    rc = watcher_job_spawn(job);
+    if (rc != 0) {
+        goto error;
+    }
+
+    /* Check the process at least once in case it finished before the pidfd
+     * was opened */
+    job->ready = true;
+
+    *process = p;
+    return WATCHER_SUCCESS;
+
+error:
+    saved_errno = errno;
+    watcher_heartbeat_cleanup(job);
+    watcher_cgroup_cleanup(job);
+    watcher_capture_cleanup(job);
+    free(job->arena);
+    free(p);
+    errno = saved_errno;
+    return rc;
+}
+
+pid_t watcher_process_pid(const struct watcher_process_st *process)
+{
+    return process->job.pid;
+}
+
+void watcher_process_heartbeat(struct watcher_process_st *process)
+{
+    /* The deadline is moved when it expires */
+    watcher_timestamp(&process->job.ts);
+}
+
+/**
+ * @brief Reap the process if it may have finished and handle its deadline.
+ *
+ * @param[in]  process    The watched process
+ * @param[in]  now_msecs  The current time in ms
+ * @param[out] next       The time in ms until the next deadline, or -1 if
+ *                        there is none
+ *
+ * @returns true if the process is not running anymore; false otherwise
+ */
+static bool watcher_process_check(struct watcher_process_st *process,
+                                  long long now_msecs, long *next)
+{
+    struct watcher_job *job = &process->job;
+    long long deadline;
+    pid_t changed_pid;
+    int status = 0;
+    int rc;
+
+    if (!job->running) {
+        return true;
+    }
+
+    if (job->ready || job->pidfd < 0) {
+        job->ready = false;
+        changed_pid = watcher_job_wait(job, &status, WNOHANG);
+        if (changed_pid == job->pid) {
+            watcher_process_finish(process, job->timed_out ? WATCHER_TIMEOUT :
+                                                             WATCHER_SUCCESS,
+                                   status, true);
+            return true;
+        } else if (changed_pid != 0) {
+            watcher_process_finish(process, WATCHER_CANNOT_WAIT, 0, false);
+            return true;
+        }
+    }
+
+    while (job->deadline <= now_msecs) {
+        if (!job->timed_out && !job->killed) {
+            /* A heartbeat may have moved the deadline forward */
+            deadline = watcher_timestamp_msecs(&job->ts) + job->timeout;
+            if (deadline <= now_msecs && watcher_heartbeat_changed(job)) {
+                watcher_timestamp(&job->ts);
+                deadline = now_msecs + job->timeout;
+            }
+            if (deadline > now_msecs) {
+                job->deadline = deadline;
+                break;
+            }
+            job->timed_out = true;
+        }
+
+        if (job->grace > 0 && job->timed_out && !job->terminating &&
+            !job->killed)
+        {
+            /* Give the process a chance to exit cleanly */
+            rc = watcher_job_signal(job, SIGTERM);
+            if (rc == 0) {
+                job->terminating = true;
+                job->deadline = now_msecs + job->grace;
+                continue;
+            }
+        }
+
+        if (!job->killed) {
+            rc = watcher_process_kill(process);
+            if (rc != 0) {
+                watcher_process_finish(process, WATCHER_CANNOT_KILL, 0, false);
+                return true;
+            }
+        } else {
+            /* The process was not reaped a second after the kill */
+            watcher_process_finish(process, WATCHER_CANNOT_KILL, 0, false);
+            return true;
+        }
+    }
+
+    if (job->deadline == LLONG_MAX) {
+        *next = -1;
+    } else {
+        *next = (long)(job->deadline - now_msecs);
+    }
+
+    return false;
+}
+
+int watcher_process_wait(struct watcher_process_st *process, long msecs)
+{
+    size_t index;
+
+    return watcher_process_wait_any(&process, 1, msecs, &index);
+}
+
+int watcher_process_wait_any(struct watcher_process_st *const processes[],
+                             size_t n, long msecs, size_t *index)
+{
+    struct pollfd pfds_small[8];
+    struct pollfd *pfds = pfds_small;
+    struct timestamp_st now;
+    struct watcher_job *job;
+    long long now_msecs;
+    long long end = LLONG_MAX;
+    long timeout;
+    long next;
+    nfds_t npfds;
+    size_t count;
+    size_t i;
+    int rc = -1;
+
+    for (count = 0, i = 0; i < n; i++) {
+        count += (processes[i] != NULL);
+    }
+    if (count == 0) {
+        errno = ECHILD;
+        return -1;
+    }
+
+    /* Room for the pidfd and the output of each process */
+    if (2 * count > sizeof(pfds_small) / sizeof(pfds_small[0])) {
+        pfds = calloc(2 * count, sizeof(struct pollfd));
+        if (pfds == NULL) {
+            return -1;
+        }
+    }
+
+    watcher_timestamp(&now);
+    if (msecs >= 0) {
+        end = watcher_timestamp_msecs(&now) + msecs;
+    }
+
+    for (;;) {
+        now_msecs = watcher_timestamp_msecs(&now);
+        timeout = (end == LLONG_MAX) ? -1 : (long)(end - now_msecs);
+        if (timeout < 0 && end != LLONG_MAX) {
+            timeout = 0;
+        }
+        npfds = 0;
+
+        for (i = 0; i < n; i++) {
+            if (processes[i] == NULL) {
+                continue;
+            }
+
+            if (watcher_process_check(processes[i], now_msecs, &next)) {
+                *index = i;
+                rc = 0;
+                goto end;
+            }
+
+            job = &processes[i]->job;
+            if (job->pidfd < 0) {
+                next = WATCHER_PROCESS_POLL_INTERVAL;
+            }
+            if (next >= 0 && (timeout < 0 || next < timeout)) {
+                timeout = next;
+            }
+
+            if (job->pidfd >= 0) {
+                pfds[npfds].fd = job->pidfd;
+                pfds[npfds].events = POLLIN;
+                pfds[npfds].revents = 0;
+                npfds++;
+            }
+            if (job->output_fd >= 0) {
+                pfds[npfds].fd = job->output_fd;
+                pfds[npfds].events = POLLIN;
+                pfds[npfds].revents = 0;
+                npfds++;
+            }
+        }
+
+        if (now_msecs >= end) {
+            rc = 1;
+            goto end;
+        }
+
+        if (poll(pfds, npfds, timeout) < 0 && errno != EINTR) {
+            goto end;
+        }
+
+        /* Mark the processes which changed state and move their output */
+        for (i = 0, npfds = 0; i < n; i++) {
+            if (processes[i] == NULL) {
+                continue;
+            }
+
+            job = &processes[i]->job;
+            if (job->pidfd >= 0) {
+                if (pfds[npfds++].revents != 0) {
+                    job->ready = true;
+                }
+            }
+            if (job->output_fd >= 0) {
+                if (pfds[npfds++].revents != 0) {
+                    watcher_capture_drain(job);
+                }
+            }
+        }
+
+        watcher_timestamp(&now);
+    }
+
+end:
+    if (pfds != pfds_small) {
+        free(pfds);
+    }
+    return rc;
+}
+
+int watcher_process_kill(struct watcher_process_st *process)
+{
+    struct watcher_job *job = &process->job;
+    struct timestamp_st now;
+    int rc;
+
+    if (!job->running) {
+        return 0;
+    }
+
+    rc = watcher_job_signal(job, SIGKILL);
+    if (rc < 0 && errno != ESRCH) {
+        return -1;
+    }
+
+    /* Give up if it is not reaped within a second */
+    watcher_timestamp(&now);
+    job->killed = true;
+    job->deadline = watcher_timestamp_msecs(&now) + 1000;
+
+    return 0;
+}
+
+int watcher_process_result(const struct watcher_process_st *process,
+                           int *status)
+{
+    if (process->job.running) {
+        return -1;
+    }
+
+    if (status != NULL && process->job.reaped) {
+        *status = process->job.status;
+    }
+
+    return process->job.result;
+}
+
+const struct watcher_usage_st *
+watcher_process_usage(const struct watcher_process_st *process)
+{
+    return &process->job.usage;
+}
+
+void watcher_process_accounting(const struct watcher_process_st *process,
+                                FILE *file)
+{
+    watcher_accounting_write(&process->job, file, process->job.result,
+                             process->job.status, process->job.reaped);
+}
+
+void watcher_process_free(struct watcher_process_st *process)
+{
+    struct watcher_job *job;
+    int status = 0;
+
+    if (process == NULL) {
+        return;
+    }
+    job = &process->job;
+
+    if (job->running) {
+        watcher_job_signal(job, SIGKILL);
+        while (watcher_job_wait(job, &status, 0) < 0 && errno == EINTR);
+        watcher_process_finish(process, WATCHER_SUCCESS, status, true);
+    }
+
+    free(job->arena);
+    free(process);
+}
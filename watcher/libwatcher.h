@@ -0,0 +1,237 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * libwatcher: watch processes from within another program.
+ *
+ * This is the API used by the watcher itself, for test harnesses which start
+ * many processes and would otherwise exec the watcher for each one.  Each
+ * watched process has its own handle and the library keeps no global state
+ * and installs no signal handlers, so different threads can watch different
+ * processes.  A single handle must not be used by two threads at once.
+ *
+ * The processes are children of the caller, which must not reap them
+ * itself, e.g. with waitpid(-1, ...) or by ignoring SIGCHLD.
+ *
+ * A process is started with watcher_process_start() and then waited for with
+ * watcher_process_wait() or watcher_process_wait_any(), which also enforce
+ * its timeout.  The timeout is reset with watcher_process_heartbeat() or by
+ * the process itself through the heartbeat channel, see heartbeat.h.
+ *
+ * Build:
+ *     cc -O2 -fPIC -shared -o libwatcher.so libwatcher.c
+ *     cc -O2 -c libwatcher.c && ar rcs libwatcher.a libwatcher.o
+ */
+
+#ifndef WATCHER_LIBWATCHER_H
+#define WATCHER_LIBWATCHER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+enum watcher_exit_e {
+    WATCHER_SUCCESS,
+    WATCHER_TIMEOUT,
+    WATCHER_CLEANUP_FAILED,
+    WATCHER_SIGTERM_SETUP_FAILED,
+    WATCHER_SIGTERM_HANDLER_FAILED,
+    WATCHER_SIGUSR1_SETUP_FAILED,
+    WATCHER_SIGUSR1_HANDLER_FAILED,
+    WATCHER_TIMESTAMP_FAILED,
+    WATCHER_OOM,
+    WATCHER_CANNOT_KILL,
+    WATCHER_CANNOT_WAIT,
+    WATCHER_COMMAND_TOO_LONG,
+    WATCHER_EXEC_FAILED,
+    WATCHER_ENV_TOO_LONG,
+    WATCHER_COMMAND_CORE_DUMP,
+    WATCHER_COMMAND_RETURNED_NON_ZERO,
+    WATCHER_HEARTBEAT_SETUP_FAILED,
+    WATCHER_CGROUP_SETUP_FAILED,
+    WATCHER_STALLED,
+    WATCHER_CAPTURE_SETUP_FAILED,
+    WATCHER_SPAWN_FAILED,
+};
+
+enum watcher_spawn_e {
+    /* posix_spawn(), or clone3() if the process runs in its own cgroup */
+    WATCHER_SPAWN_AUTO,
+    WATCHER_SPAWN_FORK,
+    WATCHER_SPAWN_POSIX,
+    WATCHER_SPAWN_CLONE3,
+};
+
+struct watcher_usage_st {
+    /* Time between the start and the reaping of the process */
+    long long wall_msecs;
+    /* Resource usage of the process and its waited-for children */
+    struct rusage rusage;
+    /* I/O counters from /proc/<pid>/io; -1 if not available */
+    long long rchar;
+    long long wchar;
+    long long read_bytes;
+    long long write_bytes;
+};
+
+struct watcher_options_st {
+    /* Time in ms without a heartbeat after which the process is killed; -1
+     * for no timeout */
+    long timeout;
+    /* Time in ms between SIGTERM and SIGKILL when the process times out; 0
+     * to send SIGKILL right away */
+    long grace;
+    /* Pass a shared memory heartbeat channel to the process */
+    bool heartbeat;
+    /* How to start the process */
+    enum watcher_spawn_e spawn;
+    /* Write stdout and stderr of the process to this file, or NULL to let the
+     * process inherit them */
+    const char *log_file;
+    /* Run the process in its own cgroup v2 under this directory, or NULL.
+     * The whole process tree is killed on timeout */
+    const char *cgroup_parent;
+    /* Values for memory.max and cpu.max of the cgroup, or NULL */
+    const char *memory_max;
+    const char *cpu_max;
+    /* Read the I/O counters of the process before it is reaped */
+    bool io_counters;
+};
+
+/* The handle of a watched process */
+struct watcher_process_st;
+
+/**
+ * @brief Set the default options: no timeout, no grace period and nothing
+ * else enabled.
+ */
+void watcher_options_init(struct watcher_options_st *options);
+
+/**
+ * @brief Start a process and watch it.
+ *
+ * This returns only after the command was executed, or failed to.
+ *
+ * @param[out] process  The handle of the process, to be freed with
+ *                      watcher_process_free()
+ * @param[in]  argv     The command and its arguments, NULL-terminated.
+ *                      argv[0] is the path of the executable
+ * @param[in]  env      The environment, NULL-terminated, or NULL to use the
+ *                      one of the caller
+ * @param[in]  options  The options, or NULL for the defaults
+ *
+ * @returns WATCHER_SUCCESS on success; otherwise the watcher exit code of the
+ * failure with errno set: WATCHER_EXEC_FAILED if the command could not be
+ * executed, WATCHER_CGROUP_SETUP_FAILED, WATCHER_HEARTBEAT_SETUP_FAILED,
+ * WATCHER_CAPTURE_SETUP_FAILED or WATCHER_SPAWN_FAILED if the process could
+ * not be set up or started, e.g. WATCHER_OOM or WATCHER_COMMAND_TOO_LONG for
+ * the others.  Nothing is written to stderr.
+ */
+int watcher_process_start(struct watcher_process_st **process,
+                          char *const argv[], char *const env[],
+                          const struct watcher_options_st *options);
+
+/**
+ * @brief Get the pid of the watched process.
+ */
+pid_t watcher_process_pid(const struct watcher_process_st *process);
+
+/**
+ * @brief Reset the timeout of the watched process.
+ */
+void watcher_process_heartbeat(struct watcher_process_st *process);
+
+/**
+ * @brief Wait for the watched process to finish, killing it if it times out.
+ *
+ * @param[in] process   The watched process
+ * @param[in] msecs     The maximum time to wait in ms; 0 to only check the
+ *                      process, -1 to wait until it finishes
+ *
+ * @returns 0 if the process finished; 1 if it is still running after msecs
+ */
+int watcher_process_wait(struct watcher_process_st *process, long msecs);
+
+/**
+ * @brief Wait for any of the given watched processes to finish, killing the
+ * ones which time out.
+ *
+ * @param[in]  processes  The watched processes; NULL elements are ignored
+ * @param[in]  n          The number of elements in processes
+ * @param[in]  msecs      The maximum time to wait in ms, as for
+ *                        watcher_process_wait()
+ * @param[out] index      The index of a finished process
+ *
+ * @returns 0 if a process finished, possibly before this was called; 1 if
+ * all are still running after msecs; -1 if there is no process to wait for
+ */
+int watcher_process_wait_any(struct watcher_process_st *const processes[],
+                             size_t n, long msecs, size_t *index);
+
+/**
+ * @brief Kill the watched process and all its descendants if it runs in its
+ * own cgroup.
+ *
+ * This does not wait for the process, which is reaped by the next wait.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+int watcher_process_kill(struct watcher_process_st *process);
+
+/**
+ * @brief Get how the watched process finished.
+ *
+ * @param[in]  process  The watched process
+ * @param[out] status   The status as returned by waitpid(), if the process
+ *                      was reaped; can be NULL
+ *
+ * @returns The watcher exit code of the process, e.g. WATCHER_TIMEOUT; -1 if
+ * it is still running
+ */
+int watcher_process_result(const struct watcher_process_st *process,
+                           int *status);
+
+/**
+ * @brief Get the resource usage of the watched process.
+ *
+ * @returns The resource usage, valid once the process finished
+ */
+const struct watcher_usage_st *
+watcher_process_usage(const struct watcher_process_st *process);
+
+/**
+ * @brief Write the JSON accounting record of the finished process, the same
+ * as "watcher --accounting", in a single line.
+ */
+void watcher_process_accounting(const struct watcher_process_st *process,
+                                FILE *file);
+
+/**
+ * @brief Free the handle of the watched process.
+ *
+ * A process still running is killed and reaped first.
+ */
+void watcher_process_free(struct watcher_process_st *process);
+
+#endif /* WATCHER_LIBWATCHER_H */
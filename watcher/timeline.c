@@ -0,0 +1,259 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Convert a resource timeline written by the watcher with --timeline to CSV
+ * or to JSON, one object per line.
+ *
+ * The CPU usage, in percent of one CPU, and the I/O rates are computed from
+ * the previous sample of the same process, so they are empty (CSV) or null
+ * (JSON) on the first sample of each process.
+ *
+ * Build:
+ *     cc -O2 -o watcher-timeline timeline.c
+ * Usage:
+ *     watcher-timeline [--json] FILE
+ *     watcher-timeline --help
+ *
+ * FILE may be - to read the standard input.  A timeline cut by a crash is
+ * converted up to its last complete record.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timeline.h"
+
+/* Last sample of each process, in an open addressing hash table */
+struct timeline_process_st {
+    bool used;
+    struct watcher_timeline_record_st last;
+};
+
+static struct timeline_process_st *processes = NULL;
+static size_t processes_size = 0;
+static size_t processes_count = 0;
+
+static size_t timeline_hash(uint64_t id, int32_t pid, size_t size)
+{
+    uint64_t h = (id * 0x9e3779b97f4a7c15ULL) ^ (uint32_t)pid;
+
+    h ^= h >> 29;
+    return (size_t)(h * 0xbf58476d1ce4e5b9ULL) & (size - 1);
+}
+
+static struct timeline_process_st *timeline_lookup(uint64_t id, int32_t pid)
+{
+    struct timeline_process_st *table, *p;
+    size_t size, i, j;
+
+    if (processes_count * 2 >= processes_size) {
+        size = processes_size > 0 ? processes_size * 2 : 64;
+        table = calloc(size, sizeof(*table));
+        if (table == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < processes_size; i++) {
+            if (!processes[i].used) {
+                continue;
+            }
+            j = timeline_hash(processes[i].last.id, processes[i].last.pid,
+                              size);
+            while (table[j].used) {
+                j = (j + 1) & (size - 1);
+            }
+            table[j] = processes[i];
+        }
+
+        free(processes);
+        processes = table;
+        processes_size = size;
+    }
+
+    i = timeline_hash(id, pid, processes_size);
+    for (;;) {
+        p = &processes[i];
+        if (!p->used) {
+            p->used = true;
+            p->last.id = id;
+            p->last.pid = pid;
+            p->last.msecs = UINT32_MAX;
+            processes_count++;
+            return p;
+        }
+        if (p->last.id == id && p->last.pid == pid) {
+            return p;
+        }
+        i = (i + 1) & (processes_size - 1);
+    }
+}
+
+static void timeline_help(const char *name)
+{
+    printf("Usage: %s [--json] FILE\n"
+           "Convert a watcher --timeline FILE to CSV, or to JSON with one "
+           "object per line.\n"
+           "FILE may be - to read the standard input.\n\n"
+           "  --json       Write JSON instead of CSV\n"
+           "  -h, --help   Show this help\n", name);
+}
+
+static void timeline_print(const struct watcher_timeline_record_st *r,
+                           const struct watcher_timeline_record_st *last,
+                           bool json)
+{
+    double secs = 0;
+    double cpu = 0, read_rate = 0, write_rate = 0;
+    bool rates = false;
+
+    if (last->msecs != UINT32_MAX && r->msecs > last->msecs) {
+        secs = (r->msecs - last->msecs) / 1e3;
+        cpu = (double)(r->cpu_usecs - last->cpu_usecs) / 1e4 / secs;
+        read_rate = (double)(r->read_bytes - last->read_bytes) / secs;
+        write_rate = (double)(r->write_bytes - last->write_bytes) / secs;
+        rates = true;
+    }
+
+    if (json) {
+        printf("{\"time_ms\":%" PRIu32 ",\"id\":%" PRIu64 ",\"pid\":%" PRId32
+               ",\"rss_kib\":%" PRIu32 ",\"threads\":%" PRIu32
+               ",\"cpu_usecs\":%" PRIu64 ",\"read_bytes\":%" PRIu64
+               ",\"write_bytes\":%" PRIu64,
+               r->msecs, r->id, r->pid, r->rss_kib, r->threads, r->cpu_usecs,
+               r->read_bytes, r->write_bytes);
+        if (rates) {
+            printf(",\"cpu_percent\":%.1f,\"read_bytes_per_sec\":%.0f"
+                   ",\"write_bytes_per_sec\":%.0f}\n",
+                   cpu, read_rate, write_rate);
+        } else {
+            printf(",\"cpu_percent\":null,\"read_bytes_per_sec\":null"
+                   ",\"write_bytes_per_sec\":null}\n");
+        }
+    } else {
+        printf("%" PRIu32 ",%" PRIu64 ",%" PRId32 ",%" PRIu32 ",%" PRIu32
+               ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+               r->msecs, r->id, r->pid, r->rss_kib, r->threads, r->cpu_usecs,
+               r->read_bytes, r->write_bytes);
+        if (rates) {
+            printf(",%.1f,%.0f,%.0f\n", cpu, read_rate, write_rate);
+        } else {
+            printf(",,,\n");
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct watcher_timeline_header_st header;
+    struct watcher_timeline_record_st record;
+    struct timeline_process_st *p;
+    const char *path = NULL;
+    unsigned char *buffer;
+    bool json = false;
+    FILE *file;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            timeline_help(argv[0]);
+            return 0;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            path = NULL;
+            break;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: %s [--json] FILE\nTry %s --help\n", argv[0],
+                argv[0]);
+        return 1;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        file = stdin;
+    } else {
+        file = fopen(path, "re");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open file %s: %s\n", path,
+                    strerror(errno));
+            return 1;
+        }
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.magic != WATCHER_TIMELINE_MAGIC ||
+        header.record_size < sizeof(record))
+    {
+        fprintf(stderr, "%s is not a watcher timeline\n", path);
+        return 1;
+    }
+    if (header.version > WATCHER_TIMELINE_VERSION) {
+        fprintf(stderr, "Timeline version %u is newer than %u, only the "
+                "known fields are converted\n", header.version,
+                WATCHER_TIMELINE_VERSION);
+    }
+
+    buffer = malloc(header.record_size);
+    if (buffer == NULL) {
+        return 1;
+    }
+
+    if (!json) {
+        printf("time_ms,id,pid,rss_kib,threads,cpu_usecs,read_bytes,"
+               "write_bytes,cpu_percent,read_bytes_per_sec,"
+               "write_bytes_per_sec\n");
+    }
+
+    while (fread(buffer, header.record_size, 1, file) == 1) {
+        memcpy(&record, buffer, sizeof(record));
+
+        p = timeline_lookup(record.id, record.pid);
+        if (p == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        timeline_print(&record, &p->last, json);
+        p->last = record;
+    }
+
+    free(buffer);
+    free(processes);
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    return 0;
+}
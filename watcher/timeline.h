@@ -0,0 +1,76 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * Copyright (c) 2019 by Red Hat, Inc.
+ *
+ * Author: Anderson Toshiyuki Sasaki <ansasaki@redhat.com>
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Resource timeline written by the watcher with --timeline.
+ *
+ * The file starts with a struct watcher_timeline_header_st followed by
+ * records of header.record_size bytes, each starting with a
+ * struct watcher_timeline_record_st, in the byte order of the host.  Every
+ * interval, the watcher appends one record per running process with a single
+ * write(), so a file cut by a crash only loses its last, partial record.
+ *
+ * The records hold the counters as read, the rates (CPU usage, I/O
+ * throughput) are derived from two consecutive records of the same process
+ * by the watcher-timeline tool, which converts a timeline to CSV or JSON.
+ */
+
+#ifndef WATCHER_TIMELINE_H
+#define WATCHER_TIMELINE_H
+
+#include <stdint.h>
+
+#define WATCHER_TIMELINE_MAGIC 0x4c544857 /* "WHTL" */
+#define WATCHER_TIMELINE_VERSION 1
+
+struct watcher_timeline_header_st {
+    uint32_t magic;
+    uint16_t version;
+    /* Size of a record; later versions only add fields at the end */
+    uint16_t record_size;
+    /* Sampling interval in ms */
+    uint32_t interval;
+    uint32_t reserved;
+    /* Start of the timeline, in microseconds since the epoch */
+    uint64_t start_usecs;
+};
+
+struct watcher_timeline_record_st {
+    /* Time of the sample, in ms since the start of the timeline */
+    uint32_t msecs;
+    int32_t pid;
+    /* Id of the job, as in the accounting record */
+    uint64_t id;
+    /* User and system CPU time of the process, or of its cgroup with
+     * --cgroup */
+    uint64_t cpu_usecs;
+    /* Bytes read and written by the process (rchar and wchar), 0 if
+     * /proc/<pid>/io cannot be read */
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    /* Resident set size of the process */
+    uint32_t rss_kib;
+    uint32_t threads;
+};
+
+#endif /* WATCHER_TIMELINE_H */
@@ -21,6 +21,10 @@
  * MA 02111-1307, USA.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "config.h"
 
 #include <signal.h>
@@ -31,9 +35,40 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
 
 #include <time.h>
 
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <dirent.h>
+#include <elf.h>
+#include <link.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#endif
+
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
@@ -43,132 +78,250 @@
 #endif
 
 #include "watcher.h"
+#include "timeline.h"
 
-#define MAX_ARGS 256
-#define MAX_ENV_VARS 256
-#define BUFFER_SIZE 1024
+/* Separates the commands in the multiple process mode */
+#define COMMAND_SEPARATOR ";"
 
 static struct watcher_ctx *ctx = NULL;
 
+/* Self-pipe used to wake up the event loop on SIGTERM, and on SIGCHLD when
+ * pidfd is not available */
+static int signal_pipe[2] = {-1, -1};
+static bool sigchld_handler_set = false;
+
+/* Set on SIGTERM; the event loop then kills the jobs and exits */
+static volatile sig_atomic_t sigterm_received = 0;
+
+/* Socket of the daemon, removed on SIGTERM */
+static const char *daemon_socket = NULL;
+
+/* Histograms of the latencies of the watcher itself */
+static struct watcher_histogram_st histograms[WATCHER_HISTOGRAM_COUNT] = {
+    [WATCHER_HISTOGRAM_SIGUSR1] = {
+        .name = "watcher_sigusr1_delay_seconds",
+        .help = "Time from the sigqueue() of a SIGUSR1 to the update of the "
+                "timestamp",
+    },
+    [WATCHER_HISTOGRAM_SPAWN] = {
+        .name = "watcher_spawn_seconds",
+        .help = "Time from the start of the spawn until the command was "
+                "executed",
+    },
+    [WATCHER_HISTOGRAM_KILL] = {
+        .name = "watcher_kill_seconds",
+        .help = "Time from the time SIGKILL was due until the process was "
+                "reaped",
+    },
+    [WATCHER_HISTOGRAM_HEARTBEAT] = {
+        .name = "watcher_heartbeat_interval_seconds",
+        .help = "Time between two SIGUSR1 heartbeats of a process",
+    },
+};
+
+/* Statistics file rewritten every WATCHER_STATS_INTERVAL ms, or NULL */
+#define WATCHER_STATS_INTERVAL 1000
+static enum watcher_backend_e event_backend = WATCHER_BACKEND_POLL;
+
+static const char *stats_file = NULL;
+static long long stats_next = 0;
+
+/* Resource timeline appended every timeline_interval ms, or -1 */
+static int timeline_fd = -1;
+static long timeline_interval = 1000;
+static long long timeline_start = 0;
+static long long timeline_next = 0;
+static struct watcher_timeline_record_st *timeline_records = NULL;
+static size_t timeline_size = 0;
+
 struct arguments_st {
-    char *argv[MAX_ARGS];
-    char *env[MAX_ENV_VARS];
+    /* Both point into the argv of the watcher, nothing is copied */
+    char **argv;
+    char **env;
     int argc;
     int envc;
     long timeout;
+    bool timeout_set;
     char *pid_file;
     bool fork;
+    bool multi;
+    bool heartbeat;
+    bool accounting;
+    char *accounting_file;
+    long grace;
+    bool cgroup;
+    char *cgroup_parent;
+    char *memory_max;
+    char *cpu_max;
+    enum watcher_spawn_e spawn;
+    long capture_kib;
+    char *log_file;
+    char *daemon;
+    char *submit;
+    char *batch;
+    long max_jobs;
+    char *stats_file;
+    enum watcher_backend_e backend;
+    char *sample_file;
+    long sample_window;
+    long inactivity;
+    char *timeline_file;
+    long timeline_interval;
+    /* PSI triggers and what to do when one fires */
+    struct watcher_pressure_st pressure[WATCHER_PRESSURE_MAX];
+    size_t npressure;
+    enum watcher_pressure_action_e pressure_action;
+    /* Placement of the jobs and of the watcher itself */
+    struct watcher_placement_st placement;
+    struct watcher_placement_st watcher_placement;
 };
 
-#ifdef _POSIX_MONOTONIC_CLOCK
-#define CLOCK CLOCK_MONOTONIC
-#else
-#define CLOCK CLOCK_REALTIME
-#endif
-
-#ifdef HAVE_CLOCK_GETTIME
-static int watcher_timestamp(struct timestamp_st *ts)
+/**
+ * @brief Add a duration to a histogram.  This is async-signal-safe.
+ *
+ * @param[in] id        The histogram
+ * @param[in] usecs     The duration in microseconds; negative durations are
+ *                      counted as 0
+ */
+static void watcher_histogram_record(enum watcher_histogram_e id,
+                                     long long usecs)
 {
-    struct timespec tp;
-    clock_gettime(CLOCK, &tp);
-    ts->useconds = tp.tv_nsec / 1000;
-#else
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
-    ts->useconds = tp.tv_usec;
-#endif
-    ts->seconds = tp.tv_sec;
+    struct watcher_histogram_st *h = &histograms[id];
+    uint64_t value = usecs > 0 ? (uint64_t)usecs : 0;
+    unsigned int bucket = 0;
 
-    return 0;
-}
+    /* The smallest i such that value <= 2^i */
+    if (value > 1) {
+        bucket = 64 - __builtin_clzll(value - 1);
+    }
+    if (bucket >= WATCHER_HISTOGRAM_BUCKETS) {
+        bucket = WATCHER_HISTOGRAM_BUCKETS - 1;
+    }
 
-#undef CLOCK
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_usecs, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
 
-static int watcher_finish(int watcher_exit, int status)
+/**
+ * @brief Write the histograms to the given file in the Prometheus text
+ * format.
+ *
+ * The file is replaced atomically, so a reader never sees a partial file.
+ *
+ * @param[in] path      The path of the file
+ * @param[in] running   The number of processes currently watched
+ */
+static void watcher_stats_write(const char *path, size_t running)
 {
-    bool is_running = true;
-    int count;
+    struct watcher_histogram_st *h;
+    char *tmp = NULL;
+    FILE *file;
+    uint64_t cumulative;
+    size_t i, b;
     int rc;
-    pid_t changed_pid;
+
+    rc = asprintf(&tmp, "%s.tmp", path);
+    if (rc < 0) {
+        return;
+    }
+
+    file = fopen(tmp, "we");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return;
+    }
+
+    for (i = 0; i < WATCHER_HISTOGRAM_COUNT; i++) {
+        h = &histograms[i];
+        fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n",
+                h->name, h->help, h->name);
+
+        /* The buckets are read one by one, the count is derived from them
+         * so that the output is consistent */
+        cumulative = 0;
+        for (b = 0; b < WATCHER_HISTOGRAM_BUCKETS - 1; b++) {
+            cumulative += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            /* The bounds are powers of two of microseconds, printed exactly
+             * in seconds */
+            fprintf(file, "%s_bucket{le=\"%llu.%06llu\"} %" PRIu64 "\n",
+                    h->name, (1ULL << b) / 1000000, (1ULL << b) % 1000000,
+                    cumulative);
+        }
+        cumulative += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        fprintf(file, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n"
+                "%s_sum %.6f\n%s_count %" PRIu64 "\n",
+                h->name, cumulative, h->name,
+                __atomic_load_n(&h->sum_usecs, __ATOMIC_RELAXED) / 1e6,
+                h->name, cumulative);
+    }
+
+    fprintf(file, "# HELP watcher_running_processes Number of processes "
+            "currently watched\n# TYPE watcher_running_processes gauge\n"
+            "watcher_running_processes %zu\n", running);
+
+    rc = fclose(file);
+    if (rc != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Could not write file %s: %s\n", path,
+                strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+/**
+ * @brief Report how the watched process finished.
+ *
+ * @param[in] job           The job of the watched process
+ * @param[in] watcher_exit  The reason the process is being finished
+ * @param[in] status        The process status as returned by waitpid()
+ * @param[in] reaped        Whether the status is valid, i.e. the process was
+ *                          reaped
+ *
+ * @returns The watcher exit code for the job
+ */
+static int watcher_finish(struct watcher_job *job, int watcher_exit,
+                          int status, bool reaped)
+{
+    struct timestamp_st now;
     int process_exit;
 
-    if (ctx == NULL) {
+    if (job == NULL) {
         return(watcher_exit);
     }
 
+    job->running = false;
+    job->status = status;
+
     switch(watcher_exit) {
     case WATCHER_SUCCESS:
+    case WATCHER_TIMEOUT:
+    case WATCHER_STALLED:
+        if (!reaped) {
+            break;
+        }
+
         if (WIFEXITED(status)) {
             process_exit = WEXITSTATUS(status);
             fprintf(stderr, "The process %u exited with "
-                    "code %d\n", ctx->pid, process_exit);
-            is_running = 0;
-            if (process_exit != 0) {
+                    "code %d\n", job->pid, process_exit);
+            /* A process which exits on SIGTERM still timed out */
+            if (process_exit != 0 && watcher_exit == WATCHER_SUCCESS) {
                 watcher_exit = WATCHER_COMMAND_RETURNED_NON_ZERO;
             }
-            break;
         } else if (WIFSIGNALED(status)) {
 #ifdef WCOREDUMP
             if (WCOREDUMP(status)) {
                 fprintf(stderr, "The process %u core dumped "
-                        "with signal %d\n", ctx->pid,
+                        "with signal %d\n", job->pid,
                         WTERMSIG(status));
                 watcher_exit = WATCHER_COMMAND_CORE_DUMP;
-                is_running = 0;
                 break;
-
             }
 #endif
             fprintf(stderr, "The process %u was signaled with "
-                    "signal %d\n", ctx->pid, WTERMSIG(status));
-            is_running = 0;
-            break;
-        }
-        break;
-    case WATCHER_TIMEOUT:
-        for (count = 0; count < 100; count++) {
-            /* Check if status changed since last wait */
-            changed_pid = waitpid(ctx->pid, &status, WNOHANG);
-            if (changed_pid < 0) {
-                /* Failed to wait, give up and die */
-                watcher_exit = WATCHER_CANNOT_WAIT;
-                break;
-            } else if (changed_pid == 0) {
-                /* Send kill signal to the process */
-                rc = kill(ctx->pid, SIGKILL);
-                if (rc < 0) {
-                    watcher_exit = WATCHER_CANNOT_KILL;
-                    break;
-                }
-                /* Wait and try again */
-                usleep(10 * 1000);
-            } else if (changed_pid == ctx->pid) {
-                /* Process successfully killed */
-                if (WIFEXITED(status)) {
-                    process_exit = WEXITSTATUS(status);
-                    fprintf(stderr, "The process %u exited with "
-                            "code %d\n", ctx->pid, process_exit);
-                    if (process_exit != 0) {
-                        watcher_exit = WATCHER_COMMAND_RETURNED_NON_ZERO;
-                    }
-                } else if (WIFSIGNALED(status)) {
-#ifdef WCOREDUMP
-                    if (WCOREDUMP(status)) {
-                        fprintf(stderr, "The process %u core dumped "
-                                "with signal %d\n", ctx->pid,
-                                WTERMSIG(status));
-                        watcher_exit = WATCHER_COMMAND_CORE_DUMP;
-                    }
-#endif
-                    fprintf(stderr, "The process %u was signaled with "
-                            "signal %d\n", ctx->pid, WTERMSIG(status));
-                }
-                is_running = 0;
-                break;
-            } else {
-                watcher_exit = WATCHER_CANNOT_WAIT;
-                break;
-            }
+                    "signal %d\n", job->pid, WTERMSIG(status));
         }
         break;
     default:
@@ -176,300 +329,4303 @@ static int watcher_finish(int watcher_exit, int status)
                 "The process status was %d\n", watcher_exit, status);
     }
 
-    if (is_running) {
+    if (!reaped) {
         fprintf(stderr, "The process %u is still running! "
-                "Watcher could not kill it.\n", ctx->pid);
+                "Watcher could not kill it.\n", job->pid);
+    }
+
+    if (reaped && job->timed_out && job->killed) {
+        /* SIGKILL was due at the end of the sampling and grace periods, if
+         * any */
+        watcher_timestamp(&now);
+        watcher_histogram_record(WATCHER_HISTOGRAM_KILL,
+                                 watcher_timestamp_usecs(&now) -
+                                 job->expired_usecs -
+                                 (job->sampled ? job->sample_window * 1000 :
+                                                 0) -
+                                 (job->terminating ? job->grace * 1000 : 0));
     }
+
+    watcher_accounting_write(job, job->accounting, watcher_exit, status,
+                             reaped);
+
+    job->reaped = reaped;
+    job->result = watcher_exit;
     return watcher_exit;
 }
 
-static void watcher_sigusr1_handler(int signo)
+/**
+ * @brief Kill the watched process and wait up to a second for it to die.
+ *
+ * @returns The watcher exit code for the job
+ */
+static int watcher_kill(struct watcher_job *job, int watcher_exit)
+{
+    struct pollfd pfd;
+    int count;
+    int rc;
+    int status = 0;
+    pid_t changed_pid;
+
+    rc = watcher_job_signal(job, SIGKILL);
+    if (rc < 0 && errno != ESRCH) {
+        return watcher_finish(job, WATCHER_CANNOT_KILL, status, false);
+    }
+    job->killed = true;
+
+    if (job->pidfd >= 0) {
+        /* Wait for the process to die */
+        pfd.fd = job->pidfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, 1000);
+    }
+
+    for (count = 0; count < 100; count++) {
+        /* Check if status changed since last wait */
+        changed_pid = watcher_job_wait(job, &status, WNOHANG);
+        if (changed_pid < 0) {
+            /* Failed to wait, give up and die */
+            return watcher_finish(job, WATCHER_CANNOT_WAIT, status, false);
+        } else if (changed_pid == 0) {
+            if (job->pidfd >= 0) {
+                /* We already waited for a whole second */
+                break;
+            }
+            /* Wait and try again */
+            usleep(10 * 1000);
+        } else if (changed_pid == job->pid) {
+            /* Process successfully killed */
+            return watcher_finish(job, watcher_exit, status, true);
+        } else {
+            return watcher_finish(job, WATCHER_CANNOT_WAIT, status, false);
+        }
+    }
+
+    return watcher_finish(job, watcher_exit, status, false);
+}
+
+static void watcher_sigusr1_handler(int signo, siginfo_t *info, void *ucontext)
 {
     (void) signo;
+    (void) ucontext;
+    struct timestamp_st now;
+    bool found = false;
+    long long usecs;
+    size_t i;
     int rc;
 
     if (ctx == NULL) {
         goto error;
     }
 
-    if (ctx->pid <= 0) {
+    rc = watcher_timestamp(&now);
+    if (rc != 0) {
         goto error;
     }
 
-    rc = watcher_timestamp(&ctx->ts);
-    if (rc != 0) {
-        goto error;
+    /* A sender using sigqueue() can pass the CLOCK_MONOTONIC time of the
+     * signal in microseconds */
+    if (info->si_code == SI_QUEUE && info->si_value.sival_ptr != NULL) {
+        watcher_histogram_record(WATCHER_HISTOGRAM_SIGUSR1,
+                                 watcher_timestamp_usecs(&now) -
+                                 (long long)(intptr_t)info->si_value.sival_ptr);
+    }
+
+    /* If the signal came from one of the watched processes, reset only its
+     * timeout.  Otherwise (e.g. it was sent by a grandchild) reset all */
+    usecs = watcher_timestamp_usecs(&now);
+    for (i = 0; i < ctx->njobs; i++) {
+        if (ctx->jobs[i].running && ctx->jobs[i].pid == info->si_pid) {
+            watcher_histogram_record(WATCHER_HISTOGRAM_HEARTBEAT, usecs -
+                                     __atomic_load_n(&ctx->jobs[i].signal_usecs,
+                                                     __ATOMIC_RELAXED));
+            __atomic_store_n(&ctx->jobs[i].signal_usecs, usecs,
+                             __ATOMIC_RELAXED);
+            found = true;
+        }
+    }
+
+    /* The loop may be updating ts, leave it to watcher_job_heartbeat() */
+    for (i = 0; !found && i < ctx->njobs; i++) {
+        if (ctx->jobs[i].running) {
+            __atomic_store_n(&ctx->jobs[i].signal_usecs, usecs,
+                             __ATOMIC_RELAXED);
+        }
     }
 
     return;
 
 error:
-    free(ctx);
-    ctx = NULL;
-    exit(watcher_finish(WATCHER_SIGUSR1_HANDLER_FAILED, 0));
+    exit(watcher_finish(NULL, WATCHER_SIGUSR1_HANDLER_FAILED, 0, false));
 }
 
-static void watcher_sigterm_handler(int signo)
+/**
+ * @brief Move the last heartbeat time of the job forward to its last SIGUSR1
+ * heartbeat, if that one is later.
+ */
+static void watcher_job_heartbeat(struct watcher_job *job)
 {
-    (void) signo;
-    exit(watcher_finish(WATCHER_SUCCESS, 0));
-}
+    long long usecs;
 
-static int watcher_timestamp_difference(struct timestamp_st *old,
-                                        struct timestamp_st *new)
-{
-    long seconds, usecs, msecs;
-    seconds = new->seconds - old->seconds;
-    usecs = new->useconds - old->useconds;
-    if (usecs < 0) {
-        seconds--;
-        usecs += 1000000;
+    usecs = __atomic_load_n(&job->signal_usecs, __ATOMIC_RELAXED);
+    if (usecs > watcher_timestamp_usecs(&job->ts)) {
+        job->ts.seconds = usecs / 1000000;
+        job->ts.useconds = usecs % 1000000;
     }
-    msecs = seconds * 1000 + usecs/1000;
-    return msecs;
 }
 
 /**
- * @brief Execute the given command in a child process and kill it after the
- * given timeout.
- *
- * If the timeout elapses, the process is killed and the watcher process exits
- * with failure.  If the watched process finishes by itself, the watcher process
- * exits with success (regardless of the exit status of the watched process).
- *
- * If the watcher process receives an SIGUSR1 signal, it will reset the timeout
- * counter. This is useful when the watched process is a long living process
- * which will perform operations that would take long time to execute.
- *
- * If the watcher process receives an SIGTERM signal, it will kill the watched
- * process and then exit with success.
- *
- * @param[in] command   The command to be executed.
- * @param[in] env       The environment variables to be used when running the
- *                      process
- * @param[in] timeout   The timeout before killing the watched process. It can
- *                      be set as WATCHER_TIMEOUT_DEFAULT, which sets the
- *                      timeout to the default of 1 minute.
- *
- * @returns 0 if successful; -1 otherwise
+ * @brief Remove the cgroup of the given job, if any, reporting a failure.
  */
-static int watch_process(char **command, char **env, long timeout)
+static void watcher_cgroup_remove(struct watcher_job *job)
 {
-    pid_t pid;
-    int difference;
-    int rc = 0;
-    int status = 0;
+    if (watcher_cgroup_cleanup(job) != 0) {
+        fprintf(stderr, "Could not remove the cgroup of process %d: %s\n",
+                job->pid, strerror(errno));
+    }
+}
 
-    struct timestamp_st now;
+static void watcher_signal_wakeup(void)
+{
+    int saved_errno = errno;
+    char c = 0;
+    ssize_t written;
 
-    struct sigaction sa;
-    pid_t changed_pid;
+    /* If the pipe is full, a wake up is already pending */
+    written = write(signal_pipe[1], &c, 1);
+    (void) written;
 
-    char buffer[BUFFER_SIZE];
-    char *argv[MAX_ARGS + 1];
-    char env_buffer[BUFFER_SIZE];
-    char *env_copy[MAX_ARGS + 1];
-    int i = 0;
-    ssize_t used = 0;
-    ssize_t printed;
+    errno = saved_errno;
+}
 
-    if (command == NULL || command[0] == NULL || timeout == 0) {
-        errno = EINVAL;
-        return -1;
-    }
+static void watcher_sigterm_handler(int signo)
+{
+    (void) signo;
 
-    /* Copy the dynamic allocated strings to a local buffer and free the
-     * memory to avoid leaks */
-    while (command[i] != NULL && i < (MAX_ARGS + 1)) {
-        if (used + strlen(command[i]) > BUFFER_SIZE) {
-            fprintf(stderr, "Command line too long\n");
-            errno = EINVAL;
-            return WATCHER_COMMAND_TOO_LONG;
-        }
+    /* Killing the jobs waits for them, which is not async-signal-safe, so
+     * it is left to the event loop, see watcher_ctx_step() */
+    sigterm_received = 1;
+    watcher_signal_wakeup();
+}
 
-        printed = snprintf(buffer + used, sizeof(buffer) - used, "%s",
-                           command[i]);
-        if (printed <= 0) {
-            errno = EINVAL;
-            return WATCHER_CLEANUP_FAILED;
-        }
+static void watcher_sigchld_handler(int signo)
+{
+    (void) signo;
 
-#ifdef HAVE_ARGP_H
-        free(command[i]);
-        command[i] = NULL;
-#endif
+    watcher_signal_wakeup();
+}
 
-        /* Set the local argv[i] */
-        argv[i] = buffer + used;
+/**
+ * @brief Kill the watched processes, remove their cgroups and the socket of
+ * the daemon, and exit.  Called from the event loop after a SIGTERM.
+ */
+static void watcher_terminate(struct watcher_ctx *wctx)
+{
+    size_t i;
+    int rc = WATCHER_SUCCESS;
 
-        /* We need the plus 1 to skip the string terminating '\0' */
-        used += (printed + 1);
-        i++;
+    for (i = 0; i < wctx->njobs; i++) {
+        if (wctx->jobs[i].running &&
+            watcher_kill(&wctx->jobs[i], WATCHER_SUCCESS) ==
+            WATCHER_CANNOT_KILL)
+        {
+            rc = WATCHER_CANNOT_KILL;
+        }
+        watcher_cgroup_remove(&wctx->jobs[i]);
     }
 
-    /* Mark the end of the list of arguments with a NULL */
-    argv[i] = NULL;
+    if (daemon_socket != NULL) {
+        unlink(daemon_socket);
+    }
 
-    /* Reset the variables */
-    used = 0;
-    i = 0;
+    exit(rc);
+}
 
-    /* Copy the dynamic allocated strings to a local buffer and free the
-     * memory to avoid leaks */
-    if (env != NULL) {
-        while (env[i] != NULL && i < (MAX_ENV_VARS + 1)) {
-            if (used + strlen(env[i]) > BUFFER_SIZE) {
-                fprintf(stderr, "Command line too long\n");
-                errno = EINVAL;
-                return WATCHER_ENV_TOO_LONG;
-            }
+/**
+ * @brief Get a pidfd for the given child process.
+ *
+ * If the kernel does not support pidfd (Linux < 5.3), a SIGCHLD handler is
+ * installed which writes to a self-pipe and -1 is returned.  The self-pipe is
+ * then polled instead.
+ *
+ * @param[in]  pid      The pid of the watched child process
+ *
+ * @returns The pidfd on success; -1 if the self-pipe should be used; -2 on
+ * error
+ */
+static int watcher_pidfd_open(pid_t pid)
+{
+    struct sigaction sa;
+    int fd;
+    int rc;
 
-            printed = snprintf(env_buffer + used, sizeof(env_buffer) - used, "%s",
-                               env[i]);
-            if (printed <= 0) {
-                errno = EINVAL;
-                return WATCHER_CLEANUP_FAILED;
-            }
+#if defined(HAVE_SYS_SYSCALL_H) && defined(SYS_pidfd_open)
+    fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd >= 0) {
+        return fd;
+    }
+#else
+    (void) pid;
+#endif
 
-    #ifdef HAVE_ARGP_H
-            free(env[i]);
-            env[i] = NULL;
-    #endif
+    if (sigchld_handler_set) {
+        return -1;
+    }
 
-            /* Set the local argv[i] */
-            env_copy[i] = env_buffer + used;
+    /* The self-pipe is created with the SIGTERM handler */
+    sa.sa_handler = watcher_sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
 
-            /* We need the plus 1 to skip the string terminating '\0' */
-            used += (printed + 1);
-            i++;
-        }
+    rc = sigaction(SIGCHLD, &sa, NULL);
+    if (rc != 0) {
+        return -2;
     }
-    /* Mark the end of the list of environment variables with a NULL */
-    env_copy[i] = NULL;
-
-    pid = fork();
-    switch(pid){
-    case 0:
-        {
-            /* If the parent had a watcher in place, free it */
-            if (ctx != NULL) {
-                free(ctx);
-                ctx = NULL;
-            }
+    sigchld_handler_set = true;
 
-            errno = 0;
+    return -1;
+}
 
-            /* Execute the command */
-            rc = execve(argv[0], (char **)argv, (char **)env_copy);
-            if (rc != 0) {
-                fprintf(stderr, "Error in execve: %s\n", strerror(errno));
-                return WATCHER_EXEC_FAILED;
-            }
-        }
-        break;
-    case -1:
-        fprintf(stderr, "Failed to start process watcher\n");
-        return -1;
-    default:
-        /* If we had a watcher in place, free it to setup a new one */
-        if (ctx != NULL) {
-            free(ctx);
-            ctx = NULL;
-        }
+/* Binary min-heap of running jobs ordered by deadline.  The deadline of a job
+ * can only move forward (a heartbeat extends it), so the keys are updated
+ * lazily: when the top of the heap expires, its real deadline is recomputed
+ * and it is pushed down if it was extended. */
 
-        /* Set up SIGTERM handler. */
-        sa.sa_handler = watcher_sigterm_handler;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = SA_RESTART;
+static void watcher_heap_swap(struct watcher_ctx *wctx, size_t a, size_t b)
+{
+    struct watcher_job *tmp = wctx->heap[a];
 
-        rc = sigaction(SIGTERM, &sa, NULL);
-        if (rc != 0) {
-            fprintf(stderr, "Could not set signal handler for SIGTERM\n");
-            rc = watcher_finish(WATCHER_SIGTERM_SETUP_FAILED, status);
-            goto end;
-        }
+    wctx->heap[a] = wctx->heap[b];
+    wctx->heap[b] = tmp;
+    wctx->heap[a]->heap_index = a;
+    wctx->heap[b]->heap_index = b;
+}
 
-        /* Set up SIGUSR1 handler. */
-        sa.sa_handler = watcher_sigusr1_handler;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = SA_RESTART;
+static void watcher_heap_up(struct watcher_ctx *wctx, size_t i)
+{
+    size_t parent;
 
-        rc = sigaction(SIGUSR1, &sa, NULL);
-        if (rc != 0) {
-            fprintf(stderr, "Could not set signal handler for SIGUSR1\n");
-            rc = watcher_finish(WATCHER_SIGUSR1_SETUP_FAILED, status);
-            goto end;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (wctx->heap[parent]->deadline <= wctx->heap[i]->deadline) {
+            break;
         }
+        watcher_heap_swap(wctx, i, parent);
+        i = parent;
+    }
+}
 
-        ctx = calloc(1, sizeof(struct watcher_ctx));
-        if (ctx == NULL) {
-            exit(WATCHER_OOM);
-        }
+static void watcher_heap_down(struct watcher_ctx *wctx, size_t i)
+{
+    size_t child;
 
-        rc = watcher_timestamp(&ctx->ts);
-        if (rc != 0) {
-            free(ctx);
-            ctx = NULL;
-            rc = watcher_finish(WATCHER_TIMESTAMP_FAILED, status);
-            goto end;
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= wctx->heap_len) {
+            break;
         }
-
-        if (timeout < 0) {
-            /* Set default timeout of 60 seconds */
-            ctx->timeout = 60 * 1000;
-        } else {
-            ctx->timeout = timeout;
+        if (child + 1 < wctx->heap_len &&
+            wctx->heap[child + 1]->deadline < wctx->heap[child]->deadline)
+        {
+            child++;
         }
-        ctx->pid = pid;
-
-        while(1) {
-            errno = 0;
-            changed_pid = waitpid(ctx->pid, &status, WNOHANG);
-            if (changed_pid == ctx->pid) {
-                /* The process finished */
-                rc = watcher_finish(WATCHER_SUCCESS, status);
-                break;
-            } else if (changed_pid < 0) {
-                if (errno == ECHILD) {
-                    fprintf(stderr, "No child\n");
-                    /* The process was dead, we are happy */
-                    rc = watcher_finish(WATCHER_SUCCESS, status);
-                    break;
-                }
-                rc = watcher_finish(WATCHER_CANNOT_WAIT, status);
-                break;
-            } else if (changed_pid == 0) {
-                /* Watched process did not change.  Check timeout. */
-                watcher_timestamp(&now);
-                difference = watcher_timestamp_difference(&ctx->ts, &now);
-                if (difference >= ctx->timeout) {
-                    /* Timeout, finish processes with failure */
-                    fprintf(stderr, "Process %d timed out\n", pid);
-                    rc = watcher_finish(WATCHER_TIMEOUT, status);
-                    break;
-                }
-            } else {
-                rc = watcher_finish(WATCHER_CANNOT_WAIT, status);
-                break;
-            }
+        if (wctx->heap[i]->deadline <= wctx->heap[child]->deadline) {
+            break;
         }
+        watcher_heap_swap(wctx, i, child);
+        i = child;
     }
+}
 
-end:
-    return rc;
+static void watcher_heap_push(struct watcher_ctx *wctx,
+                              struct watcher_job *job)
+{
+    job->heap_index = wctx->heap_len;
+    wctx->heap[wctx->heap_len++] = job;
+    watcher_heap_up(wctx, job->heap_index);
 }
 
-#ifdef HAVE_ARGP_H
-const char *argp_program_version = "watcher-0.0.1";
-const char *argp_program_bug_address = "<libssh@libssh.org>";
+static void watcher_heap_remove(struct watcher_ctx *wctx,
+                                struct watcher_job *job)
+{
+    size_t i = job->heap_index;
 
-/* Program documentation. */
-static char doc[] = "A simple watcher to kill a process after a timeout";
+    if (i >= wctx->heap_len || wctx->heap[i] != job) {
+        return;
+    }
 
-/* A description of the arguments we accept. */
-static char args_doc[] = "COMMAND";
+    wctx->heap_len--;
+    if (i != wctx->heap_len) {
+        wctx->heap[i] = wctx->heap[wctx->heap_len];
+        wctx->heap[i]->heap_index = i;
+        watcher_heap_up(wctx, i);
+        watcher_heap_down(wctx, wctx->heap[i]->heap_index);
+    }
+    job->heap_index = (size_t)-1;
+}
 
-/* The options we understand. */
+/* Pre-kill sampling.  When a process times out, a sampler process forked from
+ * the watcher looks at it for sample_window ms before it is killed, and
+ * appends where its threads spent that time to sample_file, as folded stacks
+ * ("frame;frame;frame count" lines) which flame graph tools read.
+ *
+ * Running threads are sampled with perf_event_open(), every ms of CPU time,
+ * or by interrupting them with ptrace() and walking their frame pointers
+ * every WATCHER_SAMPLE_TICK ms if perf events are not available.  Blocked
+ * threads are sampled every tick from /proc: their state, system call and
+ * kernel stack.  The counts are in ms.
+ *
+ * The sampler is a sibling of the process, not its parent, so with Yama
+ * ptrace_scope=1 it may not trace it without CAP_SYS_PTRACE.  Tracing from
+ * the watcher would stall the event loop for the whole window, so the
+ * sampler falls back to /proc only and says so in its report. */
+#define WATCHER_SAMPLE_TICK 10
+#define WATCHER_SAMPLE_MAX_THREADS 256
+#define WATCHER_SAMPLE_MAX_FRAMES 128
+#define WATCHER_SAMPLE_RING_PAGES 16
+
+struct watcher_symbol_st {
+    unsigned long value;
+    unsigned long size;
+    const char *name;
+};
+
+struct watcher_module_st {
+    unsigned long start;
+    unsigned long end;
+    unsigned long offset;
+    char *path;
+    /* The mapped ELF file and its function symbols, sorted by address */
+    bool loaded;
+    void *image;
+    size_t image_size;
+    const ElfW(Phdr) *phdrs;
+    size_t phnum;
+    struct watcher_symbol_st *symbols;
+    size_t nsymbols;
+};
+
+struct watcher_stack_st {
+    char *frames;
+    unsigned long count;
+};
+
+struct watcher_sampler_st {
+    pid_t pid;
+    char root[64];
+    pid_t tids[WATCHER_SAMPLE_MAX_THREADS];
+    size_t ntids;
+    /* perf events of the threads, if available */
+    int perf_fds[WATCHER_SAMPLE_MAX_THREADS];
+    void *perf_rings[WATCHER_SAMPLE_MAX_THREADS];
+    size_t perf_ring_size;
+    bool use_perf;
+    bool use_ptrace;
+    struct watcher_module_st *modules;
+    size_t nmodules;
+    struct watcher_stack_st *stacks;
+    size_t nstacks;
+    size_t stacks_size;
+};
+
+static int watcher_symbol_cmp(const void *a, const void *b)
+{
+    const struct watcher_symbol_st *sa = a, *sb = b;
+
+    return (sa->value > sb->value) - (sa->value < sb->value);
+}
+
+static int watcher_stack_cmp(const void *a, const void *b)
+{
+    const struct watcher_stack_st *sa = a, *sb = b;
+
+    return strcmp(sa->frames, sb->frames);
+}
+
+/**
+ * @brief Map the ELF file of the module and collect its function symbols,
+ * from .symtab or else .dynsym.  Leaves the module without symbols if the
+ * file cannot be read.
+ */
+static void watcher_module_load(struct watcher_module_st *module)
+{
+    const ElfW(Ehdr) *ehdr;
+    const ElfW(Shdr) *shdrs, *symtab = NULL, *strtab;
+    const ElfW(Sym) *syms;
+    struct stat st;
+    size_t i, n;
+    int fd;
+
+    module->loaded = true;
+
+    fd = open(module->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return;
+    }
+    module->image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (module->image == MAP_FAILED) {
+        module->image = NULL;
+        return;
+    }
+    module->image_size = st.st_size;
+
+    ehdr = module->image;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 :
+                                                           ELFCLASS32) ||
+        ehdr->e_phoff + ehdr->e_phnum * sizeof(ElfW(Phdr)) >
+            module->image_size ||
+        ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) >
+            module->image_size)
+    {
+        return;
+    }
+
+    module->phdrs = (const ElfW(Phdr) *)((char *)module->image +
+                                         ehdr->e_phoff);
+    module->phnum = ehdr->e_phnum;
+
+    shdrs = (const ElfW(Shdr) *)((char *)module->image + ehdr->e_shoff);
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if (shdrs[i].sh_type == SHT_SYMTAB ||
+            (shdrs[i].sh_type == SHT_DYNSYM && symtab == NULL))
+        {
+            symtab = &shdrs[i];
+        }
+    }
+    if (symtab == NULL || symtab->sh_link >= ehdr->e_shnum ||
+        symtab->sh_offset + symtab->sh_size > module->image_size)
+    {
+        return;
+    }
+    strtab = &shdrs[symtab->sh_link];
+    if (strtab->sh_offset + strtab->sh_size > module->image_size) {
+        return;
+    }
+
+    syms = (const ElfW(Sym) *)((char *)module->image + symtab->sh_offset);
+    n = symtab->sh_size / sizeof(ElfW(Sym));
+    module->symbols = calloc(n, sizeof(struct watcher_symbol_st));
+    if (module->symbols == NULL) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC ||
+            syms[i].st_shndx == SHN_UNDEF || syms[i].st_value == 0 ||
+            syms[i].st_name >= strtab->sh_size)
+        {
+            continue;
+        }
+        module->symbols[module->nsymbols].value = syms[i].st_value;
+        module->symbols[module->nsymbols].size = syms[i].st_size;
+        module->symbols[module->nsymbols].name = (char *)module->image +
+                                                 strtab->sh_offset +
+                                                 syms[i].st_name;
+        module->nsymbols++;
+    }
+
+    qsort(module->symbols, module->nsymbols, sizeof(struct watcher_symbol_st),
+          watcher_symbol_cmp);
+}
+
+/**
+ * @brief Read the executable mappings of the process.
+ */
+static void watcher_sampler_modules(struct watcher_sampler_st *sampler)
+{
+    struct watcher_module_st *modules;
+    unsigned long start, end, offset;
+    char path[64], perms[8];
+    char *line = NULL;
+    size_t size = 0;
+    int pathpos;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", sampler->pid);
+    file = fopen(path, "re");
+    if (file == NULL) {
+        return;
+    }
+
+    while (getline(&line, &size, file) > 0) {
+        pathpos = 0;
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %n", &start, &end, perms,
+                   &offset, &pathpos) < 4 || perms[2] != 'x' ||
+            pathpos == 0 || line[pathpos] != '/')
+        {
+            continue;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        modules = realloc(sampler->modules, (sampler->nmodules + 1) *
+                          sizeof(struct watcher_module_st));
+        if (modules == NULL) {
+            break;
+        }
+        sampler->modules = modules;
+        memset(&modules[sampler->nmodules], 0,
+               sizeof(struct watcher_module_st));
+        modules[sampler->nmodules].start = start;
+        modules[sampler->nmodules].end = end;
+        modules[sampler->nmodules].offset = offset;
+        modules[sampler->nmodules].path = strdup(&line[pathpos]);
+        if (modules[sampler->nmodules].path == NULL) {
+            break;
+        }
+        sampler->nmodules++;
+    }
+
+    free(line);
+    fclose(file);
+}
+
+/**
+ * @brief Name the code at addr: "function", or "module+0xADDRESS" with the
+ * address in the ELF file if no symbol covers it.
+ */
+static void watcher_sampler_frame(struct watcher_sampler_st *sampler,
+                                  unsigned long addr, char *name, size_t size)
+{
+    struct watcher_module_st *module = NULL;
+    unsigned long file_offset, vaddr;
+    size_t lo, hi, mid, i;
+    const char *base;
+
+    for (i = 0; i < sampler->nmodules; i++) {
+        if (addr >= sampler->modules[i].start &&
+            addr < sampler->modules[i].end)
+        {
+            module = &sampler->modules[i];
+            break;
+        }
+    }
+    if (module == NULL) {
+        snprintf(name, size, "0x%lx", addr);
+        return;
+    }
+
+    if (!module->loaded) {
+        watcher_module_load(module);
+    }
+
+    /* Translate to the address in the ELF file using the loadable segment
+     * holding the code */
+    file_offset = addr - module->start + module->offset;
+    vaddr = file_offset;
+    for (i = 0; i < module->phnum; i++) {
+        if (module->phdrs[i].p_type == PT_LOAD &&
+            file_offset >= module->phdrs[i].p_offset &&
+            file_offset < module->phdrs[i].p_offset +
+                          module->phdrs[i].p_filesz)
+        {
+            vaddr = file_offset - module->phdrs[i].p_offset +
+                    module->phdrs[i].p_vaddr;
+            break;
+        }
+    }
+
+    /* The last symbol starting at or before the address */
+    lo = 0;
+    hi = module->nsymbols;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (module->symbols[mid].value <= vaddr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && (module->symbols[lo - 1].size == 0 ||
+                   vaddr < module->symbols[lo - 1].value +
+                           module->symbols[lo - 1].size))
+    {
+        snprintf(name, size, "%s", module->symbols[lo - 1].name);
+        return;
+    }
+
+    base = strrchr(module->path, '/');
+    snprintf(name, size, "%s+0x%lx", base != NULL ? base + 1 : module->path,
+             vaddr);
+}
+
+/**
+ * @brief Count a stack given as folded frames.
+ */
+static void watcher_sampler_add(struct watcher_sampler_st *sampler,
+                                const char *frames, unsigned long count)
+{
+    struct watcher_stack_st *stacks;
+
+    if (sampler->nstacks == sampler->stacks_size) {
+        stacks = realloc(sampler->stacks, 2 * (sampler->stacks_size + 64) *
+                         sizeof(struct watcher_stack_st));
+        if (stacks == NULL) {
+            return;
+        }
+        sampler->stacks = stacks;
+        sampler->stacks_size = 2 * (sampler->stacks_size + 64);
+    }
+
+    sampler->stacks[sampler->nstacks].frames = strdup(frames);
+    if (sampler->stacks[sampler->nstacks].frames != NULL) {
+        sampler->stacks[sampler->nstacks].count = count;
+        sampler->nstacks++;
+    }
+}
+
+/**
+ * @brief Count a user stack given as addresses, innermost first.
+ */
+static void watcher_sampler_add_ips(struct watcher_sampler_st *sampler,
+                                    const uint64_t *ips, size_t nips,
+                                    unsigned long count)
+{
+    char frames[8192], name[256];
+    size_t len;
+    size_t i;
+
+    len = snprintf(frames, sizeof(frames), "%s", sampler->root);
+    for (i = nips; i > 0 && len < sizeof(frames); i--) {
+        /* Return addresses point after the call */
+        watcher_sampler_frame(sampler, ips[i - 1] - (i > 1 ? 1 : 0), name,
+                              sizeof(name));
+        len += snprintf(frames + len, sizeof(frames) - len, ";%s", name);
+    }
+    if (len >= sizeof(frames)) {
+        len = sizeof(frames) - 1;
+        frames[len] = '\0';
+    }
+
+    watcher_sampler_add(sampler, frames, count);
+}
+
+/**
+ * @brief Count the thread if it is not running: its state, system call and
+ * kernel stack, which is only readable with privileges.
+ */
+static void watcher_sampler_blocked(struct watcher_sampler_st *sampler,
+                                    pid_t tid)
+{
+    char path[96], buf[4096], frames[8192];
+    const char *state;
+    char *kframes[64];
+    size_t nkframes = 0;
+    ssize_t nread;
+    size_t len;
+    char *p;
+    long nr;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stat", sampler->pid, tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    nread = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nread <= 0) {
+        return;
+    }
+    buf[nread] = '\0';
+    p = strrchr(buf, ')');
+    if (p == NULL || p[1] == '\0') {
+        return;
+    }
+
+    switch (p[2]) {
+    case 'R':
+        return;
+    case 'S':
+        state = "[sleeping]";
+        break;
+    case 'D':
+        state = "[uninterruptible]";
+        break;
+    case 'T':
+    case 't':
+        state = "[stopped]";
+        break;
+    default:
+        state = "[other]";
+        break;
+    }
+
+    len = snprintf(frames, sizeof(frames), "%s;%s", sampler->root, state);
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/syscall", sampler->pid,
+             tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        nread = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (nread > 0) {
+            buf[nread] = '\0';
+            nr = strtol(buf, &p, 10);
+            if (p != buf && nr >= 0) {
+                len += snprintf(frames + len, sizeof(frames) - len,
+                                ";syscall_%ld", nr);
+            }
+        }
+    }
+
+    /* Lines like "[<0>] do_nanosleep+0x6d/0x170", innermost first */
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/stack", sampler->pid, tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        nread = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (nread > 0) {
+            buf[nread] = '\0';
+            for (p = strtok(buf, "\n"); p != NULL && nkframes < 64;
+                 p = strtok(NULL, "\n"))
+            {
+                p = strchr(p, ' ');
+                if (p != NULL) {
+                    p[strcspn(p, "+\n")] = '\0';
+                    kframes[nkframes++] = p + 1;
+                }
+            }
+        }
+    }
+    while (nkframes > 0 && len < sizeof(frames)) {
+        nkframes--;
+        len += snprintf(frames + len, sizeof(frames) - len, ";%s_[k]",
+                        kframes[nkframes]);
+    }
+    if (len >= sizeof(frames)) {
+        frames[sizeof(frames) - 1] = '\0';
+    }
+
+    watcher_sampler_add(sampler, frames, WATCHER_SAMPLE_TICK);
+}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+/**
+ * @brief Open a perf event sampling the user stack of each thread every ms
+ * of CPU time.
+ *
+ * @returns 0 on success; -1 if perf events cannot be used
+ */
+static int watcher_sampler_perf_open(struct watcher_sampler_st *sampler)
+{
+    struct perf_event_attr attr;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t i;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_CPU_CLOCK;
+    attr.sample_period = 1000000;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_CALLCHAIN;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    sampler->perf_ring_size = WATCHER_SAMPLE_RING_PAGES * page_size;
+
+    for (i = 0; i < sampler->ntids; i++) {
+        sampler->perf_fds[i] = syscall(SYS_perf_event_open, &attr,
+                                       sampler->tids[i], -1, -1,
+                                       PERF_FLAG_FD_CLOEXEC);
+        if (sampler->perf_fds[i] < 0) {
+            return -1;
+        }
+
+        /* A metadata page followed by the ring */
+        sampler->perf_rings[i] = mmap(NULL, page_size +
+                                      sampler->perf_ring_size,
+                                      PROT_READ | PROT_WRITE, MAP_SHARED,
+                                      sampler->perf_fds[i], 0);
+        if (sampler->perf_rings[i] == MAP_FAILED) {
+            sampler->perf_rings[i] = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Count the samples in the perf rings.
+ */
+static void watcher_sampler_perf_read(struct watcher_sampler_st *sampler)
+{
+    struct perf_event_mmap_page *meta;
+    struct perf_event_header *header;
+    uint64_t record[1 + 1 + 1 + WATCHER_SAMPLE_MAX_FRAMES];
+    uint64_t head, tail, nr, n;
+    uint64_t ips[WATCHER_SAMPLE_MAX_FRAMES];
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t offset, chunk, size;
+    char *data;
+    size_t i, j;
+
+    for (i = 0; i < sampler->ntids; i++) {
+        meta = sampler->perf_rings[i];
+        data = (char *)meta + page_size;
+        head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+        tail = meta->data_tail;
+
+        while (tail < head) {
+            /* Copy the record out of the ring, which it may wrap around */
+            offset = tail % sampler->perf_ring_size;
+            header = (struct perf_event_header *)(data + offset);
+            size = header->size;
+            if (size == 0) {
+                break;
+            }
+            if (size <= sizeof(record)) {
+                chunk = sampler->perf_ring_size - offset;
+                if (chunk > size) {
+                    chunk = size;
+                }
+                memcpy(record, data + offset, chunk);
+                memcpy((char *)record + chunk, data, size - chunk);
+            }
+            tail += size;
+
+            header = (struct perf_event_header *)record;
+            if (size > sizeof(record) ||
+                header->type != PERF_RECORD_SAMPLE)
+            {
+                continue;
+            }
+
+            /* pid and tid, then the callchain, innermost first, with
+             * context markers */
+            nr = record[2];
+            if (nr > WATCHER_SAMPLE_MAX_FRAMES ||
+                (3 + nr) * sizeof(uint64_t) > size)
+            {
+                continue;
+            }
+            for (j = 0, n = 0; j < nr; j++) {
+                if (record[3 + j] < PERF_CONTEXT_MAX) {
+                    ips[n++] = record[3 + j];
+                }
+            }
+            watcher_sampler_add_ips(sampler, ips, n, 1);
+        }
+
+        __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+    }
+}
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+
+/**
+ * @brief Stop the thread, walk its frame pointers and let it continue.
+ *
+ * @returns The number of addresses, innermost first; 0 if the thread could
+ * not be sampled
+ */
+static size_t watcher_sampler_ptrace(pid_t tid, uint64_t *ips, size_t max)
+{
+#if defined(__x86_64__) || defined(__aarch64__)
+    struct user_regs_struct regs;
+    struct iovec local, remote, iov;
+    unsigned long frame[2];
+    unsigned long fp;
+    size_t n = 0;
+    int status;
+    int sig;
+
+    if (ptrace(PTRACE_INTERRUPT, tid, 0, 0) != 0) {
+        return 0;
+    }
+    while (waitpid(tid, &status, __WALL) < 0) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    if (!WIFSTOPPED(status)) {
+        return 0;
+    }
+
+    iov.iov_base = &regs;
+    iov.iov_len = sizeof(regs);
+    if (ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == 0) {
+#ifdef __x86_64__
+        ips[n++] = regs.rip;
+        fp = regs.rbp;
+#else
+        ips[n++] = regs.pc;
+        fp = regs.regs[29];
+#endif
+        /* Each frame starts with the caller frame and return address */
+        while (n < max && fp != 0) {
+            local.iov_base = frame;
+            local.iov_len = sizeof(frame);
+            remote.iov_base = (void *)fp;
+            remote.iov_len = sizeof(frame);
+            if (process_vm_readv(tid, &local, 1, &remote, 1, 0) !=
+                    (ssize_t)sizeof(frame) ||
+                frame[1] == 0)
+            {
+                break;
+            }
+            ips[n++] = frame[1];
+            if (frame[0] <= fp) {
+                break;
+            }
+            fp = frame[0];
+        }
+    }
+
+    /* Deliver the signal if one was about to be, instead of the
+     * interruption */
+    sig = (status >> 16 == PTRACE_EVENT_STOP) ? 0 : WSTOPSIG(status);
+    ptrace(PTRACE_CONT, tid, 0, sig);
+
+    return n;
+#else
+    (void) tid;
+    (void) ips;
+    (void) max;
+    return 0;
+#endif
+}
+
+/**
+ * @brief Sample the process for window ms and append the folded stacks to
+ * path.  Runs in a process forked from the watcher and does not return.
+ */
+static void watcher_sampler_run(pid_t pid, const char *path, long window)
+{
+    struct watcher_sampler_st sampler;
+    struct timespec tick = {0, WATCHER_SAMPLE_TICK * 1000000L};
+    struct timestamp_st now;
+    uint64_t ips[WATCHER_SAMPLE_MAX_FRAMES];
+    char proc_path[64], comm[32];
+    struct dirent *entry;
+    long long end;
+    size_t n, i, j;
+    ssize_t nread;
+    FILE *out;
+    DIR *dir;
+    int fd;
+
+    memset(&sampler, 0, sizeof(sampler));
+    sampler.pid = pid;
+
+    watcher_timestamp(&now);
+    end = watcher_timestamp_msecs(&now) + window;
+
+    /* The root frame names the process */
+    snprintf(proc_path, sizeof(proc_path), "/proc/%d/comm", pid);
+    strcpy(comm, "unknown");
+    fd = open(proc_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        nread = read(fd, comm, sizeof(comm) - 1);
+        close(fd);
+        comm[nread > 0 ? nread : 0] = '\0';
+        comm[strcspn(comm, "\n;")] = '\0';
+    }
+    snprintf(sampler.root, sizeof(sampler.root), "%s-%d", comm, pid);
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/%d/task", pid);
+    dir = opendir(proc_path);
+    if (dir == NULL) {
+        _exit(1);
+    }
+    while ((entry = readdir(dir)) != NULL &&
+           sampler.ntids < WATCHER_SAMPLE_MAX_THREADS)
+    {
+        if (entry->d_name[0] != '.') {
+            sampler.tids[sampler.ntids++] = atoi(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    watcher_sampler_modules(&sampler);
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    sampler.use_perf = (watcher_sampler_perf_open(&sampler) == 0);
+#endif
+    if (!sampler.use_perf) {
+        sampler.use_ptrace = true;
+        for (i = 0; i < sampler.ntids; i++) {
+            if (ptrace(PTRACE_SEIZE, sampler.tids[i], 0, 0) != 0) {
+                sampler.use_ptrace = false;
+                break;
+            }
+        }
+    }
+
+    do {
+        nanosleep(&tick, NULL);
+
+        if (kill(pid, 0) != 0) {
+            break;
+        }
+
+        for (i = 0; i < sampler.ntids; i++) {
+            if (sampler.use_ptrace) {
+                n = watcher_sampler_ptrace(sampler.tids[i], ips,
+                                           WATCHER_SAMPLE_MAX_FRAMES);
+                if (n > 0) {
+                    watcher_sampler_add_ips(&sampler, ips, n,
+                                            WATCHER_SAMPLE_TICK);
+                }
+            } else {
+                watcher_sampler_blocked(&sampler, sampler.tids[i]);
+            }
+        }
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+        if (sampler.use_perf) {
+            watcher_sampler_perf_read(&sampler);
+        }
+#endif
+
+        watcher_timestamp(&now);
+    } while (watcher_timestamp_msecs(&now) < end);
+
+    /* Merge the identical stacks */
+    qsort(sampler.stacks, sampler.nstacks, sizeof(struct watcher_stack_st),
+          watcher_stack_cmp);
+    for (i = 0, j = 0; i < sampler.nstacks; i++) {
+        if (j > 0 &&
+            strcmp(sampler.stacks[j - 1].frames, sampler.stacks[i].frames) == 0)
+        {
+            sampler.stacks[j - 1].count += sampler.stacks[i].count;
+        } else {
+            sampler.stacks[j++] = sampler.stacks[i];
+        }
+    }
+
+    /* Other samplers may append to the same file, write everything at once */
+    out = fopen(path, "ae");
+    if (out == NULL) {
+        _exit(1);
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    for (i = 0; i < j; i++) {
+        fprintf(out, "%s %lu\n", sampler.stacks[i].frames,
+                sampler.stacks[i].count);
+    }
+    fclose(out);
+
+    fprintf(stderr, "Sampled process %d for %ld ms with %s into %s\n", pid,
+            window, sampler.use_perf ? "perf events" :
+                    sampler.use_ptrace ? "ptrace" : "/proc only", path);
+
+    _exit(0);
+}
+
+/**
+ * @brief Start sampling the timed out process in a child of the watcher.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+static int watcher_sample_start(struct watcher_job *job)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* The sampler must not act as the watcher */
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        watcher_sampler_run(job->pid, job->sample_file, job->sample_window);
+    }
+
+    job->sampler_pid = pid;
+    return 0;
+}
+
+/**
+ * @brief Wait for the sampler of the job, which stops at the end of its
+ * window or when the process exits.
+ */
+static void watcher_sample_finish(struct watcher_job *job)
+{
+    if (job->sampler_pid <= 0) {
+        return;
+    }
+
+    while (waitpid(job->sampler_pid, NULL, 0) < 0 && errno == EINTR);
+    job->sampler_pid = -1;
+    job->sampled = true;
+}
+
+/* Pressure stall information (PSI) policies.  A trigger written to a
+ * <resource>.pressure file of the cgroup of a job, or to /proc/pressure/<resource>
+ * for the jobs without a cgroup, makes the kernel report POLLPRI when the tasks
+ * stall on the resource for longer than the threshold within the window.  The
+ * triggers are polled with the other descriptors of the event loop, so there
+ * is no sampling.  A job which stalls is then killed as if it timed out, or
+ * frozen for a window to let the other jobs make progress. */
+
+/**
+ * @brief Open a PSI trigger.
+ *
+ * @param[in] cgroup_fd The cgroup to watch, or -1 for the whole system
+ * @param[in] pressure  The trigger
+ *
+ * @returns The descriptor to poll for POLLPRI; -1 on error
+ */
+static int watcher_pressure_open(int cgroup_fd,
+                                 const struct watcher_pressure_st *pressure)
+{
+    char trigger[64];
+    char path[64];
+    int saved_errno;
+    int len;
+    int fd;
+
+    if (cgroup_fd >= 0) {
+        snprintf(path, sizeof(path), "%s.pressure", pressure->resource);
+        fd = openat(cgroup_fd, path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    } else {
+        snprintf(path, sizeof(path), "/proc/pressure/%s", pressure->resource);
+        fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* In microseconds; the kernel expects the terminating NUL */
+    len = snprintf(trigger, sizeof(trigger), "%s %ld %ld",
+                   pressure->full ? "full" : "some", pressure->stall * 1000,
+                   pressure->window * 1000);
+    if (write(fd, trigger, len + 1) < 0) {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Set up the PSI triggers of the given job after it was started.
+ *
+ * The system-wide triggers are opened once and shared by all the jobs
+ * without a cgroup.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+static int watcher_pressure_setup(struct watcher_ctx *wctx,
+                                  struct watcher_job *job)
+{
+    int *fds = job->pressure_fds;
+    size_t i;
+
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        job->pressure_fds[i] = -1;
+    }
+
+    wctx->pressure = job->pressure;
+    wctx->npressure = job->npressure;
+
+    if (job->cgroup_fd < 0) {
+        if (wctx->pressure_fds[0] >= 0) {
+            return 0;
+        }
+        fds = wctx->pressure_fds;
+    }
+
+    for (i = 0; i < job->npressure; i++) {
+        fds[i] = watcher_pressure_open(job->cgroup_fd, &job->pressure[i]);
+        if (fds[i] < 0) {
+            fprintf(stderr, "Could not set up the %s pressure trigger: %s\n",
+                    job->pressure[i].resource, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void watcher_pressure_close(struct watcher_job *job)
+{
+    size_t i;
+
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        if (job->pressure_fds[i] >= 0) {
+            close(job->pressure_fds[i]);
+            job->pressure_fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * @brief Apply the pressure policy to a job which stalled on a resource.
+ */
+static void watcher_pressure_event(struct watcher_ctx *wctx,
+                                   struct watcher_job *job,
+                                   const struct watcher_pressure_st *pressure)
+{
+    struct timestamp_st now;
+    long long usecs;
+
+    if (!job->running || job->timed_out || job->throttled) {
+        return;
+    }
+
+    watcher_timestamp(&now);
+
+    if (job->pressure_action == WATCHER_PRESSURE_THROTTLE) {
+        if (watcher_job_freeze(job, true) != 0) {
+            fprintf(stderr, "Could not freeze process %d: %s\n", job->pid,
+                    strerror(errno));
+            return;
+        }
+        fprintf(stderr, "Process %d stalled on %s, frozen for %ld ms\n",
+                job->pid, pressure->resource, pressure->window);
+        job->throttled = true;
+        job->thaw_msecs = watcher_timestamp_msecs(&now) + pressure->window;
+        job->throttles++;
+
+        /* The time frozen does not count for the timeout */
+        watcher_job_heartbeat(job);
+        usecs = watcher_timestamp_usecs(&job->ts) + pressure->window * 1000LL;
+        job->ts.seconds = usecs / 1000000;
+        job->ts.useconds = usecs % 1000000;
+        return;
+    }
+
+    /* Kill it through the deadlines, with the grace period if any */
+    fprintf(stderr, "Process %d stalled on %s\n", job->pid,
+            pressure->resource);
+    job->timed_out = true;
+    job->stalled = true;
+    job->expired_usecs = watcher_timestamp_usecs(&now);
+    job->deadline = watcher_timestamp_msecs(&now);
+    watcher_heap_up(wctx, job->heap_index);
+}
+
+/**
+ * @brief Thaw the frozen jobs whose window elapsed, or which timed out so that
+ * they can handle SIGTERM.
+ *
+ * @returns The number of milliseconds until the next thaw, or -1 if no job is
+ * frozen
+ */
+static long watcher_pressure_thaw(struct watcher_ctx *wctx)
+{
+    struct watcher_job *job;
+    struct timestamp_st now;
+    long long now_msecs;
+    long next = -1;
+    size_t i;
+
+    watcher_timestamp(&now);
+    now_msecs = watcher_timestamp_msecs(&now);
+
+    for (i = 0; i < wctx->njobs; i++) {
+        job = &wctx->jobs[i];
+        if (!job->running || !job->throttled) {
+            continue;
+        }
+
+        if (job->timed_out || job->thaw_msecs <= now_msecs) {
+            if (watcher_job_freeze(job, false) != 0) {
+                fprintf(stderr, "Could not thaw process %d: %s\n", job->pid,
+                        strerror(errno));
+            }
+            job->throttled = false;
+        } else if (next < 0 || job->thaw_msecs - now_msecs < next) {
+            next = (long)(job->thaw_msecs - now_msecs);
+        }
+    }
+
+    return next;
+}
+
+/**
+ * @brief Gather the additional descriptors and the PSI triggers to poll in
+ * wctx->step_pfds.
+ *
+ * @returns The number of descriptors; -1 on error
+ */
+static long watcher_pressure_pfds(struct watcher_ctx *wctx,
+                                  struct pollfd *extra, nfds_t nextra)
+{
+    struct pollfd *pfds;
+    struct watcher_job *job;
+    size_t size;
+    nfds_t nfds;
+    size_t i, j;
+
+    size = nextra + (wctx->njobs + 1) * WATCHER_PRESSURE_MAX;
+    if (size > wctx->step_pfds_size) {
+        pfds = realloc(wctx->step_pfds, size * sizeof(struct pollfd));
+        if (pfds == NULL) {
+            return -1;
+        }
+        wctx->step_pfds = pfds;
+        wctx->step_pfds_size = size;
+    }
+
+    for (nfds = 0; nfds < nextra; nfds++) {
+        wctx->step_pfds[nfds] = extra[nfds];
+    }
+
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        if (wctx->pressure_fds[i] >= 0) {
+            wctx->step_pfds[nfds].fd = wctx->pressure_fds[i];
+            wctx->step_pfds[nfds].events = POLLPRI;
+            wctx->step_pfds[nfds].revents = 0;
+            nfds++;
+        }
+    }
+
+    for (i = 0; i < wctx->njobs; i++) {
+        job = &wctx->jobs[i];
+        for (j = 0; job->running && j < WATCHER_PRESSURE_MAX; j++) {
+            if (job->pressure_fds[j] >= 0) {
+                wctx->step_pfds[nfds].fd = job->pressure_fds[j];
+                wctx->step_pfds[nfds].events = POLLPRI;
+                wctx->step_pfds[nfds].revents = 0;
+                nfds++;
+            }
+        }
+    }
+
+    return (long)nfds;
+}
+
+/**
+ * @brief Handle the PSI triggers which fired in the descriptors gathered by
+ * watcher_pressure_pfds(), and give the revents of the additional
+ * descriptors back.
+ */
+static void watcher_pressure_check(struct watcher_ctx *wctx,
+                                   struct pollfd *extra, nfds_t nextra)
+{
+    struct watcher_job *job;
+    short revents;
+    nfds_t nfds;
+    size_t i, j, k;
+
+    for (nfds = 0; nfds < nextra; nfds++) {
+        extra[nfds].revents = wctx->step_pfds[nfds].revents;
+    }
+
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        if (wctx->pressure_fds[i] < 0) {
+            continue;
+        }
+        revents = wctx->step_pfds[nfds++].revents;
+        if (revents & (POLLERR | POLLNVAL)) {
+            /* The trigger is unusable, do not poll it anymore */
+            close(wctx->pressure_fds[i]);
+            wctx->pressure_fds[i] = -1;
+        } else if (revents & POLLPRI) {
+            /* No way to tell which job stalled, so all of them are
+             * throttled; killing requires --cgroup */
+            for (k = 0; k < wctx->njobs; k++) {
+                if (wctx->jobs[k].cgroup_fd < 0 &&
+                    wctx->jobs[k].npressure > 0)
+                {
+                    watcher_pressure_event(wctx, &wctx->jobs[k],
+                                           &wctx->pressure[i]);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < wctx->njobs; i++) {
+        job = &wctx->jobs[i];
+        for (j = 0; job->running && j < WATCHER_PRESSURE_MAX; j++) {
+            if (job->pressure_fds[j] < 0) {
+                continue;
+            }
+            revents = wctx->step_pfds[nfds++].revents;
+            if (revents & (POLLERR | POLLNVAL)) {
+                close(job->pressure_fds[j]);
+                job->pressure_fds[j] = -1;
+            } else if (revents & POLLPRI) {
+                watcher_pressure_event(wctx, job, &job->pressure[j]);
+            }
+        }
+    }
+}
+
+/* Inactivity timeout.  With --inactivity, the CPU time, the context switches
+ * and the I/O counters of each process are sampled at a low rate, and any
+ * change counts as a heartbeat, so processes which cannot send heartbeats are
+ * only killed when they stop making progress.  The counters only increase,
+ * so it is enough to compare their sum.  The /proc files are opened once per
+ * process and read again with pread(), so a sample costs a few system calls.
+ * With --cgroup, the CPU time of the whole cgroup is used, so the work of the
+ * children counts too. */
+
+/**
+ * @brief Read a /proc or cgroup file opened by watcher_proc_open().
+ *
+ * @returns The number of bytes read, NUL-terminated; -1 on error
+ */
+static ssize_t watcher_proc_read(int fd, char *buffer, size_t size)
+{
+    ssize_t nread;
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    nread = pread(fd, buffer, size - 1, 0);
+    if (nread < 0) {
+        return -1;
+    }
+    buffer[nread] = '\0';
+
+    return nread;
+}
+
+/**
+ * @brief Get the sum of the activity counters of the given job.
+ */
+static unsigned long long watcher_activity_read(struct watcher_job *job)
+{
+    unsigned long long utime = 0, stime = 0, slices = 0;
+    unsigned long long sum = 0;
+    char buffer[1024];
+    char *p;
+
+    if (watcher_proc_read(job->cpu_stat_fd, buffer, sizeof(buffer)) > 0 &&
+        strncmp(buffer, "usage_usec ", 11) == 0)
+    {
+        sum += strtoull(&buffer[11], NULL, 10);
+    } else if (watcher_proc_read(job->stat_fd, buffer, sizeof(buffer)) > 0) {
+        /* The command name may contain spaces, the fields start after the
+         * last ')' */
+        p = strrchr(buffer, ')');
+        if (p != NULL &&
+            sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                   "%llu %llu", &utime, &stime) == 2)
+        {
+            sum += utime + stime;
+        }
+    }
+
+    /* Number of times the main thread ran */
+    if (watcher_proc_read(job->schedstat_fd, buffer, sizeof(buffer)) > 0 &&
+        sscanf(buffer, "%*u %*u %llu", &slices) == 1)
+    {
+        sum += slices;
+    }
+
+    /* All the values of /proc/<pid>/io are counters */
+    if (watcher_proc_read(job->io_fd, buffer, sizeof(buffer)) > 0) {
+        for (p = strchr(buffer, ':'); p != NULL; p = strchr(p, ':')) {
+            sum += strtoull(p + 1, &p, 10);
+        }
+    }
+
+    return sum;
+}
+
+static int watcher_proc_open_file(pid_t pid, const char *name)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief Open the /proc and cgroup counters of the given job after it was
+ * started, for --inactivity and --timeline.
+ *
+ * Counters which cannot be opened, e.g. /proc/<pid>/io without permission,
+ * are ignored.
+ */
+static void watcher_proc_open(struct watcher_job *job)
+{
+    job->stat_fd = watcher_proc_open_file(job->pid, "stat");
+    job->schedstat_fd = watcher_proc_open_file(job->pid, "schedstat");
+    job->io_fd = watcher_proc_open_file(job->pid, "io");
+    if (job->cgroup_fd >= 0) {
+        job->cpu_stat_fd = openat(job->cgroup_fd, "cpu.stat",
+                                  O_RDONLY | O_CLOEXEC);
+    }
+}
+
+static void watcher_proc_close(struct watcher_job *job)
+{
+    int *fds[] = {
+        &job->stat_fd, &job->schedstat_fd, &job->io_fd, &job->cpu_stat_fd,
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+/**
+ * @brief Check if the process of the given job did something since the last
+ * sample.
+ */
+static bool watcher_activity_changed(struct watcher_job *job)
+{
+    unsigned long long activity = watcher_activity_read(job);
+
+    if (activity == job->activity) {
+        return false;
+    }
+
+    job->activity = activity;
+    return true;
+}
+
+/* Resource timeline.  With --timeline, the memory, CPU time, threads and I/O
+ * counters of each process are appended to a binary file, see timeline.h.
+ * The /proc files of --inactivity are reused, so a sample costs two pread()
+ * per process, three with --cgroup, and one write() for all the processes. */
+
+/**
+ * @brief Sample the counters of the given job into a timeline record.
+ */
+static void watcher_timeline_sample(struct watcher_job *job,
+                                    struct watcher_timeline_record_st *record,
+                                    long long now_msecs)
+{
+    unsigned long long utime = 0, stime = 0;
+    unsigned long long rchar = 0, wchar = 0;
+    long threads = 0, rss = 0;
+    char buffer[1024];
+    char *p;
+
+    memset(record, 0, sizeof(*record));
+    record->msecs = (uint32_t)(now_msecs - timeline_start);
+    record->pid = job->pid;
+    record->id = job->id;
+
+    if (watcher_proc_read(job->stat_fd, buffer, sizeof(buffer)) > 0) {
+        p = strrchr(buffer, ')');
+        if (p != NULL &&
+            sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                   "%llu %llu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+                   &utime, &stime, &threads, &rss) == 4)
+        {
+            record->cpu_usecs = (utime + stime) * 1000000 /
+                                (unsigned long long)sysconf(_SC_CLK_TCK);
+            record->threads = (uint32_t)threads;
+            record->rss_kib = (uint32_t)(rss * (sysconf(_SC_PAGESIZE) / 1024));
+        }
+    }
+
+    if (watcher_proc_read(job->cpu_stat_fd, buffer, sizeof(buffer)) > 0 &&
+        strncmp(buffer, "usage_usec ", 11) == 0)
+    {
+        record->cpu_usecs = strtoull(&buffer[11], NULL, 10);
+    }
+
+    if (watcher_proc_read(job->io_fd, buffer, sizeof(buffer)) > 0 &&
+        sscanf(buffer, "rchar: %llu wchar: %llu", &rchar, &wchar) == 2)
+    {
+        record->read_bytes = rchar;
+        record->write_bytes = wchar;
+    }
+}
+
+/**
+ * @brief Append a sample of every running process to the timeline.
+ */
+static void watcher_timeline_write(struct watcher_ctx *wctx,
+                                   long long now_msecs)
+{
+    struct watcher_timeline_record_st *records;
+    size_t count = 0;
+    size_t i;
+    ssize_t nwritten;
+
+    if (timeline_size < wctx->njobs) {
+        records = realloc(timeline_records,
+                          wctx->njobs * sizeof(*timeline_records));
+        if (records == NULL) {
+            return;
+        }
+        timeline_records = records;
+        timeline_size = wctx->njobs;
+    }
+
+    for (i = 0; i < wctx->njobs; i++) {
+        if (wctx->jobs[i].running) {
+            watcher_timeline_sample(&wctx->jobs[i], &timeline_records[count],
+                                    now_msecs);
+            count++;
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    nwritten = write(timeline_fd, timeline_records,
+                     count * sizeof(*timeline_records));
+    if (nwritten < 0) {
+        fprintf(stderr, "Could not write the timeline: %s\n",
+                strerror(errno));
+    }
+}
+
+/**
+ * @brief Create the timeline file and write its header.
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+static int watcher_timeline_open(const char *path, long interval)
+{
+    struct watcher_timeline_header_st header = {
+        .magic = WATCHER_TIMELINE_MAGIC,
+        .version = WATCHER_TIMELINE_VERSION,
+        .record_size = sizeof(struct watcher_timeline_record_st),
+        .interval = (uint32_t)interval,
+    };
+    struct timestamp_st now;
+    struct timespec real;
+
+    timeline_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+                       O_CLOEXEC, 0644);
+    if (timeline_fd < 0) {
+        fprintf(stderr, "Could not open file %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    header.start_usecs = (uint64_t)real.tv_sec * 1000000 +
+                         (uint64_t)real.tv_nsec / 1000;
+    if (write(timeline_fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "Could not write file %s: %s\n", path,
+                strerror(errno));
+        close(timeline_fd);
+        timeline_fd = -1;
+        return -1;
+    }
+
+    watcher_timestamp(&now);
+    timeline_start = watcher_timestamp_msecs(&now);
+    timeline_next = timeline_start;
+    timeline_interval = interval;
+
+    return 0;
+}
+
+static void watcher_timeline_close(void)
+{
+    if (timeline_fd >= 0) {
+        close(timeline_fd);
+        timeline_fd = -1;
+    }
+    free(timeline_records);
+    timeline_records = NULL;
+    timeline_size = 0;
+}
+
+/**
+ * @brief Write the last captured bytes of output of the given job to stderr.
+ */
+static void watcher_capture_dump(struct watcher_job *job)
+{
+    unsigned long long len;
+    char buffer[4096];
+    ssize_t written;
+    off_t offset;
+    size_t count;
+    int fd;
+
+    if (job->output_len == 0) {
+        return;
+    }
+
+    len = job->output_len;
+    if (len > job->capture_size) {
+        len = job->capture_size;
+    }
+
+    fprintf(stderr, "---- Last %llu bytes of output of process %d ----\n",
+            len, job->pid);
+    fflush(stderr);
+
+    fd = (job->log_fd >= 0) ? job->log_fd : job->ring_fd;
+    offset = (job->log_fd >= 0) ? (off_t)(job->output_len - len) :
+                                  (off_t)((job->output_len - len) %
+                                          job->capture_size);
+
+    while (len > 0) {
+        /* In the ring buffer, the tail may wrap around */
+        count = len;
+        if (job->log_fd < 0 && offset + count > job->capture_size) {
+            count = job->capture_size - offset;
+        }
+
+        written = sendfile(STDERR_FILENO, fd, &offset, count);
+        if (written < 0 && errno == EINVAL) {
+            /* stderr does not support sendfile(), e.g. it was opened with
+             * O_APPEND, so copy it instead */
+            if (count > sizeof(buffer)) {
+                count = sizeof(buffer);
+            }
+            written = pread(fd, buffer, count, offset);
+            if (written > 0) {
+                written = write(STDERR_FILENO, buffer, written);
+            }
+            if (written > 0) {
+                offset += written;
+            }
+        }
+        if (written <= 0) {
+            break;
+        }
+
+        len -= written;
+        if (job->log_fd < 0 && (size_t)offset == job->capture_size) {
+            offset = 0;
+        }
+    }
+
+    fprintf(stderr, "\n---- End of output of process %d ----\n", job->pid);
+}
+
+/**
+ * @brief Check if the process of the given job finished and report it.
+ *
+ * @returns 0 if the process is still running or was reaped; -1 otherwise
+ */
+static int watcher_job_reap(struct watcher_ctx *wctx, struct watcher_job *job)
+{
+    pid_t changed_pid;
+    int status = 0;
+
+    errno = 0;
+    changed_pid = watcher_job_wait(job, &status, WNOHANG);
+    if (changed_pid == 0) {
+        return 0;
+    }
+
+    watcher_heap_remove(wctx, job);
+    wctx->running--;
+
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+
+    /* The process exited while it was sampled */
+    watcher_sample_finish(job);
+    watcher_pressure_close(job);
+    watcher_proc_close(job);
+    watcher_heartbeat_cleanup(job);
+    watcher_cgroup_remove(job);
+    watcher_capture_drain(job);
+
+    if (changed_pid == job->pid) {
+        /* The process finished */
+        if (job->timed_out || WIFSIGNALED(status)) {
+            watcher_capture_dump(job);
+        }
+        watcher_capture_cleanup(job);
+        watcher_finish(job, job->stalled ? WATCHER_STALLED :
+                            job->timed_out ? WATCHER_TIMEOUT :
+                                             WATCHER_SUCCESS,
+                       status, true);
+        return 0;
+    } else if (changed_pid < 0 && errno == ECHILD) {
+        fprintf(stderr, "No child\n");
+        /* The process was dead, we are happy */
+        job->running = false;
+        job->result = job->stalled ? WATCHER_STALLED :
+                      job->timed_out ? WATCHER_TIMEOUT : WATCHER_SUCCESS;
+        return 0;
+    }
+
+    watcher_finish(job, WATCHER_CANNOT_WAIT, status, false);
+    return -1;
+}
+
+/**
+ * @brief Handle the jobs whose deadline elapsed.
+ *
+ * A job which times out is sent SIGTERM and gets a grace period to exit, if
+ * configured.  Then it is killed and gets a last deadline to confirm the
+ * kill.  If it is not reaped before the last deadline, the watcher gives up
+ * on it.
+ *
+ * @returns The number of milliseconds until the next deadline, or -1 if there
+ * is no deadline pending
+ */
+static long watcher_check_deadlines(struct watcher_ctx *wctx)
+{
+    struct watcher_job *job;
+    struct timestamp_st now;
+    long long now_msecs;
+    long long deadline;
+    int rc;
+
+    while (wctx->heap_len > 0) {
+        watcher_timestamp(&now);
+        now_msecs = watcher_timestamp_msecs(&now);
+
+        job = wctx->heap[0];
+        if (job->deadline > now_msecs) {
+            return (long)(job->deadline - now_msecs);
+        }
+
+        if (!job->timed_out) {
+            /* The heartbeat may have moved the deadline forward */
+            watcher_job_heartbeat(job);
+            deadline = watcher_timestamp_msecs(&job->ts) + job->timeout;
+            if (job->inactivity > 0 && watcher_activity_changed(job)) {
+                /* The process was active since the last sample */
+                job->ts = now;
+                deadline = now_msecs + job->timeout;
+            } else if (deadline <= now_msecs &&
+                       watcher_heartbeat_changed(job))
+            {
+                /* Heartbeats were sent through the shared memory channel
+                 * since the last check */
+                job->ts = now;
+                deadline = now_msecs + job->timeout;
+            }
+            if (deadline > now_msecs) {
+                /* Wake up for the next sample before the deadline */
+                if (job->inactivity > 0 &&
+                    deadline > now_msecs + job->inactivity)
+                {
+                    deadline = now_msecs + job->inactivity;
+                }
+                job->deadline = deadline;
+                watcher_heap_down(wctx, 0);
+                continue;
+            }
+
+            /* Timeout, kill the process and wait for it to be reaped */
+            if (job->heartbeat != NULL) {
+                fprintf(stderr, "Process %d timed out (last progress "
+                        "%" PRIu64 ")\n", job->pid,
+                        __atomic_load_n(&job->heartbeat->progress,
+                                        __ATOMIC_RELAXED));
+            } else {
+                fprintf(stderr, "Process %d timed out\n", job->pid);
+            }
+            job->timed_out = true;
+            job->expired_usecs = watcher_timestamp_usecs(&job->ts) +
+                                 job->timeout * 1000LL;
+
+            if (job->sample_file != NULL && job->sample_window > 0 &&
+                watcher_sample_start(job) == 0)
+            {
+                /* Let the sampler look at the process before killing it */
+                job->deadline = now_msecs + job->sample_window;
+                watcher_heap_down(wctx, 0);
+                continue;
+            }
+        }
+
+        if (job->sampler_pid > 0) {
+            watcher_sample_finish(job);
+            watcher_timestamp(&now);
+            now_msecs = watcher_timestamp_msecs(&now);
+        }
+
+        if (job->grace > 0 && !job->terminating && !job->killed) {
+            /* Give the process a chance to exit cleanly */
+            rc = watcher_job_signal(job, SIGTERM);
+            if (rc == 0) {
+                job->terminating = true;
+                job->deadline = now_msecs + job->grace;
+                watcher_heap_down(wctx, 0);
+                continue;
+            }
+        }
+
+        if (!job->killed) {
+            /* Timed out and the grace period, if any, is over */
+            rc = watcher_job_signal(job, SIGKILL);
+            if (rc < 0) {
+                watcher_heap_remove(wctx, job);
+                wctx->running--;
+                watcher_finish(job, WATCHER_CANNOT_KILL, 0, false);
+                continue;
+            }
+            job->killed = true;
+            job->deadline = now_msecs + 1000;
+            watcher_heap_down(wctx, 0);
+        } else {
+            /* The process was not reaped after the kill */
+            watcher_heap_remove(wctx, job);
+            wctx->running--;
+            watcher_finish(job, WATCHER_CANNOT_KILL, 0, false);
+        }
+    }
+
+    return -1;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Kinds of requests, in the low bits of the user data.  The polls of a job
+ * also carry the index of the job and its pid, so the completion of a poll
+ * armed for a previous job in the same slot is ignored */
+#define WATCHER_URING_PIDFD 0
+#define WATCHER_URING_OUTPUT 1
+#define WATCHER_URING_SIGNAL 2
+#define WATCHER_URING_OTHER 3
+/* Subkinds of WATCHER_URING_OTHER; the polls of the additional descriptors
+ * also carry their index and the number of the wait */
+#define WATCHER_URING_EXTRA (1 << 2)
+#define WATCHER_URING_REMOVE (2 << 2)
+
+#define WATCHER_URING_JOB(kind, index, pid) \
+    ((uint64_t)(uint32_t)(pid) << 32 | (uint64_t)(index) << 2 | (kind))
+#define WATCHER_URING_EXTRA_DATA(index, wait) \
+    ((uint64_t)(uint32_t)(wait) << 32 | (uint64_t)(index) << 4 | \
+     WATCHER_URING_EXTRA | WATCHER_URING_OTHER)
+
+struct watcher_uring_st {
+    int fd;
+    /* Submission queue */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Completion queue */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Pid of the job each poll is armed for, 0 if none; 2 per job */
+    pid_t *armed;
+    bool signal_armed;
+    /* User data of the polls of the additional descriptors which did not
+     * complete during the last wait, to be removed */
+    uint64_t *extra_pending;
+    size_t nextra_pending;
+    size_t extra_size;
+    uint32_t wait;
+};
+
+static void watcher_uring_free(struct watcher_uring_st *uring)
+{
+    if (uring == NULL) {
+        return;
+    }
+
+    if (uring->sqes != NULL && uring->sqes != MAP_FAILED) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->cq_ring != NULL && uring->cq_ring != MAP_FAILED) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sq_ring != NULL && uring->sq_ring != MAP_FAILED) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    if (uring->fd >= 0) {
+        close(uring->fd);
+    }
+    free(uring->armed);
+    free(uring->extra_pending);
+    free(uring);
+}
+
+/**
+ * @brief Set up an io_uring instance to wait for the events of njobs jobs.
+ *
+ * @returns The instance; NULL if io_uring is not available, with errno set
+ */
+static struct watcher_uring_st *watcher_uring_setup(size_t njobs)
+{
+    struct watcher_uring_st *uring;
+    struct io_uring_params params;
+    unsigned int entries = 16;
+    int saved_errno;
+
+    /* Room for the polls of all the jobs, so a wait is a single syscall */
+    while (entries < 2 * njobs + 16 && entries < 4096) {
+        entries *= 2;
+    }
+
+    uring = calloc(1, sizeof(struct watcher_uring_st));
+    if (uring == NULL) {
+        return NULL;
+    }
+    uring->fd = -1;
+
+    uring->armed = calloc(2 * njobs + 1, sizeof(pid_t));
+    if (uring->armed == NULL) {
+        goto error;
+    }
+
+    /* Completions are only needed when the watcher waits for them */
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    uring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    if (uring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        uring->fd = syscall(SYS_io_uring_setup, entries, &params);
+    }
+    if (uring->fd < 0) {
+        goto error;
+    }
+
+    /* The timeout of the wait is passed to io_uring_enter() */
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP;
+        goto error;
+    }
+
+    uring->sq_ring_size = params.sq_off.array +
+                          params.sq_entries * sizeof(unsigned int);
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd,
+                          IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        goto error;
+    }
+
+    uring->cq_ring_size = params.cq_off.cqes +
+                          params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, uring->fd,
+                          IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+        goto error;
+    }
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        goto error;
+    }
+
+    uring->sq_head = (unsigned int *)((char *)uring->sq_ring +
+                                      params.sq_off.head);
+    uring->sq_tail = (unsigned int *)((char *)uring->sq_ring +
+                                      params.sq_off.tail);
+    uring->sq_array = (unsigned int *)((char *)uring->sq_ring +
+                                       params.sq_off.array);
+    uring->sq_mask = *(unsigned int *)((char *)uring->sq_ring +
+                                       params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+
+    uring->cq_head = (unsigned int *)((char *)uring->cq_ring +
+                                      params.cq_off.head);
+    uring->cq_tail = (unsigned int *)((char *)uring->cq_ring +
+                                      params.cq_off.tail);
+    uring->cq_mask = *(unsigned int *)((char *)uring->cq_ring +
+                                       params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)((char *)uring->cq_ring +
+                                          params.cq_off.cqes);
+
+    return uring;
+
+error:
+    saved_errno = errno;
+    watcher_uring_free(uring);
+    errno = saved_errno;
+    return NULL;
+}
+
+/**
+ * @brief Submit the queued requests, and wait up to msecs ms (< 0 for no
+ * limit) for min_complete completions.
+ *
+ * @returns 0 on success; 1 if interrupted by a signal or the time is up; -1
+ * otherwise
+ */
+static int watcher_uring_enter(struct watcher_uring_st *uring,
+                               unsigned int min_complete, long msecs)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int queued;
+    int rc;
+
+    queued = *uring->sq_tail -
+             __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+    memset(&arg, 0, sizeof(arg));
+    if (msecs >= 0) {
+        ts.tv_sec = msecs / 1000;
+        ts.tv_nsec = (msecs % 1000) * 1000000;
+        arg.ts = (uintptr_t)&ts;
+    }
+
+    rc = syscall(SYS_io_uring_enter, uring->fd, queued, min_complete,
+                 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                 sizeof(arg));
+    if (rc < 0) {
+        if (errno == EINTR || errno == ETIME) {
+            return 1;
+        }
+        if (errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Queue a request, submitting the queued ones first if the
+ * submission queue is full.
+ *
+ * @returns The zeroed request; NULL on error
+ */
+static struct io_uring_sqe *watcher_uring_sqe(struct watcher_uring_st *uring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail = *uring->sq_tail;
+
+    while (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >=
+           uring->sq_entries)
+    {
+        if (watcher_uring_enter(uring, 0, 0) < 0) {
+            return NULL;
+        }
+    }
+
+    sqe = &uring->sqes[tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+static int watcher_uring_poll(struct watcher_uring_st *uring, int fd,
+                              short events, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = watcher_uring_sqe(uring);
+
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = (unsigned short)events;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/**
+ * @brief Handle a completion of watcher_uring_wait().
+ *
+ * @returns true if it is an event the caller waits for; false otherwise
+ */
+static bool watcher_uring_complete(struct watcher_ctx *wctx,
+                                   struct io_uring_cqe *cqe,
+                                   struct pollfd *extra, nfds_t nextra)
+{
+    struct watcher_uring_st *uring = wctx->uring;
+    struct watcher_job *job;
+    uint64_t data = cqe->user_data;
+    size_t index = (data & 0xffffffff) >> 2;
+    pid_t pid = (pid_t)(data >> 32);
+    int kind = data & 3;
+    char drain[64];
+    size_t j;
+
+    switch (kind) {
+    case WATCHER_URING_PIDFD:
+    case WATCHER_URING_OUTPUT:
+        if (index >= wctx->njobs || uring->armed[2 * index + kind] != pid) {
+            /* Armed for a previous job in the slot */
+            return false;
+        }
+        uring->armed[2 * index + kind] = 0;
+
+        job = &wctx->jobs[index];
+        if (!job->running || job->pid != pid) {
+            return false;
+        }
+        if (kind == WATCHER_URING_OUTPUT) {
+            watcher_capture_drain(job);
+        } else {
+            job->ready = true;
+        }
+        return true;
+    case WATCHER_URING_SIGNAL:
+        uring->signal_armed = false;
+
+        /* Drain the self-pipe and check all the jobs without a pidfd */
+        while (read(signal_pipe[0], drain, sizeof(drain)) > 0);
+        for (j = 0; j < wctx->njobs; j++) {
+            if (wctx->jobs[j].pidfd < 0) {
+                wctx->jobs[j].ready = true;
+            }
+        }
+        return true;
+    default:
+        if ((data & 0xf) != (WATCHER_URING_EXTRA | WATCHER_URING_OTHER) ||
+            (uint32_t)(data >> 32) != uring->wait)
+        {
+            /* Removals and polls of previous waits */
+            return false;
+        }
+        index = (data & 0xffffffff) >> 4;
+        if (index < nextra) {
+            extra[index].revents = cqe->res < 0 ? POLLERR : cqe->res;
+        }
+        return true;
+    }
+}
+
+/**
+ * @brief Wait for events as watcher_wait_event() does, with io_uring.
+ *
+ * Unlike poll(), the descriptors of the jobs are only passed to the kernel
+ * once: each gets a one-shot poll request, which is armed again after it
+ * completes.  Submitting the new polls and waiting with a timeout is then a
+ * single io_uring_enter().  The exit of a process is seen as its pidfd
+ * becoming readable, then reaped with waitid() as with poll().
+ */
+static int watcher_uring_wait(struct watcher_ctx *wctx, long msecs,
+                              struct pollfd *extra, nfds_t nextra)
+{
+    struct watcher_uring_st *uring = wctx->uring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct watcher_job *job;
+    struct timestamp_st now;
+    long long deadline = 0;
+    uint64_t *pending;
+    unsigned int head, tail;
+    bool events = false;
+    size_t i;
+    int rc;
+
+    /* Remove the polls left from the previous wait */
+    for (i = 0; i < uring->nextra_pending; i++) {
+        sqe = watcher_uring_sqe(uring);
+        if (sqe == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = uring->extra_pending[i];
+        sqe->user_data = WATCHER_URING_REMOVE | WATCHER_URING_OTHER;
+    }
+    uring->nextra_pending = 0;
+
+    for (i = 0; i < wctx->njobs; i++) {
+        job = &wctx->jobs[i];
+        if (!job->running) {
+            continue;
+        }
+        if (job->pidfd >= 0 && uring->armed[2 * i] != job->pid) {
+            if (watcher_uring_poll(uring, job->pidfd, POLLIN,
+                                   WATCHER_URING_JOB(WATCHER_URING_PIDFD, i,
+                                                     job->pid)) != 0)
+            {
+                return -1;
+            }
+            uring->armed[2 * i] = job->pid;
+        }
+        if (job->output_fd >= 0 && uring->armed[2 * i + 1] != job->pid) {
+            if (watcher_uring_poll(uring, job->output_fd, POLLIN,
+                                   WATCHER_URING_JOB(WATCHER_URING_OUTPUT, i,
+                                                     job->pid)) != 0)
+            {
+                return -1;
+            }
+            uring->armed[2 * i + 1] = job->pid;
+        }
+    }
+
+    if (signal_pipe[0] >= 0 && !uring->signal_armed) {
+        if (watcher_uring_poll(uring, signal_pipe[0], POLLIN,
+                               WATCHER_URING_SIGNAL) != 0)
+        {
+            return -1;
+        }
+        uring->signal_armed = true;
+    }
+
+    uring->wait++;
+    for (i = 0; i < nextra; i++) {
+        extra[i].revents = 0;
+        if (watcher_uring_poll(uring, extra[i].fd, extra[i].events,
+                               WATCHER_URING_EXTRA_DATA(i, uring->wait)) != 0)
+        {
+            return -1;
+        }
+    }
+
+    if (msecs >= 0) {
+        watcher_timestamp(&now);
+        deadline = watcher_timestamp_msecs(&now) + msecs;
+    }
+
+    /* Removed polls and polls armed for previous jobs also complete, so wait
+     * until something happens or the time is up */
+    do {
+        rc = watcher_uring_enter(uring, 1, msecs);
+        if (rc < 0) {
+            return -1;
+        }
+
+        head = *uring->cq_head;
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &uring->cqes[head & uring->cq_mask];
+            if (watcher_uring_complete(wctx, cqe, extra, nextra)) {
+                events = true;
+            }
+        }
+        __atomic_store_n(uring->cq_head, tail, __ATOMIC_RELEASE);
+
+        if (rc == 0 && !events && msecs > 0) {
+            watcher_timestamp(&now);
+            msecs = deadline - watcher_timestamp_msecs(&now);
+            if (msecs < 0) {
+                msecs = 0;
+            }
+        }
+    } while (rc == 0 && !events && msecs != 0);
+
+    /* The polls which did not complete are removed on the next wait */
+    if (nextra > uring->extra_size) {
+        pending = realloc(uring->extra_pending, nextra * sizeof(uint64_t));
+        if (pending == NULL) {
+            return -1;
+        }
+        uring->extra_pending = pending;
+        uring->extra_size = nextra;
+    }
+    for (i = 0; i < nextra; i++) {
+        if (extra[i].revents == 0) {
+            uring->extra_pending[uring->nextra_pending++] =
+                WATCHER_URING_EXTRA_DATA(i, uring->wait);
+        }
+    }
+
+    return 0;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+ * @brief Block until a watched process changes state, a signal is received
+ * or the given number of milliseconds elapse.
+ *
+ * @param[in] wctx      The watcher context
+ * @param[in] msecs     The maximum time to wait; -1 to wait forever
+ * @param[in,out] extra Additional descriptors to poll, whose revents are set
+ *                      on return.  Can be NULL.
+ * @param[in] nextra    The number of additional descriptors
+ *
+ * @returns 0 on success (including interruption by a signal); -1 otherwise
+ */
+static int watcher_wait_event(struct watcher_ctx *wctx, long msecs,
+                              struct pollfd *extra, nfds_t nextra)
+{
+    struct watcher_job **pfd_jobs;
+    struct pollfd *pfds;
+    char drain[64];
+    nfds_t nfds = 0;
+    nfds_t njob_fds;
+    size_t size;
+    size_t i, j;
+    int rc;
+
+    if (msecs > INT_MAX) {
+        msecs = INT_MAX;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (wctx->uring != NULL) {
+        return watcher_uring_wait(wctx, msecs, extra, nextra);
+    }
+#endif
+
+    /* The pidfd and output pipe of each job, the signal self-pipe and the
+     * additional descriptors */
+    size = 2 * wctx->njobs + 1 + nextra;
+    if (size > wctx->pfds_size) {
+        pfds = realloc(wctx->pfds, size * sizeof(struct pollfd));
+        if (pfds == NULL) {
+            return -1;
+        }
+        wctx->pfds = pfds;
+
+        pfd_jobs = realloc(wctx->pfd_jobs, size * sizeof(struct watcher_job *));
+        if (pfd_jobs == NULL) {
+            return -1;
+        }
+        wctx->pfd_jobs = pfd_jobs;
+        wctx->pfds_size = size;
+    }
+
+    for (i = 0; i < wctx->njobs; i++) {
+        if (!wctx->jobs[i].running) {
+            continue;
+        }
+        if (wctx->jobs[i].pidfd >= 0) {
+            wctx->pfds[nfds].fd = wctx->jobs[i].pidfd;
+            wctx->pfds[nfds].events = POLLIN;
+            wctx->pfds[nfds].revents = 0;
+            wctx->pfd_jobs[nfds] = &wctx->jobs[i];
+            nfds++;
+        }
+        if (wctx->jobs[i].output_fd >= 0) {
+            wctx->pfds[nfds].fd = wctx->jobs[i].output_fd;
+            wctx->pfds[nfds].events = POLLIN;
+            wctx->pfds[nfds].revents = 0;
+            wctx->pfd_jobs[nfds] = &wctx->jobs[i];
+            nfds++;
+        }
+    }
+
+    if (signal_pipe[0] >= 0) {
+        wctx->pfds[nfds].fd = signal_pipe[0];
+        wctx->pfds[nfds].events = POLLIN;
+        wctx->pfds[nfds].revents = 0;
+        wctx->pfd_jobs[nfds] = NULL;
+        nfds++;
+    }
+
+    njob_fds = nfds;
+    for (i = 0; i < nextra; i++) {
+        extra[i].revents = 0;
+        wctx->pfds[nfds] = extra[i];
+        wctx->pfd_jobs[nfds] = NULL;
+        nfds++;
+    }
+
+    rc = poll(wctx->pfds, nfds, (int)msecs);
+    if (rc < 0) {
+        if (errno == EINTR) {
+            /* Probably SIGUSR1, the caller will check the deadlines again */
+            return 0;
+        }
+        return -1;
+    }
+
+    for (i = 0; i < nextra; i++) {
+        extra[i].revents = wctx->pfds[njob_fds + i].revents;
+    }
+
+    for (i = 0; i < njob_fds; i++) {
+        if (wctx->pfds[i].revents == 0) {
+            continue;
+        }
+
+        if (wctx->pfd_jobs[i] != NULL) {
+            if (wctx->pfds[i].fd == wctx->pfd_jobs[i]->output_fd) {
+                watcher_capture_drain(wctx->pfd_jobs[i]);
+            } else {
+                wctx->pfd_jobs[i]->ready = true;
+            }
+            continue;
+        }
+
+        /* Drain the self-pipe and check all the jobs without a pidfd */
+        while (read(signal_pipe[0], drain, sizeof(drain)) > 0);
+        for (j = 0; j < wctx->njobs; j++) {
+            if (wctx->jobs[j].pidfd < 0) {
+                wctx->jobs[j].ready = true;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Free the watcher context, if any.  The jobs are not touched.
+ */
+static void watcher_ctx_free(void)
+{
+    size_t i;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    watcher_uring_free(ctx->uring);
+#endif
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        if (ctx->pressure_fds[i] >= 0) {
+            close(ctx->pressure_fds[i]);
+        }
+    }
+    free(ctx->step_pfds);
+    free(ctx->heap);
+    free(ctx->pfds);
+    free(ctx->pfd_jobs);
+    free(ctx);
+    ctx = NULL;
+}
+
+/**
+ * @brief Set up the signal handlers and the watcher context for the given
+ * job slots.
+ *
+ * The jobs are not started, see watcher_job_start().
+ *
+ * @param[in] jobs      The job slots
+ * @param[in] njobs     The number of job slots
+ *
+ * @returns WATCHER_SUCCESS on success; the watcher exit code otherwise
+ */
+static int watcher_ctx_setup(struct watcher_job *jobs, size_t njobs)
+{
+    struct sigaction sa;
+    size_t i;
+    int rc;
+
+    /* If we had a watcher in place, free it to setup a new one */
+    watcher_ctx_free();
+
+    for (i = 0; i < njobs; i++) {
+        watcher_job_init(&jobs[i]);
+    }
+
+    /* Set up SIGTERM handler, which wakes up the event loop through the
+     * self-pipe. */
+    if (signal_pipe[0] < 0 &&
+        pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+        fprintf(stderr, "Could not create the signal pipe\n");
+        return watcher_finish(NULL, WATCHER_SIGTERM_SETUP_FAILED, 0, false);
+    }
+
+    sa.sa_handler = watcher_sigterm_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    rc = sigaction(SIGTERM, &sa, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "Could not set signal handler for SIGTERM\n");
+        return watcher_finish(NULL, WATCHER_SIGTERM_SETUP_FAILED, 0, false);
+    }
+
+    /* Set up SIGUSR1 handler. */
+    sa.sa_sigaction = watcher_sigusr1_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+
+    rc = sigaction(SIGUSR1, &sa, NULL);
+    if (rc != 0) {
+        fprintf(stderr, "Could not set signal handler for SIGUSR1\n");
+        return watcher_finish(NULL, WATCHER_SIGUSR1_SETUP_FAILED, 0, false);
+    }
+
+    ctx = calloc(1, sizeof(struct watcher_ctx));
+    if (ctx == NULL) {
+        exit(WATCHER_OOM);
+    }
+
+    ctx->heap = calloc(njobs, sizeof(struct watcher_job *));
+    if (ctx->heap == NULL) {
+        exit(WATCHER_OOM);
+    }
+
+    for (i = 0; i < WATCHER_PRESSURE_MAX; i++) {
+        ctx->pressure_fds[i] = -1;
+    }
+
+    if (event_backend == WATCHER_BACKEND_IO_URING) {
+#ifdef HAVE_LINUX_IO_URING_H
+        ctx->uring = watcher_uring_setup(njobs);
+        if (ctx->uring == NULL) {
+            fprintf(stderr, "io_uring is not available (%s), using poll()\n",
+                    strerror(errno));
+        }
+#else
+        fprintf(stderr, "io_uring is not supported, using poll()\n");
+#endif
+    }
+
+    /* The jobs are not running, so the signal handlers can see them */
+    ctx->jobs = jobs;
+    ctx->njobs = njobs;
+
+    return WATCHER_SUCCESS;
+}
+
+/**
+ * @brief Start the process of the given job slot and add it to the watched
+ * processes.
+ *
+ * @returns WATCHER_SUCCESS if the process was started or could not be
+ * executed, in which case the job is finished with WATCHER_EXEC_FAILED; the
+ * watcher exit code or -1 if the watcher cannot continue
+ */
+static int watcher_job_start(struct watcher_ctx *wctx, struct watcher_job *job)
+{
+    struct timestamp_st now;
+    int rc;
+
+    if (job->timeout < 0) {
+        /* Set default timeout of 60 seconds */
+        job->timeout = 60 * 1000;
+    }
+
+    job->reaped = false;
+    job->result = WATCHER_SUCCESS;
+
+    rc = watcher_timestamp(&job->ts);
+    if (rc != 0) {
+        return watcher_finish(NULL, WATCHER_TIMESTAMP_FAILED, 0, false);
+    }
+    job->signal_usecs = watcher_timestamp_usecs(&job->ts);
+    job->deadline = watcher_timestamp_msecs(&job->ts) + job->timeout;
+
+    rc = watcher_job_spawn(job);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", job->spawn_error, strerror(errno));
+    }
+    if (rc == WATCHER_EXEC_FAILED) {
+        /* The command could not be executed */
+        return WATCHER_SUCCESS;
+    } else if (rc != 0) {
+        return -1;
+    }
+
+    watcher_timestamp(&now);
+    watcher_histogram_record(WATCHER_HISTOGRAM_SPAWN,
+                             watcher_timestamp_usecs(&now) -
+                             watcher_timestamp_usecs(&job->start));
+
+    if (job->pidfd < 0) {
+        job->pidfd = watcher_pidfd_open(job->pid);
+        if (job->pidfd == -2) {
+            fprintf(stderr, "Could not wait for process %d: %s\n", job->pid,
+                    strerror(errno));
+            watcher_kill(job, WATCHER_CANNOT_WAIT);
+            return -1;
+        }
+    }
+
+    if (job->npressure > 0 && watcher_pressure_setup(wctx, job) != 0) {
+        watcher_kill(job, WATCHER_CANNOT_WAIT);
+        return -1;
+    }
+
+    if (job->inactivity > 0 || timeline_fd >= 0) {
+        watcher_proc_open(job);
+    }
+    if (job->inactivity > 0) {
+        job->activity = watcher_activity_read(job);
+        if (job->inactivity < job->timeout) {
+            job->deadline = watcher_timestamp_msecs(&job->ts) +
+                            job->inactivity;
+        }
+    }
+
+    /* Check the process at least once in case it finished before we could
+     * be notified */
+    job->ready = true;
+    wctx->running++;
+    watcher_heap_push(wctx, job);
+
+    return WATCHER_SUCCESS;
+}
+
+/**
+ * @brief Run one iteration of the event loop: handle the expired deadlines,
+ * sleep until the next event and reap the processes which changed state.
+ *
+ * The jobs finished when this returns are not running anymore.  The sleep is
+ * skipped if a process may have changed state already, or if no process is
+ * running and there are no additional descriptors to poll.
+ *
+ * @param[in] wctx      The watcher context
+ * @param[in,out] extra Additional descriptors to poll, see
+ *                      watcher_wait_event()
+ * @param[in] nextra    The number of additional descriptors
+ *
+ * @returns WATCHER_SUCCESS on success; the watcher exit code otherwise
+ */
+static int watcher_ctx_step(struct watcher_ctx *wctx, struct pollfd *extra,
+                            nfds_t nextra)
+{
+    struct pollfd *pfds = extra;
+    nfds_t npfds = nextra;
+    struct timestamp_st now;
+    long long now_msecs;
+    long thaw;
+    long next;
+    size_t i;
+    int rc;
+
+    if (sigterm_received) {
+        watcher_terminate(wctx);
+    }
+
+    next = watcher_check_deadlines(wctx);
+    if (wctx->pressure != NULL) {
+        thaw = watcher_pressure_thaw(wctx);
+        if (thaw >= 0 && (next < 0 || thaw < next)) {
+            next = thaw;
+        }
+    }
+    for (i = 0; i < wctx->njobs; i++) {
+        if (wctx->jobs[i].running && wctx->jobs[i].ready) {
+            next = 0;
+            break;
+        }
+    }
+
+    if (stats_file != NULL) {
+        watcher_timestamp(&now);
+        now_msecs = watcher_timestamp_msecs(&now);
+        if (now_msecs >= stats_next) {
+            watcher_stats_write(stats_file, wctx->running);
+            stats_next = now_msecs + WATCHER_STATS_INTERVAL;
+        }
+        if (next < 0 || next > stats_next - now_msecs) {
+            next = stats_next - now_msecs;
+        }
+    }
+
+    if (timeline_fd >= 0) {
+        watcher_timestamp(&now);
+        now_msecs = watcher_timestamp_msecs(&now);
+        if (now_msecs >= timeline_next) {
+            watcher_timeline_write(wctx, now_msecs);
+            timeline_next = now_msecs + timeline_interval;
+        }
+        if (next < 0 || next > timeline_next - now_msecs) {
+            next = timeline_next - now_msecs;
+        }
+    }
+
+    if (wctx->pressure != NULL) {
+        /* Also wait for the PSI triggers */
+        rc = watcher_pressure_pfds(wctx, extra, nextra);
+        if (rc < 0) {
+            return watcher_finish(NULL, WATCHER_OOM, 0, false);
+        }
+        pfds = wctx->step_pfds;
+        npfds = (nfds_t)rc;
+    }
+
+    if (wctx->running > 0 || nextra > 0) {
+        /* Sleep until a process changes state or the next deadline */
+        rc = watcher_wait_event(wctx, next, pfds, npfds);
+        if (rc != 0) {
+            return watcher_finish(NULL, WATCHER_CANNOT_WAIT, 0, false);
+        }
+    }
+
+    if (sigterm_received) {
+        watcher_terminate(wctx);
+    }
+
+    if (wctx->pressure != NULL) {
+        watcher_pressure_check(wctx, extra, nextra);
+    }
+
+    for (i = 0; i < wctx->njobs; i++) {
+        if (wctx->jobs[i].running && wctx->jobs[i].ready) {
+            wctx->jobs[i].ready = false;
+            rc = watcher_job_reap(wctx, &wctx->jobs[i]);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    }
+
+    return WATCHER_SUCCESS;
+}
+
+/**
+ * @brief Kill the processes still running and release the resources of the
+ * given job.  The command and environment are kept.
+ */
+static void watcher_job_cleanup(struct watcher_job *job)
+{
+    if (job->running) {
+        watcher_kill(job, WATCHER_CANNOT_WAIT);
+    }
+    watcher_sample_finish(job);
+    watcher_pressure_close(job);
+    watcher_proc_close(job);
+    if (job->pidfd >= 0) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    watcher_heartbeat_cleanup(job);
+    watcher_cgroup_remove(job);
+    watcher_capture_cleanup(job);
+}
+
+/**
+ * @brief Report why the command of a job could not be marshalled.
+ */
+static void watcher_marshal_error(int rc)
+{
+    if (rc == WATCHER_COMMAND_TOO_LONG) {
+        fprintf(stderr, "Command line too long\n");
+    } else if (rc == WATCHER_ENV_TOO_LONG) {
+        fprintf(stderr, "Environment too long\n");
+    }
+}
+
+/**
+ * @brief Execute the given jobs concurrently and kill each of them after its
+ * timeout.
+ *
+ * Each job has its own deadline, which is reset when the watcher receives a
+ * SIGUSR1 signal from the watched process.  A SIGUSR1 sent by any other
+ * process resets the deadlines of all the jobs.
+ *
+ * If the watcher process receives an SIGTERM signal, it will kill the watched
+ * processes and then exit.
+ *
+ * @param[in] jobs      The jobs to run.  The argv, env and timeout of each
+ *                      job must be set.
+ * @param[in] njobs     The number of jobs
+ *
+ * @returns The watcher exit code of the first job which did not succeed, or
+ * WATCHER_SUCCESS if all jobs succeeded
+ */
+static int watch_processes(struct watcher_job *jobs, size_t njobs)
+{
+    size_t i;
+    int rc = WATCHER_SUCCESS;
+
+    if (jobs == NULL || njobs == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = watcher_ctx_setup(jobs, njobs);
+    if (rc != WATCHER_SUCCESS) {
+        return rc;
+    }
+
+    for (i = 0; i < njobs; i++) {
+        rc = watcher_job_start(ctx, &jobs[i]);
+        if (rc != WATCHER_SUCCESS) {
+            goto end;
+        }
+    }
+
+    while (ctx->running > 0) {
+        rc = watcher_ctx_step(ctx, NULL, 0);
+        if (rc != WATCHER_SUCCESS) {
+            goto end;
+        }
+    }
+
+    rc = WATCHER_SUCCESS;
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].result != WATCHER_SUCCESS) {
+            rc = jobs[i].result;
+            break;
+        }
+    }
+
+end:
+    for (i = 0; i < njobs; i++) {
+        watcher_job_cleanup(&jobs[i]);
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Execute the given command in a child process and kill it after the
+ * given timeout.
+ *
+ * If the timeout elapses, the process is killed and the watcher process exits
+ * with failure.  If the watched process finishes by itself, the watcher process
+ * exits with success (regardless of the exit status of the watched process).
+ *
+ * The watcher blocks waiting for the watched process to change state or for
+ * the timeout to elapse, so it does not consume CPU while the watched process
+ * is running.
+ *
+ * If the watcher process receives an SIGUSR1 signal, it will reset the timeout
+ * counter. This is useful when the watched process is a long living process
+ * which will perform operations that would take long time to execute.
+ *
+ * If the watcher process receives an SIGTERM signal, it will kill the watched
+ * process and then exit with success.
+ *
+ * @param[in] command   The command to be executed.
+ * @param[in] env       The environment variables to be used when running the
+ *                      process
+ * @param[in] settings  The settings for the job.  The timeout before killing
+ *                      the watched process can be set as
+ *                      WATCHER_TIMEOUT_DEFAULT, which sets the timeout to the
+ *                      default of 1 minute.
+ *
+ * @returns 0 if successful; -1 otherwise
+ */
+static int watch_process(char **command, char **env,
+                         const struct watcher_job *settings)
+{
+    struct watcher_job job;
+    size_t argc = 0;
+    size_t envc = 0;
+    int rc;
+
+    if (command == NULL || command[0] == NULL || settings == NULL ||
+        settings->timeout == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (command[argc] != NULL) {
+        argc++;
+    }
+    while (env != NULL && env[envc] != NULL) {
+        envc++;
+    }
+
+    job = *settings;
+    rc = watcher_job_marshal(&job, command, argc, env, envc);
+    if (rc != 0) {
+        watcher_marshal_error(rc);
+        return rc;
+    }
+
+    rc = watch_processes(&job, 1);
+
+    free(job.arena);
+    return rc;
+}
+
+/**
+ * @brief Restrict the CPUs of the placement to the ones of its NUMA nodes,
+ * read from sysfs.  If no CPUs were set, all the CPUs of the nodes are used.
+ *
+ * @returns 0 on success; -1 if a node does not exist or has no CPUs left
+ */
+static int watcher_placement_nodes(struct watcher_placement_st *placement)
+{
+    char path[64], list[4096];
+    cpu_set_t node_cpus, cpus;
+    ssize_t nread;
+    size_t node;
+    int fd;
+
+    CPU_ZERO(&cpus);
+
+    for (node = 0; node < WATCHER_MAX_NODES; node++) {
+        if (!(placement->nodes[node / WATCHER_NODE_BITS] &
+              (1UL << (node % WATCHER_NODE_BITS))))
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist",
+                 node);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        nread = read(fd, list, sizeof(list) - 1);
+        close(fd);
+        if (nread < 0) {
+            fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        list[nread] = '\0';
+
+        /* Memory-only nodes have an empty list */
+        if (nread <= 1) {
+            continue;
+        }
+
+        if (watcher_parse_cpus(list, &node_cpus) != 0) {
+            fprintf(stderr, "Could not parse %s\n", path);
+            return -1;
+        }
+        CPU_OR(&cpus, &cpus, &node_cpus);
+    }
+
+    if (placement->set_cpus) {
+        CPU_AND(&cpus, &cpus, &placement->cpus);
+    }
+
+    if (CPU_COUNT(&cpus) == 0) {
+        fprintf(stderr, "No CPU left on the given NUMA nodes\n");
+        return -1;
+    }
+
+    placement->cpus = cpus;
+    placement->set_cpus = true;
+    return 0;
+}
+
+/**
+ * @brief List the CPUs jobs are spread across: the CPUs of the placement, or
+ * the CPUs the watcher may run on.
+ *
+ * @param[out] cpus   Receives the allocated list of CPU numbers
+ * @param[out] ncpus  Receives the number of CPUs in the list
+ *
+ * @returns 0 on success; -1 otherwise
+ */
+static int watcher_spread_cpus(const struct watcher_placement_st *placement,
+                               int **cpus, size_t *ncpus)
+{
+    cpu_set_t set;
+    size_t n = 0;
+    int cpu;
+
+    if (placement->set_cpus) {
+        set = placement->cpus;
+    } else if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return -1;
+    }
+
+    *cpus = calloc(CPU_COUNT(&set), sizeof(int));
+    if (*cpus == NULL) {
+        return -1;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            (*cpus)[n++] = cpu;
+        }
+    }
+    *ncpus = n;
+
+    return 0;
+}
+
+/**
+ * @brief Execute multiple commands concurrently, each with its own timeout.
+ *
+ * The commands are given in a single list of arguments, separated by a ";"
+ * argument.  All the commands use the same environment and timeout.
+ *
+ * @param[in] command   The list of arguments of all commands
+ * @param[in] argc      The number of arguments in the list
+ * @param[in] env       The environment variables to be used when running the
+ *                      processes
+ * @param[in] envc      The number of environment variables
+ * @param[in] settings  The settings for all the jobs
+ *
+ * @returns The watcher exit code of the first job which did not succeed, or
+ * WATCHER_SUCCESS if all jobs succeeded
+ */
+static int watch_multiple_processes(char **command, int argc, char **env,
+                                    int envc,
+                                    const struct watcher_job *settings)
+{
+    struct watcher_job *jobs;
+    char **log_files;
+    int *cpus = NULL;
+    size_t ncpus = 0;
+    size_t njobs = 0;
+    size_t j;
+    int start = 0;
+    int i;
+    int rc = 0;
+
+    if (command == NULL || argc == 0 || settings == NULL ||
+        settings->timeout == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* There are at most argc / 2 + 1 non-empty commands */
+    jobs = calloc(argc / 2 + 1, sizeof(struct watcher_job));
+    log_files = calloc(argc / 2 + 1, sizeof(char *));
+    if (jobs == NULL || log_files == NULL) {
+        free(jobs);
+        free(log_files);
+        return WATCHER_OOM;
+    }
+
+    if (settings->placement != NULL && settings->placement->spread &&
+        watcher_spread_cpus(settings->placement, &cpus, &ncpus) != 0)
+    {
+        rc = WATCHER_OOM;
+        goto end;
+    }
+
+    for (i = 0; i <= argc; i++) {
+        if (i < argc && strcmp(command[i], COMMAND_SEPARATOR) != 0) {
+            continue;
+        }
+
+        if (i > start) {
+            jobs[njobs] = *settings;
+            jobs[njobs].id = njobs;
+            if (ncpus > 0) {
+                /* All the jobs start at once, so round-robin is balanced */
+                jobs[njobs].pinned = true;
+                jobs[njobs].cpu = cpus[njobs % ncpus];
+            }
+            rc = watcher_job_marshal(&jobs[njobs], &command[start],
+                                     i - start, env, envc);
+            if (rc != 0) {
+                watcher_marshal_error(rc);
+                goto end;
+            }
+            njobs++;
+
+            if (settings->log_file != NULL) {
+                /* Each command has its own log file */
+                rc = asprintf(&log_files[njobs - 1], "%s.%zu",
+                              settings->log_file, njobs);
+                if (rc < 0) {
+                    log_files[njobs - 1] = NULL;
+                    rc = WATCHER_OOM;
+                    goto end;
+                }
+                jobs[njobs - 1].log_file = log_files[njobs - 1];
+                rc = 0;
+            }
+        }
+        start = i + 1;
+    }
+
+    if (njobs == 0) {
+        fprintf(stderr, "No command provided\n");
+        rc = EINVAL;
+    } else {
+        rc = watch_processes(jobs, njobs);
+    }
+
+end:
+    for (j = 0; j < njobs; j++) {
+        free(jobs[j].arena);
+        free(log_files[j]);
+    }
+    free(jobs);
+    free(log_files);
+    free(cpus);
+
+    return rc;
+}
+
+/**
+ * @brief Split a line of a job file into words, in place.
+ *
+ * Words are separated by blanks.  Single quotes keep everything up to the
+ * next single quote, double quotes keep everything up to the next unescaped
+ * double quote, and a backslash escapes the next character outside single
+ * quotes.  A '#' at the start of a word starts a comment.
+ *
+ * @param[in,out] line  The line, overwritten with the NUL-terminated words
+ * @param[out] words    Receives pointers to the words.  It must have room
+ *                      for strlen(line) / 2 + 1 words.
+ *
+ * @returns The number of words; -1 if a quote is not closed
+ */
+static long watcher_batch_split(char *line, char **words)
+{
+    char *in = line;
+    char *out = line;
+    char quote;
+    long n = 0;
+
+    for (;;) {
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') {
+            in++;
+        }
+        if (*in == '\0' || *in == '#') {
+            break;
+        }
+
+        words[n++] = out;
+        while (*in != '\0' && *in != ' ' && *in != '\t' && *in != '\n' &&
+               *in != '\r')
+        {
+            if (*in == '\'' || *in == '"') {
+                quote = *in++;
+                while (*in != quote) {
+                    if (*in == '\0') {
+                        return -1;
+                    }
+                    if (quote == '"' && *in == '\\' &&
+                        (in[1] == '"' || in[1] == '\\'))
+                    {
+                        in++;
+                    }
+                    *out++ = *in++;
+                }
+                in++;
+            } else {
+                if (*in == '\\' && in[1] != '\0') {
+                    in++;
+                }
+                *out++ = *in++;
+            }
+        }
+
+        /* The separator, if any, was consumed, so out < in here */
+        if (*in != '\0') {
+            in++;
+        }
+        *out++ = '\0';
+    }
+
+    return n;
+}
+
+/**
+ * @brief Read a job file into an array of jobs ready to be started.
+ *
+ * Each non-empty line which is not a comment is a job:
+ *
+ *     TIMEOUT [VAR=VALUE...] COMMAND [ARGS...]
+ *
+ * TIMEOUT is in ms, or "-" to use the timeout given in the settings.  The
+ * variables are added to the environment given in the arguments.
+ *
+ * @param[in] file      The job file
+ * @param[in] env       The environment variables of all jobs
+ * @param[in] envc      The number of environment variables
+ * @param[in] settings  The settings for all the jobs
+ * @param[out] jobs     Receives the array of jobs, which must be freed with
+ *                      their arenas and log files
+ * @param[out] njobs    Receives the number of jobs
+ *
+ * @returns 0 on success; the watcher exit code or EINVAL otherwise
+ */
+static int watcher_batch_read(FILE *file, char **env, int envc,
+                              const struct watcher_job *settings,
+                              struct watcher_job **jobs, size_t *njobs)
+{
+    struct watcher_job *grown;
+    struct watcher_job *job;
+    size_t jobs_size = 0;
+    size_t line_size = 0;
+    char *line = NULL;
+    char **words = NULL;
+    char **job_env;
+    char *log_file;
+    char *end;
+    uint64_t lineno = 0;
+    ssize_t len;
+    long nwords;
+    long first;
+    long i;
+    int rc = 0;
+
+    *jobs = NULL;
+    *njobs = 0;
+
+    while ((len = getline(&line, &line_size, file)) >= 0) {
+        lineno++;
+
+        free(words);
+        words = calloc(len / 2 + 2, sizeof(char *));
+        if (words == NULL) {
+            rc = WATCHER_OOM;
+            goto end;
+        }
+
+        nwords = watcher_batch_split(line, words);
+        if (nwords == 0) {
+            continue;
+        } else if (nwords < 2) {
+            fprintf(stderr, "Invalid job at line %" PRIu64 "\n", lineno);
+            rc = EINVAL;
+            goto end;
+        }
+
+        if (*njobs == jobs_size) {
+            grown = realloc(*jobs, (2 * jobs_size + 16) *
+                            sizeof(struct watcher_job));
+            if (grown == NULL) {
+                rc = WATCHER_OOM;
+                goto end;
+            }
+            *jobs = grown;
+            jobs_size = 2 * jobs_size + 16;
+        }
+
+        job = &(*jobs)[*njobs];
+        *job = *settings;
+        job->id = lineno;
+        job->arena = NULL;
+        job->log_file = NULL;
+
+        if (strcmp(words[0], "-") != 0) {
+            errno = 0;
+            job->timeout = strtol(words[0], &end, 10);
+            if (errno != 0 || *end != '\0' || job->timeout == 0) {
+                fprintf(stderr, "Invalid timeout at line %" PRIu64 "\n",
+                        lineno);
+                rc = EINVAL;
+                goto end;
+            }
+        }
+
+        /* The variables of the line follow the global ones.  The words
+         * array has room for them in front of the command */
+        for (first = 1; first < nwords; first++) {
+            if (strchr(words[first], '=') == NULL) {
+                break;
+            }
+        }
+        if (first == nwords) {
+            fprintf(stderr, "No command at line %" PRIu64 "\n", lineno);
+            rc = EINVAL;
+            goto end;
+        }
+
+        job_env = calloc(envc + first, sizeof(char *));
+        if (job_env == NULL) {
+            rc = WATCHER_OOM;
+            goto end;
+        }
+        for (i = 0; i < envc; i++) {
+            job_env[i] = env[i];
+        }
+        for (i = 1; i < first; i++) {
+            job_env[envc + i - 1] = words[i];
+        }
+
+        rc = watcher_job_marshal(job, &words[first], nwords - first, job_env,
+                                 envc + first - 1);
+        free(job_env);
+        if (rc != 0) {
+            fprintf(stderr, "Job at line %" PRIu64 " is too long\n", lineno);
+            goto end;
+        }
+        (*njobs)++;
+
+        if (settings->log_file != NULL) {
+            /* Each job has its own log file, named after its line */
+            rc = asprintf(&log_file, "%s.%" PRIu64, settings->log_file,
+                          lineno);
+            if (rc < 0) {
+                rc = WATCHER_OOM;
+                goto end;
+            }
+            job->log_file = log_file;
+            rc = 0;
+        }
+    }
+
+    if (ferror(file)) {
+        rc = EINVAL;
+    }
+
+end:
+    free(words);
+    free(line);
+    return rc;
+}
+
+/**
+ * @brief Execute the jobs of a job file, running at most max_jobs processes
+ * at once.
+ *
+ * The jobs are started in the order of the file as soon as a slot is free, so
+ * a slow job never holds back the others.  Each job has its own timeout, as
+ * in watch_process().  When a job finishes, its accounting record is written
+ * to stdout, with the line of the job as id.  A summary is written at the
+ * end.  See watcher_batch_read() for the format of the file.
+ *
+ * @param[in] path      The path of the job file; "-" for stdin
+ * @param[in] max_jobs  The maximum number of processes running at once
+ * @param[in] env       The environment variables of all jobs
+ * @param[in] envc      The number of environment variables
+ * @param[in] settings  The settings for all the jobs
+ *
+ * @returns The watcher exit code of the first job in the file which did not
+ * succeed, or WATCHER_SUCCESS if all jobs succeeded
+ */
+static int watch_batch(const char *path, size_t max_jobs, char **env,
+                       int envc, const struct watcher_job *settings)
+{
+    struct watcher_job *queue = NULL;
+    struct watcher_job *slots = NULL;
+    struct watcher_job *job;
+    struct timestamp_st start, end_ts;
+    size_t *queue_index = NULL;
+    /* CPUs the jobs are spread across and the number of jobs on each */
+    int *cpus = NULL;
+    size_t *cpu_jobs = NULL;
+    size_t *slot_cpu = NULL;
+    size_t ncpus = 0;
+    size_t best;
+    size_t njobs = 0;
+    size_t next = 0;
+    size_t active = 0;
+    size_t succeeded = 0;
+    size_t timed_out = 0;
+    size_t i, j;
+    FILE *file;
+    int rc;
+
+    if (path == NULL || max_jobs == 0 || settings == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        file = stdin;
+    } else {
+        file = fopen(path, "re");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open file %s: %s\n", path,
+                    strerror(errno));
+            return EINVAL;
+        }
+    }
+
+    rc = watcher_batch_read(file, env, envc, settings, &queue, &njobs);
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (rc != 0) {
+        goto end;
+    }
+
+    if (njobs == 0) {
+        fprintf(stderr, "No job in %s\n", path);
+        rc = EINVAL;
+        goto end;
+    }
+
+    if (max_jobs > njobs) {
+        max_jobs = njobs;
+    }
+
+    slots = calloc(max_jobs, sizeof(struct watcher_job));
+    queue_index = calloc(max_jobs, sizeof(size_t));
+    if (slots == NULL || queue_index == NULL) {
+        rc = WATCHER_OOM;
+        goto end;
+    }
+
+    if (settings->placement != NULL && settings->placement->spread) {
+        if (watcher_spread_cpus(settings->placement, &cpus, &ncpus) != 0) {
+            rc = WATCHER_OOM;
+            goto end;
+        }
+        cpu_jobs = calloc(ncpus, sizeof(size_t));
+        slot_cpu = calloc(max_jobs, sizeof(size_t));
+        if (cpu_jobs == NULL || slot_cpu == NULL) {
+            rc = WATCHER_OOM;
+            goto end;
+        }
+    }
+
+    rc = watcher_ctx_setup(slots, max_jobs);
+    if (rc != WATCHER_SUCCESS) {
+        goto end;
+    }
+
+    watcher_timestamp(&start);
+
+    while (next < njobs || active > 0) {
+        /* Fill the free slots from the queue */
+        for (i = 0; i < max_jobs && next < njobs; i++) {
+            if (slots[i].arena != NULL) {
+                continue;
+            }
+
+            /* The slot takes over the arena of the queued job */
+            slots[i] = queue[next];
+            watcher_job_init(&slots[i]);
+            queue[next].arena = NULL;
+            queue_index[i] = next;
+            next++;
+            active++;
+
+            if (ncpus > 0) {
+                /* Jobs finish in any order, so pick the least loaded CPU */
+                best = 0;
+                for (j = 1; j < ncpus; j++) {
+                    if (cpu_jobs[j] < cpu_jobs[best]) {
+                        best = j;
+                    }
+                }
+                cpu_jobs[best]++;
+                slot_cpu[i] = best;
+                slots[i].pinned = true;
+                slots[i].cpu = cpus[best];
+            }
+
+            rc = watcher_job_start(ctx, &slots[i]);
+            if (rc != WATCHER_SUCCESS) {
+                /* Keep running the other jobs */
+                watcher_job_cleanup(&slots[i]);
+                slots[i].running = false;
+                slots[i].result = WATCHER_EXEC_FAILED;
+            }
+        }
+
+        rc = watcher_ctx_step(ctx, NULL, 0);
+        if (rc != WATCHER_SUCCESS) {
+            goto end;
+        }
+
+        for (i = 0; i < max_jobs; i++) {
+            job = &slots[i];
+            if (job->arena == NULL || job->running) {
+                continue;
+            }
+
+            watcher_job_cleanup(job);
+            watcher_accounting_write(job, stdout, job->result, job->status,
+                                     job->reaped);
+
+            if (job->result == WATCHER_SUCCESS) {
+                succeeded++;
+            } else if (job->result == WATCHER_TIMEOUT) {
+                timed_out++;
+            }
+
+            /* Keep the result in the queue for the exit code */
+            queue[queue_index[i]].result = job->result;
+            free(job->arena);
+            job->arena = NULL;
+            active--;
+
+            if (ncpus > 0) {
+                cpu_jobs[slot_cpu[i]]--;
+            }
+        }
+    }
+
+    watcher_timestamp(&end_ts);
+    printf("{\"summary\":true,\"jobs\":%zu,\"succeeded\":%zu,"
+           "\"timed_out\":%zu,\"failed\":%zu,\"wall_ms\":%lld}\n",
+           njobs, succeeded, timed_out, njobs - succeeded - timed_out,
+           watcher_timestamp_msecs(&end_ts) - watcher_timestamp_msecs(&start));
+    fflush(stdout);
+
+    rc = WATCHER_SUCCESS;
+    for (i = 0; i < njobs; i++) {
+        if (queue[i].result != WATCHER_SUCCESS) {
+            rc = queue[i].result;
+            break;
+        }
+    }
+
+end:
+    for (i = 0; slots != NULL && i < max_jobs; i++) {
+        /* The command and environment of a finished job are freed */
+        if (slots[i].arena != NULL) {
+            watcher_job_cleanup(&slots[i]);
+            free(slots[i].arena);
+        }
+    }
+    for (i = 0; i < njobs; i++) {
+        free(queue[i].arena);
+        free((char *)queue[i].log_file);
+    }
+    free(queue);
+    free(queue_index);
+    free(slots);
+    free(cpus);
+    free(cpu_jobs);
+    free(slot_cpu);
+
+    return rc;
+}
+
+/* Results a daemon client may leave unread before it is disconnected */
+#define WATCHER_CLIENT_OUT_MAX (16 * 1024 * 1024)
+
+/* A connection to the daemon */
+struct watcher_client_st {
+    int fd;
+    /* Received data not yet parsed into requests */
+    char *buf;
+    size_t len;
+    size_t size;
+    /* Results not yet sent, always whole lines */
+    char *out;
+    size_t out_len;
+    size_t out_size;
+    /* Number of jobs submitted and not yet reported */
+    size_t pending;
+    /* The client will not send more requests */
+    bool eof;
+    /* The connection failed or the client does not read its results, so it
+     * must be closed */
+    bool broken;
+};
+
+/**
+ * @brief Send the pending results of a daemon client, as far as possible
+ * without blocking.  The rest is sent once the socket is writable again.
+ */
+static void watcher_client_flush(struct watcher_client_st *client)
+{
+    size_t done = 0;
+    ssize_t sent;
+
+    while (done < client->out_len) {
+        sent = send(client->fd, client->out + done, client->out_len - done,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Could not send the results to client %d: "
+                        "%s\n", client->fd, strerror(errno));
+                client->broken = true;
+                client->out_len = 0;
+                return;
+            }
+            break;
+        }
+        done += sent;
+    }
+
+    memmove(client->out, client->out + done, client->out_len - done);
+    client->out_len -= done;
+}
+
+/**
+ * @brief Send a line to a daemon client.  What cannot be sent without
+ * blocking is kept for watcher_client_flush(), so a client which reads its
+ * results slowly cannot stall the daemon.  A client which leaves more than
+ * WATCHER_CLIENT_OUT_MAX bytes unread is disconnected instead.
+ */
+static void watcher_client_send(struct watcher_client_st *client,
+                                const char *line, size_t len)
+{
+    char *out;
+    size_t size;
+
+    if (client->broken) {
+        return;
+    }
+
+    if (client->out_size - client->out_len < len) {
+        size = 2 * client->out_size + len;
+        if (client->out_len + len > WATCHER_CLIENT_OUT_MAX) {
+            fprintf(stderr, "Client %d does not read its results\n",
+                    client->fd);
+            client->broken = true;
+            return;
+        }
+        out = realloc(client->out, size);
+        if (out == NULL) {
+            client->broken = true;
+            return;
+        }
+        client->out = out;
+        client->out_size = size;
+    }
+
+    memcpy(client->out + client->out_len, line, len);
+    client->out_len += len;
+    watcher_client_flush(client);
+}
+
+/**
+ * @brief Send a record for a request which could not be started.
+ */
+static void watcher_client_reject(struct watcher_client_st *client,
+                                  uint64_t id, int watcher_exit)
+{
+    char line[64];
+    int len;
+
+    len = snprintf(line, sizeof(line),
+                   "{\"id\":%" PRIu64 ",\"watcher_exit\":%d}\n",
+                   id, watcher_exit);
+    watcher_client_send(client, line, len);
+}
+
+/**
+ * @brief Start the job of the given request in the given job slot.
+ *
+ * @param[in] wctx      The watcher context
+ * @param[in] job       A free job slot, initialized with the settings of the
+ *                      daemon
+ * @param[in] client    The client which sent the request
+ * @param[in] req       The request header
+ * @param[in] payload   The arguments and environment of the request
+ *
+ * @returns WATCHER_SUCCESS if the slot was used, even if the process could
+ * not be executed; the reason the slot was not used otherwise; -1 if the
+ * request is malformed
+ */
+static int watcher_client_start(struct watcher_ctx *wctx,
+                                struct watcher_job *job,
+                                struct watcher_client_st *client,
+                                const struct watcher_request_st *req,
+                                char *payload)
+{
+    char **strings;
+    char *p = payload;
+    char *end = payload + req->size;
+    size_t nstrings = (size_t)req->argc + req->envc;
+    size_t i;
+    int rc;
+
+    /* Each string takes at least its terminating NUL, so a valid request
+     * never has more strings than bytes */
+    if (req->argc == 0 || nstrings > req->size || req->timeout < 0) {
+        return -1;
+    }
+
+    /* The pointers to the strings are needed only until they are copied
+     * into the arena of the job */
+    strings = calloc(nstrings + 1, sizeof(char *));
+    if (strings == NULL) {
+        return WATCHER_OOM;
+    }
+
+    for (i = 0; i < nstrings; i++) {
+        strings[i] = p;
+        p = memchr(p, '\0', end - p);
+        if (p == NULL) {
+            free(strings);
+            return -1;
+        }
+        p++;
+    }
+
+    rc = watcher_job_marshal(job, strings, req->argc, strings + req->argc,
+                             req->envc);
+    free(strings);
+    if (rc != 0) {
+        return rc;
+    }
+
+    job->id = req->id;
+    job->client_fd = client->fd;
+    if (req->timeout != 0) {
+        job->timeout = req->timeout;
+    }
+
+    rc = watcher_job_start(wctx, job);
+    if (rc != WATCHER_SUCCESS) {
+        /* The daemon keeps serving the other jobs */
+        watcher_job_cleanup(job);
+        job->running = false;
+        job->result = WATCHER_EXEC_FAILED;
+    }
+
+    client->pending++;
+    return WATCHER_SUCCESS;
+}
+
+/**
+ * @brief Send the record of a finished job to its client, if any, and free
+ * its slot.
+ */
+static void watcher_daemon_report(struct watcher_job *job,
+                                  struct watcher_client_st *client)
+{
+    char *record = NULL;
+    size_t len = 0;
+    FILE *file;
+
+    watcher_job_cleanup(job);
+
+    if (client != NULL) {
+        file = open_memstream(&record, &len);
+        if (file != NULL) {
+            watcher_accounting_write(job, file, job->result, job->status,
+                                     job->reaped);
+            fclose(file);
+            watcher_client_send(client, record, len);
+            free(record);
+        }
+        client->pending--;
+    }
+
+    free(job->arena);
+    job->arena = NULL;
+    job->argv = NULL;
+    job->env = NULL;
+}
+
+/**
+ * @brief Read the data available from a client and start the jobs of the
+ * complete requests, as long as there are free job slots.
+ *
+ * @returns 0 on success; -1 if the connection must be closed
+ */
+static int watcher_client_process(struct watcher_ctx *wctx,
+                                  struct watcher_client_st *client,
+                                  struct watcher_job *jobs,
+                                  size_t *free_slots, size_t *nfree,
+                                  const struct watcher_job *settings,
+                                  bool readable)
+{
+    struct watcher_request_st req;
+    struct watcher_job *job;
+    size_t offset = 0;
+    size_t need;
+    char *buf;
+    ssize_t n;
+    int rc;
+
+    while (readable && !client->eof) {
+        if (client->size - client->len < 4096) {
+            buf = realloc(client->buf, 2 * client->size + 4096);
+            if (buf == NULL) {
+                return -1;
+            }
+            client->buf = buf;
+            client->size = 2 * client->size + 4096;
+        }
+
+        n = recv(client->fd, client->buf + client->len,
+                 client->size - client->len, MSG_DONTWAIT);
+        if (n > 0) {
+            client->len += n;
+            continue;
+        } else if (n == 0) {
+            client->eof = true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        break;
+    }
+
+    while (*nfree > 0 && client->len - offset >= sizeof(req)) {
+        memcpy(&req, client->buf + offset, sizeof(req));
+        if (req.magic != WATCHER_REQUEST_MAGIC ||
+            req.size > (uint64_t)sysconf(_SC_ARG_MAX))
+        {
+            fprintf(stderr, "Invalid request from client %d\n", client->fd);
+            return -1;
+        }
+
+        need = sizeof(req) + req.size;
+        if (client->len - offset < need) {
+            break;
+        }
+
+        job = &jobs[free_slots[*nfree - 1]];
+        *job = *settings;
+        watcher_job_init(job);
+        rc = watcher_client_start(wctx, job, client, &req,
+                                  client->buf + offset + sizeof(req));
+        if (rc == WATCHER_SUCCESS && !job->running) {
+            /* The command could not be executed.  Report it now, the event
+             * loop may not wake up again before another request */
+            watcher_daemon_report(job, client);
+        } else if (rc == WATCHER_SUCCESS) {
+            (*nfree)--;
+        } else if (rc > 0) {
+            watcher_client_reject(client, req.id, rc);
+        } else {
+            fprintf(stderr, "Invalid request from client %d\n", client->fd);
+            return -1;
+        }
+        offset += need;
+    }
+
+    /* Keep the incomplete request, if any */
+    if (offset > 0) {
+        memmove(client->buf, client->buf + offset, client->len - offset);
+        client->len -= offset;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Run as a daemon, executing the jobs submitted on a unix socket.
+ *
+ * The daemon is started once, so the cost of starting the watcher is not paid
+ * for each job.  Jobs are started as soon as they are received, with at most
+ * max_jobs processes running at once.  Further requests are left in the
+ * socket until a job finishes.  The result of each job is streamed back to
+ * the client as its JSON accounting record, see struct watcher_request_st.
+ *
+ * @param[in] path      The path of the unix socket to listen on
+ * @param[in] max_jobs  The maximum number of processes running at once
+ * @param[in] settings  The settings for all the jobs.  The timeout is used
+ *                      for requests without a timeout.
+ *
+ * @returns The watcher exit code if the daemon cannot continue
+ */
+static int watch_daemon(const char *path, size_t max_jobs,
+                        const struct watcher_job *settings)
+{
+    struct sockaddr_un addr;
+    struct watcher_client_st *clients = NULL;
+    struct watcher_client_st *client;
+    struct watcher_client_st *grown;
+    struct watcher_job *jobs;
+    struct pollfd *pfds;
+    struct pollfd *grown_pfds;
+    struct stat st;
+    size_t *free_slots;
+    size_t nclients = 0;
+    size_t clients_size = 0;
+    size_t nfree;
+    size_t i, j;
+    int listen_fd;
+    int fd;
+    int rc;
+
+    if (path == NULL || max_jobs == 0 || settings == NULL ||
+        strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Replace the socket left by a previous daemon */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    rc = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc == 0) {
+        rc = listen(listen_fd, SOMAXCONN);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+    daemon_socket = path;
+
+    jobs = calloc(max_jobs, sizeof(struct watcher_job));
+    free_slots = calloc(max_jobs, sizeof(size_t));
+    pfds = calloc(1, sizeof(struct pollfd));
+    if (jobs == NULL || free_slots == NULL || pfds == NULL) {
+        rc = WATCHER_OOM;
+        goto end;
+    }
+
+    for (i = 0; i < max_jobs; i++) {
+        free_slots[i] = max_jobs - 1 - i;
+    }
+    nfree = max_jobs;
+
+    rc = watcher_ctx_setup(jobs, max_jobs);
+    if (rc != WATCHER_SUCCESS) {
+        goto end;
+    }
+
+    for (;;) {
+        /* The listening socket is followed by the clients.  Clients are only
+         * read when a job slot is free, and written while they have pending
+         * results */
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            pfds[i + 1].events = 0;
+            if (nfree > 0 && !clients[i].eof) {
+                pfds[i + 1].events |= POLLIN;
+            }
+            if (clients[i].out_len > 0) {
+                pfds[i + 1].events |= POLLOUT;
+            }
+            pfds[i + 1].fd = pfds[i + 1].events != 0 ? clients[i].fd : -1;
+        }
+
+        rc = watcher_ctx_step(ctx, pfds, nclients + 1);
+        if (rc != WATCHER_SUCCESS) {
+            goto end;
+        }
+
+        for (i = 0; i < max_jobs; i++) {
+            if (jobs[i].arena == NULL || jobs[i].running) {
+                continue;
+            }
+
+            client = NULL;
+            for (j = 0; jobs[i].client_fd >= 0 && j < nclients; j++) {
+                if (clients[j].fd == jobs[i].client_fd) {
+                    client = &clients[j];
+                    break;
+                }
+            }
+            watcher_daemon_report(&jobs[i], client);
+            free_slots[nfree++] = i;
+        }
+
+        for (i = 0; i < nclients; i++) {
+            if (pfds[i + 1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                watcher_client_flush(&clients[i]);
+            }
+            rc = watcher_client_process(ctx, &clients[i], jobs, free_slots,
+                                        &nfree, settings,
+                                        (pfds[i + 1].revents &
+                                         (POLLIN | POLLERR | POLLHUP)) != 0);
+            /* Once the client is done, close the connection after its last
+             * result is sent, dropping any incomplete request */
+            if (rc == 0 && !clients[i].broken &&
+                !(clients[i].eof && clients[i].pending == 0 &&
+                  clients[i].out_len == 0 &&
+                  (clients[i].len == 0 || nfree > 0)))
+            {
+                continue;
+            }
+
+            /* The results of the jobs still running are dropped */
+            for (j = 0; j < max_jobs; j++) {
+                if (jobs[j].arena != NULL &&
+                    jobs[j].client_fd == clients[i].fd)
+                {
+                    jobs[j].client_fd = -1;
+                }
+            }
+            close(clients[i].fd);
+            free(clients[i].buf);
+            free(clients[i].out);
+            clients[i] = clients[nclients - 1];
+            pfds[i + 1] = pfds[nclients];
+            nclients--;
+            i--;
+        }
+
+        if (!(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        for (;;) {
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (fd < 0) {
+                break;
+            }
+
+            if (nclients == clients_size) {
+                grown = realloc(clients, (2 * clients_size + 8) *
+                                sizeof(struct watcher_client_st));
+                if (grown == NULL) {
+                    close(fd);
+                    break;
+                }
+                clients = grown;
+
+                grown_pfds = realloc(pfds, (2 * clients_size + 9) *
+                                     sizeof(struct pollfd));
+                if (grown_pfds == NULL) {
+                    close(fd);
+                    break;
+                }
+                pfds = grown_pfds;
+                clients_size = 2 * clients_size + 8;
+            }
+
+            memset(&clients[nclients], 0, sizeof(struct watcher_client_st));
+            clients[nclients].fd = fd;
+            nclients++;
+        }
+    }
+
+end:
+    for (i = 0; jobs != NULL && i < max_jobs; i++) {
+        watcher_job_cleanup(&jobs[i]);
+        free(jobs[i].arena);
+    }
+    for (i = 0; i < nclients; i++) {
+        close(clients[i].fd);
+        free(clients[i].buf);
+        free(clients[i].out);
+    }
+    free(clients);
+    free(pfds);
+    free(free_slots);
+    free(jobs);
+    close(listen_fd);
+    unlink(path);
+    daemon_socket = NULL;
+
+    return rc;
+}
+
+/**
+ * @brief Submit a command to a watcher daemon and wait for its result.
+ *
+ * The JSON accounting record sent back by the daemon is written to stdout.
+ *
+ * @param[in] path      The path of the unix socket of the daemon
+ * @param[in] command   The command and its arguments
+ * @param[in] argc      The number of arguments
+ * @param[in] env       The environment variables to be used
+ * @param[in] envc      The number of environment variables
+ * @param[in] timeout   The timeout in ms; 0 to use the timeout of the daemon
+ *
+ * @returns The watcher exit code reported by the daemon; -1 if the command
+ * could not be submitted
+ */
+static int watch_submit(const char *path, char **command, int argc,
+                        char **env, int envc, long timeout)
+{
+    struct watcher_request_st req;
+    struct sockaddr_un addr;
+    struct iovec iov[2];
+    char line[4096];
+    char *exit_field;
+    char *payload = NULL;
+    size_t size = 0;
+    size_t off;
+    ssize_t n;
+    int fd = -1;
+    int i;
+    int rc = -1;
+
+    if (path == NULL || command == NULL || argc == 0 ||
+        strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < argc; i++) {
+        size += strlen(command[i]) + 1;
+    }
+    for (i = 0; i < envc; i++) {
+        size += strlen(env[i]) + 1;
+    }
+
+    payload = malloc(size);
+    if (payload == NULL) {
+        return WATCHER_OOM;
+    }
+
+    off = 0;
+    for (i = 0; i < argc; i++) {
+        off = stpcpy(payload + off, command[i]) - payload + 1;
+    }
+    for (i = 0; i < envc; i++) {
+        off = stpcpy(payload + off, env[i]) - payload + 1;
+    }
+
+    req.magic = WATCHER_REQUEST_MAGIC;
+    req.argc = argc;
+    req.envc = envc;
+    req.size = size;
+    req.id = getpid();
+    req.timeout = timeout;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Could not connect to %s: %s\n", path,
+                strerror(errno));
+        goto end;
+    }
+
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = size;
+    while (iov[1].iov_len > 0) {
+        n = writev(fd, iov, 2);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Could not submit the command: %s\n",
+                    strerror(errno));
+            goto end;
+        }
+        for (i = 0; i < 2; i++) {
+            off = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + off;
+            iov[i].iov_len -= off;
+            n -= off;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+
+    /* The record is a single line */
+    off = 0;
+    while (off < sizeof(line) - 1) {
+        n = read(fd, line + off, sizeof(line) - 1 - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        off += n;
+        if (line[off - 1] == '\n') {
+            break;
+        }
+    }
+    line[off] = '\0';
+
+    exit_field = strstr(line, "\"watcher_exit\":");
+    if (exit_field == NULL) {
+        fprintf(stderr, "No result received from the daemon\n");
+        goto end;
+    }
+
+    fputs(line, stdout);
+    rc = strtol(exit_field + strlen("\"watcher_exit\":"), NULL, 10);
+
+end:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(payload);
+    return rc;
+}
+
+#ifdef HAVE_ARGP_H
+const char *argp_program_version = "watcher-0.0.1";
+const char *argp_program_bug_address = "<libssh@libssh.org>";
+
+/* Program documentation. */
+static char doc[] = "A simple watcher to kill a process after a timeout";
+
+/* A description of the arguments we accept. */
+static char args_doc[] = "COMMAND [\\; COMMAND...]";
+
+/* Keys of the options without a short form */
+enum watcher_option_e {
+    WATCHER_OPTION_CPUS = 0x100,
+    WATCHER_OPTION_NUMA,
+    WATCHER_OPTION_WATCHER_CPUS,
+    WATCHER_OPTION_WATCHER_NUMA,
+    WATCHER_OPTION_SCHED,
+    WATCHER_OPTION_NICE,
+    WATCHER_OPTION_IOPRIO,
+    WATCHER_OPTION_SPREAD,
+    WATCHER_OPTION_BACKEND,
+    WATCHER_OPTION_SAMPLE,
+    WATCHER_OPTION_SAMPLE_WINDOW,
+    WATCHER_OPTION_PRESSURE,
+    WATCHER_OPTION_PRESSURE_ACTION,
+    WATCHER_OPTION_INACTIVITY,
+    WATCHER_OPTION_TIMELINE,
+    WATCHER_OPTION_TIMELINE_INTERVAL,
+};
+
+/* The options we understand. */
 static struct argp_option options[] = {
     {
         .name  = "env",
@@ -481,22 +4637,339 @@ static struct argp_option options[] = {
         .group = 0
     },
     {
-        .name  = "fork",
-        .key   = 'f',
-        .arg   = NULL,
+        .name  = "fork",
+        .key   = 'f',
+        .arg   = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Do not block, run the watcher in a child process and return "
+                 "immediately",
+        .group = 0
+    },
+    {
+        .name  = "timeout",
+        .key   = 't',
+        .arg   = "TIMEOUT",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "The timeout in ms to wait before killing the process. "
+                 "If < 0, it means infinite timeout (will block until "
+                 "killed). [default = 300000ms]",
+        .group = 0
+    },
+    {
+        .name  = "multi",
+        .key   = 'm',
+        .arg   = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run multiple commands concurrently, separated by a ';' "
+                 "argument.  Each process has its own timeout.",
+        .group = 0
+    },
+    {
+        .name  = "heartbeat",
+        .key   = 'H',
+        .arg   = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Pass a shared memory heartbeat channel to the process in "
+                 "the " WATCHER_HEARTBEAT_ENV " environment variable.  See "
+                 "heartbeat.h.",
+        .group = 0
+    },
+    {
+        .name  = "accounting",
+        .key   = 'a',
+        .arg   = "FILE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Write the resource usage of each watched process as a JSON "
+                 "record per line to FILE.  If FILE is not given, the records "
+                 "are written next to the pid file, with the \".json\" "
+                 "suffix.",
+        .group = 0
+    },
+    {
+        .name  = "grace",
+        .key   = 'g',
+        .arg   = "GRACE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "When a process times out, send SIGTERM and wait GRACE ms "
+                 "before sending SIGKILL. [default = 0ms]",
+        .group = 0
+    },
+    {
+        .name  = "cgroup",
+        .key   = 'c',
+        .arg   = "PARENT",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run each watched process in its own cgroup v2, created under "
+                 "PARENT (default: the cgroup of the watcher).  The whole "
+                 "process tree is killed on timeout or when the process "
+                 "exits.",
+        .group = 0
+    },
+    {
+        .name  = "memory-max",
+        .key   = 'M',
+        .arg   = "BYTES",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Set memory.max of the cgroup of each process.  Implies "
+                 "--cgroup.",
+        .group = 0
+    },
+    {
+        .name  = "cpu-max",
+        .key   = 'C',
+        .arg   = "\"QUOTA PERIOD\"",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Set cpu.max of the cgroup of each process, e.g. "
+                 "\"50000 100000\" for half a CPU.  Implies --cgroup.",
+        .group = 0
+    },
+    {
+        .name  = "spawn",
+        .key   = 'S',
+        .arg   = "METHOD",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "How to start the processes: \"posix_spawn\", \"clone3\" or "
+                 "\"fork\".  By default, posix_spawn is used, or clone3 when "
+                 "running in a cgroup.",
+        .group = 0
+    },
+    {
+        .name  = "capture",
+        .key   = 'o',
+        .arg   = "KIB",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Capture stdout and stderr of the processes in memory and "
+                 "dump the last KIB KiB to stderr if a process times out or is "
+                 "killed by a signal. [default = 64KiB]",
+        .group = 0
+    },
+    {
+        .name  = "log",
+        .key   = 'l',
+        .arg   = "FILE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Capture stdout and stderr of the process to FILE instead of "
+                 "memory.  With --multi, the output of the Nth command goes "
+                 "to FILE.N.  Implies --capture.",
+        .group = 0
+    },
+    {
+        .name  = "daemon",
+        .key   = 'd',
+        .arg   = "SOCKET",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run as a daemon executing the commands submitted on the unix "
+                 "socket SOCKET, instead of running COMMAND.  The other "
+                 "options apply to all the submitted commands.",
+        .group = 0
+    },
+    {
+        .name  = "batch",
+        .key   = 'b',
+        .arg   = "FILE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run the jobs listed in FILE (\"-\" for stdin) instead of "
+                 "COMMAND, one per line: \"TIMEOUT [VAR=VALUE...] COMMAND "
+                 "[ARGS...]\", with TIMEOUT in ms or \"-\" for the default.  "
+                 "The accounting record of each job and a summary are written "
+                 "to stdout; use --capture or --log to keep the output of the "
+                 "jobs apart.",
+        .group = 0
+    },
+    {
+        .name  = "jobs",
+        .key   = 'j',
+        .arg   = "N",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run at most N processes at once in daemon or batch mode. "
+                 "[default = 256 for the daemon, the number of CPUs for a "
+                 "batch]",
+        .group = 0
+    },
+    {
+        .name  = "submit",
+        .key   = 's',
+        .arg   = "SOCKET",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Submit COMMAND to the daemon listening on SOCKET, wait for "
+                 "it to finish and print its JSON accounting record.  Only "
+                 "--env and --timeout apply.",
+        .group = 0
+    },
+    {
+        .name  = "stats",
+        .key   = 'T',
+        .arg   = "FILE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Write latency histograms of the watcher to FILE in the "
+                 "Prometheus text format, every second and on exit.  To "
+                 "measure the SIGUSR1 delay, send SIGUSR1 with sigqueue() "
+                 "and the CLOCK_MONOTONIC time in microseconds as value.",
+        .group = 0
+    },
+    {
+        .name  = "sample",
+        .key   = WATCHER_OPTION_SAMPLE,
+        .arg   = "FILE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Before killing a process which timed out, sample where its "
+                 "threads run or block and append the stacks to FILE in the "
+                 "folded format of flame graph tools, counted in ms.  Running "
+                 "threads are sampled with perf events, or with ptrace if perf "
+                 "events are not available; ptrace needs "
+                 "kernel.yama.ptrace_scope=0 or CAP_SYS_PTRACE, otherwise only "
+                 "the blocked threads are sampled.",
+        .group = 0
+    },
+    {
+        .name  = "sample-window",
+        .key   = WATCHER_OPTION_SAMPLE_WINDOW,
+        .arg   = "MS",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Sample the process for MS ms with --sample. "
+                 "[default = 500ms]",
+        .group = 0
+    },
+    {
+        .name  = "timeline",
+        .key   = WATCHER_OPTION_TIMELINE,
+        .arg   = "FILE",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Sample the RSS, CPU time, threads and I/O counters of each "
+                 "process every --timeline-interval and append them to FILE "
+                 "in a compact binary format.  Convert it to CSV or JSON with "
+                 "watcher-timeline.",
+        .group = 0
+    },
+    {
+        .name  = "timeline-interval",
+        .key   = WATCHER_OPTION_TIMELINE_INTERVAL,
+        .arg   = "MS",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Sample the processes every MS ms with --timeline. "
+                 "[default = 1000ms]",
+        .group = 0
+    },
+    {
+        .name  = "inactivity",
+        .key   = WATCHER_OPTION_INACTIVITY,
+        .arg   = "INTERVAL",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Apply the timeout to inactivity only: every INTERVAL ms, "
+                 "sample the CPU time, context switches and I/O counters of "
+                 "each process (the CPU time of its cgroup with --cgroup) and "
+                 "count any change as a heartbeat. [default = 1000ms]",
+        .group = 0
+    },
+    {
+        .name  = "pressure",
+        .key   = WATCHER_OPTION_PRESSURE,
+        .arg   = "RESOURCE:STALL/WINDOW",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Apply --pressure-action to a process whose tasks stall on "
+                 "RESOURCE (\"memory\", \"io\" or \"cpu\") for STALL ms "
+                 "within WINDOW ms (500 to 10000), e.g. \"memory:150/1000\".  "
+                 "With a \"-full\" suffix, e.g. \"memory-full\", only the "
+                 "time all the tasks stall counts.  The pressure of the cgroup "
+                 "of each process is used with --cgroup, the system-wide "
+                 "pressure otherwise, which applies to all the processes and "
+                 "can only throttle them.  "
+                 "Without CAP_SYS_RESOURCE, WINDOW must be a multiple of "
+                 "2000.  Can be used multiple times.",
+        .group = 0
+    },
+    {
+        .name  = "pressure-action",
+        .key   = WATCHER_OPTION_PRESSURE_ACTION,
+        .arg   = "ACTION",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "What to do when a process stalls: \"kill\" it as if it "
+                 "timed out (requires --cgroup), or \"throttle\" it by "
+                 "freezing it for a window. [default = kill]",
+        .group = 0
+    },
+    {
+        .name  = "backend",
+        .key   = WATCHER_OPTION_BACKEND,
+        .arg   = "BACKEND",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Wait for the processes with \"poll\" or \"io_uring\", "
+                 "which costs less with many processes and falls back to poll "
+                 "if not available. [default = poll]",
+        .group = 0
+    },
+    {
+        .name  = "cpus",
+        .key   = WATCHER_OPTION_CPUS,
+        .arg   = "LIST",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run the processes on the CPUs in LIST, e.g. \"0-3,8\".",
+        .group = 0
+    },
+    {
+        .name  = "numa",
+        .key   = WATCHER_OPTION_NUMA,
+        .arg   = "NODES",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Bind the memory of the processes to the NUMA nodes in "
+                 "NODES and run them on the CPUs of these nodes.",
+        .group = 0
+    },
+    {
+        .name  = "spread",
+        .key   = WATCHER_OPTION_SPREAD,
+        .arg   = NULL,
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "With --multi or --batch, pin each process to a single CPU "
+                 "out of --cpus (default: the CPUs of the watcher), spreading "
+                 "the processes across the CPUs.",
+        .group = 0
+    },
+    {
+        .name  = "sched",
+        .key   = WATCHER_OPTION_SCHED,
+        .arg   = "POLICY[:PRIO]",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run the processes with the scheduling policy \"other\", "
+                 "\"batch\", \"idle\", \"fifo\" or \"rr\", with the static "
+                 "priority PRIO for the real-time policies [default = 1].",
+        .group = 0
+    },
+    {
+        .name  = "nice",
+        .key   = WATCHER_OPTION_NICE,
+        .arg   = "N",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run the processes with the nice value N.",
+        .group = 0
+    },
+    {
+        .name  = "ioprio",
+        .key   = WATCHER_OPTION_IOPRIO,
+        .arg   = "CLASS[:LEVEL]",
+        .flags = OPTION_ARG_OPTIONAL,
+        .doc   = "Run the processes with the I/O scheduling class \"rt\", "
+                 "\"be\" or \"idle\" and the level 0 (highest) to 7 "
+                 "[default = 4].",
+        .group = 0
+    },
+    {
+        .name  = "watcher-cpus",
+        .key   = WATCHER_OPTION_WATCHER_CPUS,
+        .arg   = "LIST",
         .flags = OPTION_ARG_OPTIONAL,
-        .doc   = "Do not block, run the watcher in a child process and return "
-                 "immediately",
+        .doc   = "Run the watcher itself on the CPUs in LIST.  The processes "
+                 "keep the CPUs the watcher was started with, unless --cpus "
+                 "is given.",
         .group = 0
     },
     {
-        .name  = "timeout",
-        .key   = 't',
-        .arg   = "TIMEOUT",
+        .name  = "watcher-numa",
+        .key   = WATCHER_OPTION_WATCHER_NUMA,
+        .arg   = "NODES",
         .flags = OPTION_ARG_OPTIONAL,
-        .doc   = "The timeout in ms to wait before killing the process. "
-                 "If < 0, it means infinite timeout (will block until "
-                 "killed). [default = 300000ms]",
+        .doc   = "Bind the memory of the watcher itself to the NUMA nodes in "
+                 "NODES and run it on the CPUs of these nodes.",
         .group = 0
     },
     {
@@ -518,6 +4991,13 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
      * know is a pointer to our arguments structure.
      */
     struct arguments_st *arguments = state->input;
+    struct watcher_placement_st *placement;
+    struct watcher_pressure_st *pressure;
+    const char *name;
+    char **env;
+    char *end = NULL;
+    long length;
+    long value;
     error_t rc = 0;
 
     if (arguments == NULL) {
@@ -528,65 +5008,455 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
 
     switch (key) {
     case 'e':
-        if (arguments->envc >= MAX_ENV_VARS) {
-            fprintf(stderr, "Too many environment variables\n");
+        if (arg == NULL) {
+            fprintf(stderr, "No environment variable provided\n");
             argp_usage(state);
             rc = EINVAL;
             goto end;
         }
 
-        /* Duplicate the current argument */
-        arguments->env[arguments->envc] = strdup(arg);
-        if (arguments->env[arguments->envc] == NULL) {
-            rc = ENOMEM;
-            goto end;
+        if ((arguments->envc & (arguments->envc + 1)) == 0) {
+            /* Grow to the next power of two, keeping a NULL terminator */
+            env = realloc(arguments->env,
+                          2 * (arguments->envc + 1) * sizeof(char *));
+            if (env == NULL) {
+                rc = ENOMEM;
+                goto end;
+            }
+            arguments->env = env;
         }
+
+        /* The argument points into the argv of the watcher, which outlives
+         * the parsing, so there is no need to copy it */
+        arguments->env[arguments->envc] = arg;
         arguments->envc++;
+        arguments->env[arguments->envc] = NULL;
         break;
     case 'f':
         arguments->fork = true;
         break;
-    case 't':
-        arguments->timeout = strtol(arg, NULL, 10);
+    case 'm':
+        arguments->multi = true;
         break;
-    case 'p':
-        arguments->pid_file = strdup(arg);
-        if (arguments->pid_file == NULL) {
+    case 'H':
+        arguments->heartbeat = true;
+        break;
+    case 'g':
+        if (arg == NULL) {
+            fprintf(stderr, "No grace period provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->grace = strtol(arg, &end, 10);
+        if (*end != '\0' || arguments->grace < 0) {
+            fprintf(stderr, "Invalid grace period %s\n", arg);
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case 'c':
+        arguments->cgroup = true;
+        if (arg != NULL) {
+            arguments->cgroup_parent = strdup(arg);
+            if (arguments->cgroup_parent == NULL) {
+                rc = ENOMEM;
+                goto end;
+            }
+        }
+        break;
+    case 'M':
+        if (arg == NULL) {
+            fprintf(stderr, "No memory limit provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->cgroup = true;
+        arguments->memory_max = strdup(arg);
+        if (arguments->memory_max == NULL) {
             rc = ENOMEM;
             goto end;
         }
         break;
-    case ARGP_KEY_ARG:
-        if (arguments->argc >= MAX_ARGS) {
-            fprintf(stderr, "Too many arguments\n");
+    case 'C':
+        if (arg == NULL) {
+            fprintf(stderr, "No CPU limit provided\n");
             argp_usage(state);
             rc = EINVAL;
             goto end;
         }
-
-        /* Duplicate the current argument */
-        arguments->argv[arguments->argc] = strdup(arg);
-        if (arguments->argv[arguments->argc] == NULL) {
+        arguments->cgroup = true;
+        arguments->cpu_max = strdup(arg);
+        if (arguments->cpu_max == NULL) {
+            rc = ENOMEM;
+            goto end;
+        }
+        break;
+    case 'S':
+        if (arg == NULL) {
+            arguments->spawn = WATCHER_SPAWN_AUTO;
+        } else if (strcmp(arg, "posix_spawn") == 0) {
+            arguments->spawn = WATCHER_SPAWN_POSIX;
+        } else if (strcmp(arg, "clone3") == 0) {
+            arguments->spawn = WATCHER_SPAWN_CLONE3;
+        } else if (strcmp(arg, "fork") == 0) {
+            arguments->spawn = WATCHER_SPAWN_FORK;
+        } else {
+            fprintf(stderr, "Unknown spawn method %s\n", arg);
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case 'o':
+        arguments->capture_kib = 64;
+        if (arg != NULL) {
+            arguments->capture_kib = strtol(arg, &end, 10);
+            if (*end != '\0' || arguments->capture_kib <= 0) {
+                fprintf(stderr, "Invalid capture size %s\n", arg);
+                argp_usage(state);
+                rc = EINVAL;
+                goto end;
+            }
+        }
+        break;
+    case 'l':
+        if (arg == NULL) {
+            fprintf(stderr, "No log file provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        if (arguments->capture_kib == 0) {
+            arguments->capture_kib = 64;
+        }
+        arguments->log_file = strdup(arg);
+        if (arguments->log_file == NULL) {
             rc = ENOMEM;
             goto end;
         }
-        arguments->argc++;
+        break;
+    case 'a':
+        arguments->accounting = true;
+        if (arg != NULL) {
+            arguments->accounting_file = strdup(arg);
+            if (arguments->accounting_file == NULL) {
+                rc = ENOMEM;
+                goto end;
+            }
+        }
+        break;
+    case 'd':
+    case 's':
+        if (arg == NULL) {
+            fprintf(stderr, "No socket provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        if (key == 'd') {
+            arguments->daemon = arg;
+        } else {
+            arguments->submit = arg;
+        }
+        break;
+    case 'b':
+        if (arg == NULL) {
+            fprintf(stderr, "No job file provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->batch = arg;
+        break;
+    case 'T':
+        if (arg == NULL) {
+            fprintf(stderr, "No statistics file provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->stats_file = arg;
+        break;
+    case 'j':
+        if (arg == NULL) {
+            fprintf(stderr, "No number of jobs provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->max_jobs = strtol(arg, &end, 10);
+        if (*end != '\0' || arguments->max_jobs <= 0) {
+            fprintf(stderr, "Invalid number of jobs %s\n", arg);
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case WATCHER_OPTION_CPUS:
+    case WATCHER_OPTION_WATCHER_CPUS:
+        placement = (key == WATCHER_OPTION_CPUS) ?
+                    &arguments->placement : &arguments->watcher_placement;
+        if (watcher_parse_cpus(arg, &placement->cpus) != 0) {
+            fprintf(stderr, "Invalid CPU list %s\n", arg ? arg : "");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        placement->set_cpus = true;
+        break;
+    case WATCHER_OPTION_NUMA:
+    case WATCHER_OPTION_WATCHER_NUMA:
+        placement = (key == WATCHER_OPTION_NUMA) ?
+                    &arguments->placement : &arguments->watcher_placement;
+        if (arg == NULL ||
+            watcher_parse_list(arg, placement->nodes, WATCHER_MAX_NODES) != 0)
+        {
+            fprintf(stderr, "Invalid NUMA node list %s\n", arg ? arg : "");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        placement->mempolicy = MPOL_BIND;
+        placement->set_mempolicy = true;
+        break;
+    case WATCHER_OPTION_SAMPLE:
+        if (arg == NULL) {
+            fprintf(stderr, "No sample file provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->sample_file = arg;
+        break;
+    case WATCHER_OPTION_SAMPLE_WINDOW:
+        arguments->sample_window = (arg != NULL) ? strtol(arg, NULL, 10) : 0;
+        if (arguments->sample_window <= 0) {
+            fprintf(stderr, "Invalid sample window\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case WATCHER_OPTION_TIMELINE:
+        if (arg == NULL) {
+            fprintf(stderr, "No timeline file provided\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->timeline_file = arg;
+        break;
+    case WATCHER_OPTION_TIMELINE_INTERVAL:
+        arguments->timeline_interval = (arg != NULL) ? strtol(arg, NULL, 10)
+                                                     : 0;
+        if (arguments->timeline_interval <= 0) {
+            fprintf(stderr, "Invalid timeline interval\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case WATCHER_OPTION_INACTIVITY:
+        arguments->inactivity = 1000;
+        if (arg != NULL) {
+            arguments->inactivity = strtol(arg, &end, 10);
+            if (*end != '\0' || arguments->inactivity <= 0) {
+                fprintf(stderr, "Invalid inactivity interval %s\n", arg);
+                argp_usage(state);
+                rc = EINVAL;
+                goto end;
+            }
+        }
+        break;
+    case WATCHER_OPTION_PRESSURE:
+        if (arguments->npressure == WATCHER_PRESSURE_MAX) {
+            fprintf(stderr, "Too many pressure triggers\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        pressure = &arguments->pressure[arguments->npressure];
+        name = (arg != NULL) ? arg : "";
+        value = strcspn(name, ":");
+        pressure->full = (value > 5 &&
+                          strncmp(&name[value - 5], "-full", 5) == 0);
+        length = value - (pressure->full ? 5 : 0);
+        if (length == 6 && strncmp(name, "memory", 6) == 0) {
+            pressure->resource = "memory";
+        } else if (length == 2 && strncmp(name, "io", 2) == 0) {
+            pressure->resource = "io";
+        } else if (length == 3 && strncmp(name, "cpu", 3) == 0) {
+            pressure->resource = "cpu";
+        } else {
+            pressure->resource = NULL;
+        }
+        if (pressure->resource != NULL && name[value] == ':') {
+            pressure->stall = strtol(&name[value + 1], &end, 10);
+            pressure->window = (*end == '/') ? strtol(end + 1, &end, 10) : 0;
+        }
+        if (pressure->resource == NULL || name[value] != ':' ||
+            *end != '\0' || pressure->stall <= 0 ||
+            pressure->stall > pressure->window || pressure->window < 500 ||
+            pressure->window > 10000)
+        {
+            fprintf(stderr, "Invalid pressure trigger %s\n", name);
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->npressure++;
+        break;
+    case WATCHER_OPTION_PRESSURE_ACTION:
+        if (arg != NULL && strcmp(arg, "kill") == 0) {
+            arguments->pressure_action = WATCHER_PRESSURE_KILL;
+        } else if (arg != NULL && strcmp(arg, "throttle") == 0) {
+            arguments->pressure_action = WATCHER_PRESSURE_THROTTLE;
+        } else {
+            fprintf(stderr, "Unknown pressure action %s\n", arg ? arg : "");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case WATCHER_OPTION_BACKEND:
+        if (arg != NULL && strcmp(arg, "poll") == 0) {
+            arguments->backend = WATCHER_BACKEND_POLL;
+        } else if (arg != NULL && strcmp(arg, "io_uring") == 0) {
+            arguments->backend = WATCHER_BACKEND_IO_URING;
+        } else {
+            fprintf(stderr, "Unknown backend %s\n", arg ? arg : "");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        break;
+    case WATCHER_OPTION_SPREAD:
+        arguments->placement.spread = true;
+        break;
+    case WATCHER_OPTION_SCHED:
+        placement = &arguments->placement;
+        name = (arg != NULL) ? arg : "";
+        value = strcspn(name, ":");
+        if (value == 5 && strncmp(name, "other", 5) == 0) {
+            placement->policy = SCHED_OTHER;
+        } else if (value == 5 && strncmp(name, "batch", 5) == 0) {
+            placement->policy = SCHED_BATCH;
+        } else if (value == 4 && strncmp(name, "idle", 4) == 0) {
+            placement->policy = SCHED_IDLE;
+        } else if (value == 4 && strncmp(name, "fifo", 4) == 0) {
+            placement->policy = SCHED_FIFO;
+        } else if (value == 2 && strncmp(name, "rr", 2) == 0) {
+            placement->policy = SCHED_RR;
+        } else {
+            fprintf(stderr, "Unknown scheduling policy %s\n", name);
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+
+        placement->priority = sched_get_priority_min(placement->policy);
+        if (name[value] == ':') {
+            placement->priority = strtol(&name[value + 1], &end, 10);
+            if (*end != '\0' || end == &name[value + 1] ||
+                placement->priority <
+                    sched_get_priority_min(placement->policy) ||
+                placement->priority >
+                    sched_get_priority_max(placement->policy))
+            {
+                fprintf(stderr, "Invalid priority for %s\n", name);
+                argp_usage(state);
+                rc = EINVAL;
+                goto end;
+            }
+        }
+        placement->set_policy = true;
+        break;
+    case WATCHER_OPTION_NICE:
+        value = (arg != NULL) ? strtol(arg, &end, 10) : 0;
+        if (arg == NULL || *end != '\0' || end == arg ||
+            value < -20 || value > 19)
+        {
+            fprintf(stderr, "Invalid nice value %s\n", arg ? arg : "");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
+        arguments->placement.nice = value;
+        arguments->placement.set_nice = true;
+        break;
+    case WATCHER_OPTION_IOPRIO:
+        placement = &arguments->placement;
+        name = (arg != NULL) ? arg : "";
+        value = strcspn(name, ":");
+        if (value == 2 && strncmp(name, "rt", 2) == 0) {
+            placement->ioprio = 1;
+        } else if (value == 2 && strncmp(name, "be", 2) == 0) {
+            placement->ioprio = 2;
+        } else if (value == 4 && strncmp(name, "idle", 4) == 0) {
+            placement->ioprio = 3;
+        } else {
+            fprintf(stderr, "Unknown I/O scheduling class %s\n", name);
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
 
-        /* Steal the rest of arguments to be passed to command instead of being
-         * parsed*/
-        while (state->next != state->argc) {
-            arguments->argv[arguments->argc] = strdup(state->argv[state->next]);
-            arguments->argc++;
-            state->next++;
+        /* The idle class has no levels */
+        value = (placement->ioprio == 3) ? 0 : 4;
+        if (name[strcspn(name, ":")] == ':') {
+            value = strtol(strchr(name, ':') + 1, &end, 10);
+            if (*end != '\0' || value < 0 || value > 7) {
+                fprintf(stderr, "Invalid I/O priority level for %s\n", name);
+                argp_usage(state);
+                rc = EINVAL;
+                goto end;
+            }
+        }
+        placement->ioprio = WATCHER_IOPRIO_VALUE(placement->ioprio, value);
+        placement->set_ioprio = true;
+        break;
+    case 't':
+        arguments->timeout = strtol(arg, NULL, 10);
+        arguments->timeout_set = true;
+        break;
+    case 'p':
+        arguments->pid_file = strdup(arg);
+        if (arguments->pid_file == NULL) {
+            rc = ENOMEM;
+            goto end;
         }
         break;
+    case ARGP_KEY_ARG:
+        /* Take the rest of arguments to be passed to command instead of
+         * being parsed.  They point into the argv of the watcher, so there is
+         * no need to copy them */
+        arguments->argv = &state->argv[state->next - 1];
+        arguments->argc = state->argc - state->next + 1;
+        state->next = state->argc;
+        break;
     case ARGP_KEY_END:
-        if (state->arg_num < 1) {
+        if (state->arg_num < 1 && arguments->daemon == NULL &&
+            arguments->batch == NULL)
+        {
             fprintf(stderr, "No command provided\n");
             argp_usage(state);
             rc = EINVAL;
             goto end;
         }
+        if (arguments->npressure > 0 && !arguments->cgroup &&
+            arguments->pressure_action == WATCHER_PRESSURE_KILL)
+        {
+            /* The system-wide pressure does not tell which process stalled,
+             * so killing on it would kill all of them */
+            fprintf(stderr, "--pressure-action=kill requires --cgroup, use "
+                    "--pressure-action=throttle without it\n");
+            argp_usage(state);
+            rc = EINVAL;
+            goto end;
+        }
         break;
     default:
         return ARGP_ERR_UNKNOWN;
@@ -605,16 +5475,44 @@ int main(int argc, char *argv[])
     int rc;
     FILE *file;
     pid_t watcher_pid;
-    int i;
 
     struct arguments_st arguments = {
-        .argv = {0},
+        .argv = NULL,
         .argc = 0,
-        .env = {0},
+        .env = NULL,
         .envc = 0,
         .timeout = 300000,
+        .timeout_set = false,
         .pid_file = NULL,
         .fork = false,
+        .multi = false,
+        .heartbeat = false,
+        .accounting = false,
+        .accounting_file = NULL,
+        .grace = 0,
+        .cgroup = false,
+        .cgroup_parent = NULL,
+        .memory_max = NULL,
+        .cpu_max = NULL,
+        .spawn = WATCHER_SPAWN_AUTO,
+        .capture_kib = 0,
+        .log_file = NULL,
+        .daemon = NULL,
+        .submit = NULL,
+        .batch = NULL,
+        .max_jobs = 0,
+        .stats_file = NULL,
+        .backend = WATCHER_BACKEND_POLL,
+        .sample_file = NULL,
+        .sample_window = 500,
+        .inactivity = 0,
+        .timeline_file = NULL,
+        .timeline_interval = 1000,
+        .npressure = 0,
+        .pressure_action = WATCHER_PRESSURE_KILL,
+    };
+    struct watcher_job settings = {
+        .timeout = 300000,
     };
 
 #ifdef HAVE_ARGP_H
@@ -623,11 +5521,48 @@ int main(int argc, char *argv[])
         goto end;
     }
 
-    if (arguments.argc == 0) {
+    if (arguments.daemon != NULL) {
+        if (arguments.argc > 0 || arguments.submit != NULL ||
+            arguments.batch != NULL)
+        {
+            fprintf(stderr, "No command can be given in daemon mode\n");
+            return EINVAL;
+        }
+        if (arguments.log_file != NULL || arguments.multi) {
+            fprintf(stderr, "--log and --multi cannot be used in daemon "
+                    "mode\n");
+            return EINVAL;
+        }
+        if (arguments.max_jobs == 0) {
+            arguments.max_jobs = 256;
+        }
+    } else if (arguments.batch != NULL) {
+        if (arguments.argc > 0 || arguments.submit != NULL ||
+            arguments.multi)
+        {
+            fprintf(stderr, "No command can be given in batch mode\n");
+            return EINVAL;
+        }
+        if (arguments.max_jobs == 0) {
+            arguments.max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+            if (arguments.max_jobs <= 0) {
+                arguments.max_jobs = 1;
+            }
+        }
+    } else if (arguments.argc == 0) {
         fprintf(stderr, "No command provided\n");
         return EINVAL;
     }
 
+    if (arguments.submit != NULL) {
+        /* The timeout of the daemon is used unless one is given */
+        rc = watch_submit(arguments.submit, arguments.argv, arguments.argc,
+                          arguments.env, arguments.envc,
+                          arguments.timeout_set ? arguments.timeout : 0);
+        free(arguments.env);
+        goto end;
+    }
+
     if (arguments.fork) {
         watcher_pid = fork();
         if (watcher_pid != 0) {
@@ -635,18 +5570,7 @@ int main(int argc, char *argv[])
                 rc = -1;
             }
 
-            if (arguments.argv != NULL) {
-                for (i = 0; i < arguments.argc; i++) {
-                    free(arguments.argv[i]);
-                }
-            }
-
-            if (arguments.env != NULL) {
-                for (i = 0; i < arguments.envc; i++) {
-                    free(arguments.env[i]);
-                }
-            }
-
+            free(arguments.env);
             goto end;
         }
     }
@@ -664,16 +5588,159 @@ int main(int argc, char *argv[])
         fclose(file);
     }
 
-    rc = watch_process(arguments.argv, arguments.env, arguments.timeout);
+    if (arguments.accounting) {
+        if (arguments.accounting_file == NULL) {
+            if (arguments.pid_file == NULL) {
+                fprintf(stderr, "No accounting file or pid file provided\n");
+                return EINVAL;
+            }
+            rc = asprintf(&arguments.accounting_file, "%s.json",
+                          arguments.pid_file);
+            if (rc < 0) {
+                return WATCHER_OOM;
+            }
+        }
+
+        errno = 0;
+        settings.accounting = fopen(arguments.accounting_file, "we");
+        if (settings.accounting == NULL) {
+            fprintf(stderr, "Could not open file %s: %s\n",
+                    arguments.accounting_file, strerror(errno));
+            return EINVAL;
+        }
+    }
+
+    if (arguments.cgroup) {
+        if (arguments.cgroup_parent == NULL) {
+            arguments.cgroup_parent = watcher_cgroup_self();
+            if (arguments.cgroup_parent == NULL) {
+                fprintf(stderr, "Could not find the cgroup v2 of the "
+                        "watcher: %s\n", strerror(errno));
+                return WATCHER_CGROUP_SETUP_FAILED;
+            }
+        }
+
+        rc = watcher_cgroup_prepare(arguments.cgroup_parent,
+                                    arguments.memory_max != NULL,
+                                    arguments.cpu_max != NULL);
+        if (rc != 0) {
+            fprintf(stderr, "Could not enable the controllers in cgroup %s: "
+                    "%s\n", arguments.cgroup_parent, strerror(errno));
+            return WATCHER_CGROUP_SETUP_FAILED;
+        }
+    }
+
+    /* The NUMA nodes restrict the CPUs */
+    if ((arguments.placement.set_mempolicy &&
+         watcher_placement_nodes(&arguments.placement) != 0) ||
+        (arguments.watcher_placement.set_mempolicy &&
+         watcher_placement_nodes(&arguments.watcher_placement) != 0))
+    {
+        return EINVAL;
+    }
+
+    if (arguments.watcher_placement.set_cpus ||
+        arguments.watcher_placement.set_mempolicy)
+    {
+        /* The processes keep the placement the watcher was started with */
+        if (!arguments.placement.set_cpus) {
+            if (sched_getaffinity(0, sizeof(cpu_set_t),
+                                  &arguments.placement.cpus) != 0)
+            {
+                fprintf(stderr, "Could not get the CPU affinity: %s\n",
+                        strerror(errno));
+                return EINVAL;
+            }
+            arguments.placement.set_cpus = true;
+        }
+
+        if (arguments.watcher_placement.set_mempolicy &&
+            !arguments.placement.set_mempolicy)
+        {
+            if (syscall(SYS_get_mempolicy, &arguments.placement.mempolicy,
+                        arguments.placement.nodes, WATCHER_MAX_NODES + 1,
+                        NULL, 0) != 0)
+            {
+                fprintf(stderr, "Could not get the memory policy: %s\n",
+                        strerror(errno));
+                return EINVAL;
+            }
+            arguments.placement.set_mempolicy = true;
+        }
+
+        if (watcher_placement_apply(&arguments.watcher_placement, -1) != 0) {
+            fprintf(stderr, "Could not place the watcher: %s\n",
+                    strerror(errno));
+            return EINVAL;
+        }
+    }
+
+    if (arguments.placement.set_cpus || arguments.placement.set_mempolicy ||
+        arguments.placement.set_policy || arguments.placement.set_nice ||
+        arguments.placement.set_ioprio || arguments.placement.spread)
+    {
+        settings.placement = &arguments.placement;
+    }
+
+    settings.timeout = arguments.timeout;
+    settings.use_heartbeat = arguments.heartbeat;
+    settings.grace = arguments.grace;
+    settings.cgroup_parent = arguments.cgroup_parent;
+    settings.memory_max = arguments.memory_max;
+    settings.cpu_max = arguments.cpu_max;
+    settings.spawn = arguments.spawn;
+    settings.capture_size = (size_t)arguments.capture_kib * 1024;
+    settings.log_file = arguments.log_file;
+    settings.sample_file = arguments.sample_file;
+    settings.sample_window = arguments.sample_window;
+    settings.inactivity = arguments.inactivity;
+    settings.pressure = arguments.pressure;
+    settings.npressure = arguments.npressure;
+    settings.pressure_action = arguments.pressure_action;
+
+    stats_file = arguments.stats_file;
+    event_backend = arguments.backend;
+
+    if (arguments.timeline_file != NULL &&
+        watcher_timeline_open(arguments.timeline_file,
+                              arguments.timeline_interval) != 0)
+    {
+        return EINVAL;
+    }
+
+    if (arguments.daemon != NULL) {
+        rc = watch_daemon(arguments.daemon, arguments.max_jobs, &settings);
+    } else if (arguments.batch != NULL) {
+        rc = watch_batch(arguments.batch, arguments.max_jobs, arguments.env,
+                         arguments.envc, &settings);
+    } else if (arguments.multi) {
+        rc = watch_multiple_processes(arguments.argv, arguments.argc,
+                                      arguments.env, arguments.envc,
+                                      &settings);
+    } else {
+        rc = watch_process(arguments.argv, arguments.env, &settings);
+    }
 #else
     /* If argp is not available, always use default timeout of 5 minutes */
-    rc = watch_process(&argv[1], NULL, 300000);
+    rc = watch_process(&argv[1], NULL, &settings);
 #endif
 
-    if (ctx != NULL) {
-        free(ctx);
-        ctx = NULL;
+    if (stats_file != NULL) {
+        watcher_stats_write(stats_file, 0);
+    }
+
+    watcher_timeline_close();
+    watcher_ctx_free();
+
+    if (settings.accounting != NULL) {
+        fclose(settings.accounting);
     }
+    free(arguments.env);
+    free(arguments.accounting_file);
+    free(arguments.cgroup_parent);
+    free(arguments.memory_max);
+    free(arguments.cpu_max);
+    free(arguments.log_file);
 
 end:
     return rc;
@@ -21,28 +21,129 @@
  * MA 02111-1307, USA.
  */
 
+#include <sched.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "heartbeat.h"
+#include "libwatcher.h"
 
 #define WATCHER_TIMEOUT_DEFAULT -1
 
-enum watcher_exit_e {
-    WATCHER_SUCCESS,
-    WATCHER_TIMEOUT,
-    WATCHER_CLEANUP_FAILED,
-    WATCHER_SIGTERM_SETUP_FAILED,
-    WATCHER_SIGTERM_HANDLER_FAILED,
-    WATCHER_SIGUSR1_SETUP_FAILED,
-    WATCHER_SIGUSR1_HANDLER_FAILED,
-    WATCHER_TIMESTAMP_FAILED,
-    WATCHER_OOM,
-    WATCHER_CANNOT_KILL,
-    WATCHER_CANNOT_WAIT,
-    WATCHER_COMMAND_TOO_LONG,
-    WATCHER_EXEC_FAILED,
-    WATCHER_ENV_TOO_LONG,
-    WATCHER_COMMAND_CORE_DUMP,
-    WATCHER_COMMAND_RETURNED_NON_ZERO,
+#ifdef HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#else
+#define MPOL_DEFAULT 0
+#define MPOL_BIND 2
+#endif
+
+/* From linux/ioprio.h, which not all distributions ship */
+#define WATCHER_IOPRIO_WHO_PROCESS 1
+#define WATCHER_IOPRIO_CLASS_SHIFT 13
+#define WATCHER_IOPRIO_VALUE(class, level) \
+    (((class) << WATCHER_IOPRIO_CLASS_SHIFT) | (level))
+
+enum watcher_backend_e {
+    /* poll() on the pidfds and output pipes of the jobs */
+    WATCHER_BACKEND_POLL,
+    /* io_uring, or poll() if not available */
+    WATCHER_BACKEND_IO_URING,
+};
+
+/* Daemon protocol.  A client sends a struct watcher_request_st followed by
+ * size bytes holding argc NUL-terminated arguments and then envc
+ * NUL-terminated environment variables.  For each request, the daemon sends
+ * back the JSON accounting record of the job in a single line once the job
+ * finishes.  Records are sent in the order the jobs finish and carry the id of
+ * the request. */
+#define WATCHER_REQUEST_MAGIC 0x48435457 /* "WTCH" */
+
+struct watcher_request_st {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t size;
+    uint64_t id;
+    /* Timeout in ms; 0 to use the timeout of the daemon */
+    int64_t timeout;
+};
+
+enum watcher_histogram_e {
+    /* From the sigqueue() of a SIGUSR1 to the update of the timestamp */
+    WATCHER_HISTOGRAM_SIGUSR1,
+    /* From the start of the spawn until the command was executed */
+    WATCHER_HISTOGRAM_SPAWN,
+    /* From the time SIGKILL was due until the process was reaped */
+    WATCHER_HISTOGRAM_KILL,
+    /* Between two SIGUSR1 heartbeats of a process */
+    WATCHER_HISTOGRAM_HEARTBEAT,
+    WATCHER_HISTOGRAM_COUNT,
+};
+
+/* Durations with power of two buckets: bucket i counts the durations of at
+ * most 2^i microseconds, the last bucket counts all the others.  Updated with
+ * atomic operations only, so it can be used from signal handlers */
+#define WATCHER_HISTOGRAM_BUCKETS 32
+
+struct watcher_histogram_st {
+    const char *name;
+    const char *help;
+    uint64_t buckets[WATCHER_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_usecs;
+};
+
+/* Maximum number of NUMA nodes in a node mask */
+#define WATCHER_MAX_NODES 1024
+#define WATCHER_NODE_BITS (8 * sizeof(unsigned long))
+
+/* Where and how the processes run.  Set in the child before the command is
+ * executed, so posix_spawn() cannot be used */
+struct watcher_placement_st {
+    /* CPUs the processes may run on */
+    cpu_set_t cpus;
+    bool set_cpus;
+    /* Memory policy, MPOL_BIND on the nodes or MPOL_DEFAULT */
+    int mempolicy;
+    unsigned long nodes[WATCHER_MAX_NODES / WATCHER_NODE_BITS];
+    bool set_mempolicy;
+    /* Scheduling policy and its static priority */
+    int policy;
+    int priority;
+    bool set_policy;
+    int nice;
+    bool set_nice;
+    /* I/O priority as passed to ioprio_set() */
+    int ioprio;
+    bool set_ioprio;
+    /* Pin each job of a batch to a single CPU out of cpus, picking the CPU
+     * running the least jobs */
+    bool spread;
+};
+
+/* Maximum number of pressure triggers: some and full for each resource */
+#define WATCHER_PRESSURE_MAX 6
+
+/* A pressure stall information (PSI) trigger, which fires when the tasks
+ * stall on the resource for stall ms within window ms */
+struct watcher_pressure_st {
+    /* "memory", "io" or "cpu" */
+    const char *resource;
+    /* Count the time all the tasks stall instead of any of them */
+    bool full;
+    long stall;
+    long window;
+};
+
+enum watcher_pressure_action_e {
+    /* Kill the process as if it timed out */
+    WATCHER_PRESSURE_KILL,
+    /* Freeze the process for a window */
+    WATCHER_PRESSURE_THROTTLE,
 };
 
 struct timestamp_st {
@@ -50,8 +151,181 @@ struct timestamp_st {
     long seconds;
 };
 
-struct watcher_ctx {
-    pid_t pid;
+struct watcher_job {
+    /* The command and environment, set with watcher_job_marshal().  Both
+     * point into the arena, a single allocation which also holds the
+     * strings */
+    char **argv;
+    char **env;
+    size_t envc;
+    void *arena;
     long timeout;
+    /* Create a shared memory heartbeat channel for the process */
+    bool use_heartbeat;
+    /* Write a JSON accounting record here when the process finishes */
+    FILE *accounting;
+    /* Read the I/O counters of the process before reaping it, also done if
+     * accounting is set */
+    bool read_io;
+    /* How to start the process */
+    enum watcher_spawn_e spawn;
+    /* Capture stdout and stderr, keeping the last capture_size bytes to be
+     * dumped if the process times out or crashes; 0 to not capture */
+    size_t capture_size;
+    /* Also write the captured output to this file, or NULL */
+    const char *log_file;
+    /* Time in ms between SIGTERM and SIGKILL when the process times out */
+    long grace;
+    /* Run the process in its own cgroup v2 under this directory, or NULL */
+    const char *cgroup_parent;
+    /* Values for memory.max and cpu.max of the cgroup, or NULL */
+    const char *memory_max;
+    const char *cpu_max;
+    /* Append folded stacks of the process to this file for sample_window ms
+     * before killing it on timeout, or NULL */
+    const char *sample_file;
+    long sample_window;
+    /* Sample the activity of the process every inactivity ms, a change
+     * counting as a heartbeat, so the timeout only applies to inactivity; 0
+     * to not sample */
+    long inactivity;
+    /* Placement of the process, or NULL to inherit the one of the watcher */
+    const struct watcher_placement_st *placement;
+    /* Pin the process to this CPU instead of the CPUs of the placement */
+    bool pinned;
+    int cpu;
+    /* PSI triggers, on the cgroup of the process if it has one and
+     * system-wide otherwise, and what to do when one fires */
+    const struct watcher_pressure_st *pressure;
+    size_t npressure;
+    enum watcher_pressure_action_e pressure_action;
+    /* What failed when the process could not be started, set by
+     * watcher_job_spawn() */
+    const char *spawn_error;
+    /* Reported in the accounting record */
+    uint64_t id;
+    /* Daemon connection which submitted the job, or -1 */
+    int client_fd;
+
+    pid_t pid;
+    /* pidfd of the process or -1 if not supported */
+    int pidfd;
+    /* Time of the last heartbeat */
     struct timestamp_st ts;
+    /* Time of the last SIGUSR1 heartbeat in microseconds.  Only the signal
+     * handler writes it, atomically; the loop folds it into ts */
+    long long signal_usecs;
+    /* Deadline in milliseconds used as the heap key */
+    long long deadline;
+    /* Time the timeout expired in microseconds */
+    long long expired_usecs;
+    size_t heap_index;
+    bool running;
+    /* The process timed out */
+    bool timed_out;
+    /* SIGTERM was sent and the grace period is running */
+    bool terminating;
+    /* SIGKILL was sent */
+    bool killed;
+    /* The process stalled on a resource and was killed */
+    bool stalled;
+    /* The process is frozen by the pressure policy until thaw_msecs */
+    bool throttled;
+    long long thaw_msecs;
+    unsigned int throttles;
+    /* Descriptors of /proc/<pid>/stat, schedstat and io and of cpu.stat of
+     * the cgroup of the process, kept open between samples, or -1 */
+    int stat_fd;
+    int schedstat_fd;
+    int io_fd;
+    int cpu_stat_fd;
+    /* Sum of the activity counters at the last sample */
+    unsigned long long activity;
+    /* The PSI triggers on the cgroup of the process, or -1 */
+    int pressure_fds[WATCHER_PRESSURE_MAX];
+    /* The process sampler, or -1 */
+    pid_t sampler_pid;
+    /* The process was sampled before it was killed */
+    bool sampled;
+    /* Read end of the pipe connected to stdout and stderr */
+    int output_fd;
+    int output_write_fd;
+    /* In-memory ring buffer holding the tail of the output */
+    int ring_fd;
+    int log_fd;
+    /* Total number of bytes captured */
+    unsigned long long output_len;
+    /* The cgroup of the process */
+    char *cgroup_path;
+    int cgroup_fd;
+    int cgroup_procs_fd;
+    /* The process may have changed state */
+    bool ready;
+    /* Shared memory heartbeat channel, or NULL if not used */
+    struct watcher_heartbeat_st *heartbeat;
+    int heartbeat_fd;
+    /* Last heartbeat counter seen by the watcher */
+    uint64_t heartbeat_count;
+    /* Appended to the environment to pass the heartbeat file descriptor */
+    char heartbeat_var[sizeof(WATCHER_HEARTBEAT_ENV) + 16];
+    int status;
+    /* The status is valid, i.e. the process was reaped */
+    bool reaped;
+    int result;
+    /* Time the process was started */
+    struct timestamp_st start;
+    struct watcher_usage_st usage;
 };
+
+struct watcher_uring_st;
+
+struct watcher_ctx {
+    struct watcher_job *jobs;
+    size_t njobs;
+    size_t running;
+    /* Running jobs ordered by deadline */
+    struct watcher_job **heap;
+    size_t heap_len;
+    struct pollfd *pfds;
+    struct watcher_job **pfd_jobs;
+    size_t pfds_size;
+    /* Used instead of poll() if not NULL */
+    struct watcher_uring_st *uring;
+    /* The PSI triggers of the jobs, or NULL if they use none */
+    const struct watcher_pressure_st *pressure;
+    size_t npressure;
+    /* The system-wide triggers for the jobs without a cgroup, or -1 */
+    int pressure_fds[WATCHER_PRESSURE_MAX];
+    /* The additional descriptors and the PSI triggers polled in a step */
+    struct pollfd *step_pfds;
+    size_t step_pfds_size;
+};
+
+/* Shared by the watcher and libwatcher, see libwatcher.c.  Not exported by the
+ * shared library */
+#pragma GCC visibility push(hidden)
+
+int watcher_timestamp(struct timestamp_st *ts);
+long long watcher_timestamp_msecs(struct timestamp_st *ts);
+long long watcher_timestamp_usecs(struct timestamp_st *ts);
+pid_t watcher_job_wait(struct watcher_job *job, int *status, int options);
+void watcher_accounting_write(const struct watcher_job *job, FILE *file,
+                              int watcher_exit, int status, bool reaped);
+char *watcher_cgroup_self(void);
+int watcher_cgroup_prepare(const char *parent, bool memory, bool cpu);
+int watcher_cgroup_cleanup(struct watcher_job *job);
+int watcher_job_signal(struct watcher_job *job, int signo);
+int watcher_job_freeze(struct watcher_job *job, bool frozen);
+int watcher_job_marshal(struct watcher_job *job, char **argv, size_t argc,
+                        char **env, size_t envc);
+void watcher_heartbeat_cleanup(struct watcher_job *job);
+bool watcher_heartbeat_changed(struct watcher_job *job);
+void watcher_capture_drain(struct watcher_job *job);
+void watcher_capture_cleanup(struct watcher_job *job);
+int watcher_parse_list(const char *list, unsigned long *mask, size_t nbits);
+int watcher_parse_cpus(const char *list, cpu_set_t *cpus);
+int watcher_placement_apply(const struct watcher_placement_st *p, int cpu);
+int watcher_job_spawn(struct watcher_job *job);
+void watcher_job_init(struct watcher_job *job);
+
+#pragma GCC visibility pop